@@ -0,0 +1,218 @@
+// Performance summary of a filter instance
+//
+// Aggregate counters are updated with relaxed atomics over the lifetime of an
+// instance, and reported when the instance is freed through `logMessage()`
+// and, if a path is given by the `perf` parameter, as one line of JSON
+// appended to the file, so that runs can be compared over time.
+//
+// Latency of a frame is the time spent in computing it, and its percentiles
+// are estimated from a histogram with 4 buckets per octave, i.e. within 19%.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+
+#include <VapourSynth4.h>
+
+class PerfSummary {
+public:
+    static constexpr int max_stages = 4;
+    static constexpr int max_caches = 4;
+
+    using clock = std::chrono::steady_clock;
+
+    static int64_t elapsed_ns(clock::time_point start) noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+
+    void add_frame(int64_t latency_ns) noexcept {
+        num_frames.fetch_add(1, std::memory_order_relaxed);
+        total_ns.fetch_add(latency_ns, std::memory_order_relaxed);
+        histogram[bucket(latency_ns)].fetch_add(1, std::memory_order_relaxed);
+        update_max(max_ns, latency_ns);
+    }
+
+    void add_stage(int stage, int64_t ns) noexcept {
+        stage_ns[stage].fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    // time blocked on resources of the filter
+    void add_wait(int64_t ns) noexcept {
+        wait_ns.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    // `bytes` is the size of the cached data, which is counted as saved on hits
+    void add_cache(int cache, bool hit, int64_t bytes = 0) noexcept {
+        (hit ? cache_hits : cache_misses)[cache].fetch_add(1, std::memory_order_relaxed);
+        if (hit) {
+            cache_bytes_saved[cache].fetch_add(bytes, std::memory_order_relaxed);
+        }
+    }
+
+    // buffer memory allocated (or freed, if negative) by the filter
+    void add_memory(int64_t bytes) noexcept {
+        auto current = memory.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        update_max(peak_memory, current);
+    }
+
+    // `stages` and `caches` name the indices used in `add_stage()` and `add_cache()`,
+    // caches that are never accessed are not reported
+    void report(
+        const char * filter_name,
+        std::initializer_list<const char *> stages,
+        std::initializer_list<const char *> caches,
+        const std::string & path,
+        VSCore * core, const VSAPI * vsapi
+    ) const {
+
+        const int64_t frames = num_frames.load();
+        if (frames == 0) {
+            return;
+        }
+
+        const auto ms = [](double ns) {
+            char buffer[32];
+            std::snprintf(buffer, sizeof(buffer), "%.2f", ns * 1e-6);
+            return std::string { buffer };
+        };
+        const auto s = [](double ns) {
+            char buffer[32];
+            std::snprintf(buffer, sizeof(buffer), "%.3f", ns * 1e-9);
+            return std::string { buffer };
+        };
+
+        const int64_t total = total_ns.load();
+        int64_t total_stages {};
+        for (int i = 0; i < static_cast<int>(stages.size()); ++i) {
+            total_stages += stage_ns[i].load();
+        }
+
+        std::string message = (
+            std::string { filter_name } + ": " + std::to_string(frames) + " frames in " +
+            s(total) + " s, per frame " + ms(static_cast<double>(total) / frames) + " ms (p50 " +
+            ms(percentile(0.5)) + ", p90 " + ms(percentile(0.9)) + ", p99 " +
+            ms(percentile(0.99)) + ", max " + ms(max_ns.load()) + ")");
+        std::string json = (
+            "{\"filter\": \"" + std::string { filter_name } + "\", \"time\": " +
+            std::to_string(std::time(nullptr)) + ", \"frames\": " + std::to_string(frames) +
+            ", \"total_s\": " + s(total) +
+            ", \"mean_ms\": " + ms(static_cast<double>(total) / frames) +
+            ", \"p50_ms\": " + ms(percentile(0.5)) + ", \"p90_ms\": " + ms(percentile(0.9)) +
+            ", \"p99_ms\": " + ms(percentile(0.99)) + ", \"max_ms\": " + ms(max_ns.load()) +
+            ", \"stages_s\": {");
+
+        int stage = 0;
+        for (const auto & name : stages) {
+            const int64_t ns = stage_ns[stage].load();
+            message += (stage == 0 ? "; " : ", ") + std::string { name } + " " +
+                std::to_string(total_stages > 0 ? 100 * ns / total_stages : 0) + "%";
+            json += (stage == 0 ? "\"" : ", \"") + std::string { name } + "\": " + s(ns);
+            ++stage;
+        }
+        json += "}, \"wait_s\": " + s(wait_ns.load()) +
+            ", \"peak_memory_bytes\": " + std::to_string(peak_memory.load()) + ", \"caches\": {";
+
+        if (const int64_t wait = wait_ns.load(); wait >= 1000000) {
+            message += "; waited " + s(wait) + " s";
+        }
+        if (const int64_t peak = peak_memory.load(); peak > 0) {
+            char buffer[32];
+            std::snprintf(buffer, sizeof(buffer), "%.1f", peak / 1048576.0);
+            message += "; peak buffer memory " + std::string { buffer } + " MiB";
+        }
+
+        int cache = 0;
+        bool first = true;
+        for (const auto & name : caches) {
+            const int64_t hits = cache_hits[cache].load();
+            const int64_t accesses = hits + cache_misses[cache].load();
+            const int64_t bytes_saved = cache_bytes_saved[cache].load();
+            ++cache;
+            if (accesses == 0) {
+                continue;
+            }
+            message += "; " + std::string { name } + " cache hit " + std::to_string(hits) +
+                " of " + std::to_string(accesses) + " (" + std::to_string(100 * hits / accesses) + "%)";
+            if (bytes_saved > 0) {
+                char buffer[32];
+                std::snprintf(buffer, sizeof(buffer), "%.1f", bytes_saved / 1048576.0);
+                message += ", " + std::string { buffer } + " MiB saved";
+            }
+            json += (first ? "\"" : ", \"") + std::string { name } + "\": {\"hits\": " +
+                std::to_string(hits) + ", \"accesses\": " + std::to_string(accesses) +
+                ", \"bytes_saved\": " + std::to_string(bytes_saved) + "}";
+            first = false;
+        }
+        json += "}}\n";
+
+        vsapi->logMessage(mtInformation, message.c_str(), core);
+
+        if (!path.empty()) {
+            // shared by all instances of the plugin
+            static std::mutex file_lock;
+            std::lock_guard _ { file_lock };
+            if (FILE * file = std::fopen(path.c_str(), "a"); file) {
+                std::fputs(json.c_str(), file);
+                std::fclose(file);
+            } else {
+                message = std::string { filter_name } + ": failed to open \"" + path + "\"";
+                vsapi->logMessage(mtWarning, message.c_str(), core);
+            }
+        }
+    }
+
+private:
+    // 4 buckets per octave starting from 1 us, bucket 0 holds shorter latencies
+    static constexpr int num_buckets = 128;
+
+    static int bucket(int64_t ns) noexcept {
+        if (ns < 1000) {
+            return 0;
+        }
+        return std::min(1 + static_cast<int>(4.0 * std::log2(ns * 1e-3)), num_buckets - 1);
+    }
+
+    // upper bound of the latency of bucket `i`
+    static double bucket_limit(int i) noexcept {
+        return 1e3 * std::exp2(i / 4.0);
+    }
+
+    static void update_max(std::atomic<int64_t> & maximum, int64_t value) noexcept {
+        auto current = maximum.load(std::memory_order_relaxed);
+        while (current < value &&
+            !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+    }
+
+    double percentile(double p) const noexcept {
+        const int64_t frames = num_frames.load();
+        const auto rank = static_cast<int64_t>(std::ceil(p * frames));
+        int64_t count {};
+        for (int i = 0; i < num_buckets; ++i) {
+            count += histogram[i].load();
+            if (count >= rank) {
+                return std::min(bucket_limit(i), static_cast<double>(max_ns.load()));
+            }
+        }
+        return static_cast<double>(max_ns.load());
+    }
+
+    std::atomic<int64_t> num_frames {};
+    std::atomic<int64_t> total_ns {};
+    std::atomic<int64_t> max_ns {};
+    std::array<std::atomic<int64_t>, num_buckets> histogram {};
+    std::array<std::atomic<int64_t>, max_stages> stage_ns {};
+    std::atomic<int64_t> wait_ns {};
+    std::array<std::atomic<int64_t>, max_caches> cache_hits {};
+    std::array<std::atomic<int64_t>, max_caches> cache_misses {};
+    std::array<std::atomic<int64_t>, max_caches> cache_bytes_saved {};
+    std::atomic<int64_t> memory {};
+    std::atomic<int64_t> peak_memory {};
+};
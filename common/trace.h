@@ -0,0 +1,204 @@
+// Request trace of the BM3D plugins
+//
+// Activations of `BM3DGetFrame()` and `VAggregateGetFrame()` are recorded to
+// a compact binary file, which is shared by all filter instances with the
+// same `trace` path. The trace is analyzed offline by `tools/bm3d_trace.py`.
+//
+// Layout (little-endian): a 16-byte header of the magic "BM3DTRC", a zero
+// byte, the version and the size of a record (uint32), followed by records
+// of `trace_record_size` bytes. Each instance is described by an instance
+// record before its first activation record.
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+static constexpr uint32_t trace_version = 1;
+static constexpr uint32_t trace_record_size = 40;
+
+enum class TraceRecordType : uint8_t { instance = 0, activation = 1 };
+
+enum class TraceFilter : uint8_t { bm3d = 0, vaggregate = 1 };
+
+struct TraceInstanceRecord {
+    TraceRecordType type;
+    TraceFilter filter;
+    uint16_t reserved;
+    uint32_t instance;
+    int32_t num_frames;
+    int32_t radius;
+    int32_t width;
+    int32_t height;
+    int32_t num_threads; // of the core
+    int32_t num_resources; // limit of frames processed concurrently, 0 if unlimited
+    int32_t reserved2[2];
+};
+
+struct TraceActivationRecord {
+    TraceRecordType type;
+    int8_t reason; // activation reason
+    uint16_t thread; // index of the thread in order of appearance
+    uint32_t instance;
+    int32_t n;
+    uint32_t reserved;
+    uint64_t start_ns; // since the creation of the trace
+    uint64_t duration_ns;
+    uint64_t wait_ns; // time blocked on resources of the filter
+};
+
+static_assert(sizeof(TraceInstanceRecord) == trace_record_size);
+static_assert(sizeof(TraceActivationRecord) == trace_record_size);
+
+class TraceFile {
+public:
+    TraceFile(const TraceFile &) = delete;
+    TraceFile & operator=(const TraceFile &) = delete;
+
+    ~TraceFile() {
+        flush();
+        std::fclose(file);
+    }
+
+    // returns the trace of `path`, which is created if not opened yet,
+    // or sets `error` on failure
+    static std::shared_ptr<TraceFile> open(const std::string & path, std::string & error) {
+        static std::mutex registry_lock;
+        static std::map<std::string, std::weak_ptr<TraceFile>> registry;
+
+        std::lock_guard _ { registry_lock };
+
+        if (auto trace = registry[path].lock()) {
+            return trace;
+        }
+
+        FILE * file = std::fopen(path.c_str(), "wb");
+        if (file == nullptr) {
+            error = "failed to create trace file \"" + path + "\"";
+            return nullptr;
+        }
+
+        std::array<char, 8> magic { 'B', 'M', '3', 'D', 'T', 'R', 'C', '\0' };
+        std::array<uint32_t, 2> header { trace_version, trace_record_size };
+        std::fwrite(magic.data(), sizeof(magic), 1, file);
+        std::fwrite(header.data(), sizeof(header), 1, file);
+
+        std::shared_ptr<TraceFile> trace { new TraceFile(file) };
+        registry[path] = trace;
+        return trace;
+    }
+
+    // returns the id of a new instance
+    uint32_t add_instance(
+        TraceFilter filter, int num_frames, int radius, int width, int height,
+        int num_threads, int num_resources
+    ) {
+        TraceInstanceRecord record {};
+        record.type = TraceRecordType::instance;
+        record.filter = filter;
+        record.num_frames = num_frames;
+        record.radius = radius;
+        record.width = width;
+        record.height = height;
+        record.num_threads = num_threads;
+        record.num_resources = num_resources;
+
+        std::lock_guard _ { lock };
+        record.instance = num_instances++;
+        append(&record);
+        return record.instance;
+    }
+
+    void add_activation(
+        uint32_t instance, int n, int reason,
+        std::chrono::steady_clock::time_point start, int64_t wait_ns
+    ) {
+        const auto end = std::chrono::steady_clock::now();
+
+        TraceActivationRecord record {};
+        record.type = TraceRecordType::activation;
+        record.reason = static_cast<int8_t>(reason);
+        record.instance = instance;
+        record.n = n;
+        record.start_ns = to_ns(start - creation);
+        record.duration_ns = to_ns(end - start);
+        record.wait_ns = static_cast<uint64_t>(wait_ns);
+
+        const auto thread_id = std::this_thread::get_id();
+
+        std::lock_guard _ { lock };
+        auto it = threads.emplace(thread_id, static_cast<uint16_t>(threads.size())).first;
+        record.thread = it->second;
+        append(&record);
+    }
+
+private:
+    explicit TraceFile(FILE * file) : file(file), creation(std::chrono::steady_clock::now()) {}
+
+    static uint64_t to_ns(std::chrono::steady_clock::duration duration) noexcept {
+        return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+    }
+
+    // requires `lock`
+    void append(const void * record) {
+        const auto bytes = static_cast<const unsigned char *>(record);
+        buffer.insert(buffer.end(), bytes, bytes + trace_record_size);
+        if (buffer.size() >= 4096 * trace_record_size) {
+            flush();
+        }
+    }
+
+    void flush() {
+        std::fwrite(buffer.data(), 1, buffer.size(), file);
+        buffer.clear();
+    }
+
+    std::mutex lock;
+    FILE * file;
+    const std::chrono::steady_clock::time_point creation;
+    std::vector<unsigned char> buffer;
+    uint32_t num_instances {};
+    std::unordered_map<std::thread::id, uint16_t> threads;
+};
+
+// Records an activation of a filter when going out of scope.
+// Does nothing if `trace` is null.
+class TraceScope {
+public:
+    TraceScope(TraceFile * trace, uint32_t instance, int n, int reason)
+        : trace(trace), instance(instance), n(n), reason(reason),
+          start(std::chrono::steady_clock::now()) {}
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope & operator=(const TraceScope &) = delete;
+
+    ~TraceScope() {
+        if (trace) {
+            trace->add_activation(instance, n, reason, start, wait_ns);
+        }
+    }
+
+    // accounts the time since `wait_start` as waiting on resources
+    void add_wait(std::chrono::steady_clock::time_point wait_start) noexcept {
+        if (trace) {
+            wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - wait_start).count();
+        }
+    }
+
+private:
+    TraceFile * trace;
+    uint32_t instance;
+    int n;
+    int reason;
+    std::chrono::steady_clock::time_point start;
+    int64_t wait_ns {};
+};
@@ -0,0 +1,157 @@
+// Plugin-wide store of per-frame artifacts
+//
+// Data derived from input frames, e.g. the Y plane of the opponent color space
+// of RGB input used in block-matching, is shared by all filter instances and
+// all requests of a filter instance (e.g. the 2 * radius + 1 requests of V-BM3D
+// that read the same input frame).
+//
+// Artifacts are addressed by the identity of the input frame, which is pinned
+// by a reference held by the store, together with the plane, the type and
+// the parameters of the artifact. Frames of the same node returned by the
+// frame cache of VapourSynth are the same object. Artifacts are reference
+// counted, and the least recently used ones are dropped from the store when
+// the total size exceeds the budget, which is the largest one requested by
+// filter instances alive.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <VapourSynth4.h>
+#include <VSHelper4.h>
+
+enum class ArtifactType : int { opp_luma = 0 };
+
+struct ArtifactKey {
+    const VSFrame * frame;
+    int plane;
+    ArtifactType type;
+    int64_t params;
+
+    bool operator==(const ArtifactKey & other) const noexcept {
+        return (
+            frame == other.frame && plane == other.plane &&
+            type == other.type && params == other.params);
+    }
+};
+
+struct ArtifactKeyHash {
+    size_t operator()(const ArtifactKey & key) const noexcept {
+        size_t h = std::hash<const VSFrame *>{}(key.frame);
+        h ^= std::hash<int64_t>{}(
+            (key.params * 31 + static_cast<int>(key.type)) * 31 + key.plane
+        ) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+        return h;
+    }
+};
+
+class ArtifactStore {
+public:
+    ArtifactStore(const ArtifactStore &) = delete;
+    ArtifactStore & operator=(const ArtifactStore &) = delete;
+
+    static ArtifactStore & get() {
+        static ArtifactStore store;
+        return store;
+    }
+
+    // called on creation of a filter instance using the store
+    void attach(size_t budget) {
+        std::lock_guard _ { lock };
+        budgets.push_back(budget);
+        this->budget = std::max(this->budget, budget);
+    }
+
+    // called when a filter instance using the store is freed,
+    // artifacts are dropped with the last one
+    void detach(size_t budget, const VSAPI * vsapi) {
+        std::lock_guard _ { lock };
+        budgets.erase(std::find(budgets.begin(), budgets.end(), budget));
+        this->budget = budgets.empty() ? 0 : *std::max_element(budgets.begin(), budgets.end());
+        if (budgets.empty()) {
+            while (!lru.empty()) {
+                evict(vsapi);
+            }
+        } else {
+            shrink(vsapi);
+        }
+    }
+
+    // returns the artifact of `key` of `size` bytes,
+    // which is computed by `compute(float * dstp)` if not stored
+    template <typename F>
+    std::shared_ptr<const float> acquire(
+        const ArtifactKey & key, size_t size, F && compute, const VSAPI * vsapi, bool & hit
+    ) {
+        {
+            std::lock_guard _ { lock };
+            if (auto it = entries.find(key); it != entries.end()) {
+                lru.splice(lru.begin(), lru, it->second.position);
+                hit = true;
+                return it->second.data;
+            }
+        }
+
+        hit = false;
+
+        // computed outside of the lock, concurrent misses of the same key
+        // compute the artifact redundantly
+        std::shared_ptr<float> data {
+            vsh::vsh_aligned_malloc<float>(size, 32),
+            [](float * p) { vsh::vsh_aligned_free(p); }
+        };
+        compute(data.get());
+
+        std::lock_guard _ { lock };
+        if (size > budget || entries.count(key)) {
+            return data;
+        }
+
+        vsapi->addFrameRef(key.frame);
+        lru.push_front(key);
+        entries.emplace(key, Entry { data, size, lru.begin() });
+        used += size;
+        shrink(vsapi);
+
+        return data;
+    }
+
+private:
+    ArtifactStore() = default;
+
+    struct Entry {
+        std::shared_ptr<float> data;
+        size_t size;
+        std::list<ArtifactKey>::iterator position;
+    };
+
+    // requires `lock`
+    void evict(const VSAPI * vsapi) {
+        const ArtifactKey key = lru.back();
+        auto it = entries.find(key);
+        used -= it->second.size;
+        entries.erase(it); // the artifact is kept alive by its users
+        lru.pop_back();
+        vsapi->freeFrame(key.frame);
+    }
+
+    // requires `lock`
+    void shrink(const VSAPI * vsapi) {
+        while (used > budget && !lru.empty()) {
+            evict(vsapi);
+        }
+    }
+
+    std::mutex lock;
+    std::unordered_map<ArtifactKey, Entry, ArtifactKeyHash> entries;
+    std::list<ArtifactKey> lru; // most recently used first
+    std::vector<size_t> budgets; // of filter instances alive
+    size_t budget {};
+    size_t used {};
+};
@@ -42,3 +42,16 @@ static inline int cpu_supports_avx2() {
 	}
 	return 1;
 }
+
+static inline int cpu_supports_avx512() {
+	if (!cpu_supports_avx2())
+		return 0;
+
+	uint64_t xedxeax = cpu_xgetbv(0);
+	if ((xedxeax & 0xE6) != 0xE6)
+		return 0; // no support for avx-512 states
+
+	int regs[4] = {0};
+	cpu_cpuid(7, regs);
+	return (regs[1] & (1 << 16)) && (regs[1] & (1 << 31)); // avx512f, avx512vl
+}
@@ -0,0 +1,622 @@
+// Thin client of a long-lived denoising server
+//
+// A `bm3d_server` process (see "server.cpp") owns a VapourSynth core, filter
+// instances of an engine and their buffers and caches, e.g. per-thread buffers
+// of the `cpu` version, compiled kernels of the `_rtc` version and the
+// plugin-wide `ArtifactStore`, which are reused by successive short jobs
+// instead of being set up again by each process.
+//
+// A client holds a pool of connections to the Unix domain socket of the
+// server, each carrying one request at a time. Every connection owns a shared
+// memory segment holding the input frames of a request followed by its output
+// frame, whose file descriptor is passed to the server in the handshake.
+// Messages on the socket are prefixed by their size, and only carry arguments,
+// frame numbers and frame properties.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SIGPIPE is disabled by SO_NOSIGPIPE instead
+#endif
+#endif
+
+#include <VapourSynth4.h>
+#include <VSHelper4.h>
+
+namespace remote {
+
+constexpr uint32_t protocol_magic = 0x44334d42; // "BM3D"
+constexpr uint32_t protocol_version = 1;
+
+// upper bound of the size of a message, frames are passed in shared memory
+constexpr uint32_t max_message_size = 1 << 24;
+
+// roles of input frames of a request
+enum FrameRole : uint8_t { role_clip = 0, role_ref = 1 };
+
+class Writer {
+public:
+    template <typename T>
+    void put(T value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        put_bytes(&value, sizeof(T));
+    }
+
+    void put_bytes(const void * data, size_t size) {
+        auto bytes = static_cast<const uint8_t *>(data);
+        buffer.insert(buffer.end(), bytes, bytes + size);
+    }
+
+    void put_string(const std::string & s) {
+        put<uint32_t>(static_cast<uint32_t>(s.size()));
+        put_bytes(s.data(), s.size());
+    }
+
+    std::vector<uint8_t> buffer;
+};
+
+// reads of truncated messages return zeros and clear `ok`
+class Reader {
+public:
+    explicit Reader(const std::vector<uint8_t> & buffer) noexcept
+        : data { buffer.data() }, size { buffer.size() } {}
+
+    template <typename T>
+    T get() noexcept {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value {};
+        get_bytes(&value, sizeof(T));
+        return value;
+    }
+
+    void get_bytes(void * dst, size_t count) noexcept {
+        if (!ok || size - position < count) {
+            ok = false;
+            return;
+        }
+        std::memcpy(dst, data + position, count);
+        position += count;
+    }
+
+    std::string get_string() {
+        auto length = get<uint32_t>();
+        if (!ok || size - position < length) {
+            ok = false;
+            return {};
+        }
+        std::string s { reinterpret_cast<const char *>(data + position), length };
+        position += length;
+        return s;
+    }
+
+    const uint8_t * data;
+    size_t size;
+    size_t position {};
+    bool ok { true };
+};
+
+// properties of type int, float and data of `map`,
+// others (nodes, frames and functions) and `excluded` keys are skipped
+static inline void write_map(
+    Writer & writer, const VSMap * map, const VSAPI * vsapi,
+    std::initializer_list<const char *> excluded = {}
+) {
+
+    std::vector<const char *> keys;
+    for (int i = 0; i < vsapi->mapNumKeys(map); ++i) {
+        const char * key = vsapi->mapGetKey(map, i);
+        const int type = vsapi->mapGetType(map, key);
+        bool skip = type != ptInt && type != ptFloat && type != ptData;
+        for (const auto & excluded_key : excluded) {
+            skip |= std::strcmp(key, excluded_key) == 0;
+        }
+        if (!skip) {
+            keys.push_back(key);
+        }
+    }
+
+    writer.put<uint32_t>(static_cast<uint32_t>(keys.size()));
+    for (const auto & key : keys) {
+        const int type = vsapi->mapGetType(map, key);
+        const int num_elements = vsapi->mapNumElements(map, key);
+        writer.put_string(key);
+        writer.put<uint8_t>(static_cast<uint8_t>(type));
+        writer.put<uint32_t>(static_cast<uint32_t>(num_elements));
+        for (int i = 0; i < num_elements; ++i) {
+            if (type == ptInt) {
+                writer.put<int64_t>(vsapi->mapGetInt(map, key, i, nullptr));
+            } else if (type == ptFloat) {
+                writer.put<double>(vsapi->mapGetFloat(map, key, i, nullptr));
+            } else {
+                writer.put<int8_t>(static_cast<int8_t>(vsapi->mapGetDataTypeHint(map, key, i, nullptr)));
+                writer.put_string({
+                    vsapi->mapGetData(map, key, i, nullptr),
+                    static_cast<size_t>(vsapi->mapGetDataSize(map, key, i, nullptr))
+                });
+            }
+        }
+    }
+}
+
+// properties of `map` with the same keys are replaced
+static inline bool read_map(Reader & reader, VSMap * map, const VSAPI * vsapi) {
+    const auto num_keys = reader.get<uint32_t>();
+    for (uint32_t i = 0; i < num_keys && reader.ok; ++i) {
+        const auto key = reader.get_string();
+        const auto type = reader.get<uint8_t>();
+        const auto num_elements = reader.get<uint32_t>();
+        if (!reader.ok || (type != ptInt && type != ptFloat && type != ptData)) {
+            return false;
+        }
+        vsapi->mapDeleteKey(map, key.c_str());
+        for (uint32_t j = 0; j < num_elements && reader.ok; ++j) {
+            if (type == ptInt) {
+                vsapi->mapSetInt(map, key.c_str(), reader.get<int64_t>(), maAppend);
+            } else if (type == ptFloat) {
+                vsapi->mapSetFloat(map, key.c_str(), reader.get<double>(), maAppend);
+            } else {
+                const auto hint = reader.get<int8_t>();
+                const auto data = reader.get_string();
+                vsapi->mapSetData(
+                    map, key.c_str(), data.data(), static_cast<int>(data.size()), hint, maAppend);
+            }
+        }
+    }
+    return reader.ok;
+}
+
+static inline void write_video_info(Writer & writer, const VSVideoInfo & vi, VSCore * core, const VSAPI * vsapi) {
+    const auto & format = vi.format;
+    writer.put<uint32_t>(vsapi->queryVideoFormatID(
+        format.colorFamily, format.sampleType, format.bitsPerSample,
+        format.subSamplingW, format.subSamplingH, core));
+    writer.put<int32_t>(vi.width);
+    writer.put<int32_t>(vi.height);
+}
+
+static inline bool read_video_info(Reader & reader, VSVideoInfo & vi, VSCore * core, const VSAPI * vsapi) {
+    const auto id = reader.get<uint32_t>();
+    vi.width = reader.get<int32_t>();
+    vi.height = reader.get<int32_t>();
+    return (
+        reader.ok && vsapi->getVideoFormatByID(&vi.format, id, core) &&
+        vi.width > 0 && vi.height > 0);
+}
+
+// size of a frame packed without padding
+static inline size_t packed_frame_size(const VSVideoFormat & format, int width, int height) noexcept {
+    size_t size = 0;
+    for (int plane = 0; plane < format.numPlanes; ++plane) {
+        const int plane_width = plane > 0 ? width >> format.subSamplingW : width;
+        const int plane_height = plane > 0 ? height >> format.subSamplingH : height;
+        size += static_cast<size_t>(plane_width) * plane_height * format.bytesPerSample;
+    }
+    return size;
+}
+
+static inline void pack_frame(uint8_t * dstp, const VSFrame * frame, const VSAPI * vsapi) noexcept {
+    const auto * format = vsapi->getVideoFrameFormat(frame);
+    for (int plane = 0; plane < format->numPlanes; ++plane) {
+        const size_t row_size = static_cast<size_t>(vsapi->getFrameWidth(frame, plane)) * format->bytesPerSample;
+        const int height = vsapi->getFrameHeight(frame, plane);
+        vsh::bitblt(
+            dstp, row_size, vsapi->getReadPtr(frame, plane), vsapi->getStride(frame, plane),
+            row_size, height);
+        dstp += row_size * height;
+    }
+}
+
+static inline void unpack_frame(VSFrame * frame, const uint8_t * srcp, const VSAPI * vsapi) noexcept {
+    const auto * format = vsapi->getVideoFrameFormat(frame);
+    for (int plane = 0; plane < format->numPlanes; ++plane) {
+        const size_t row_size = static_cast<size_t>(vsapi->getFrameWidth(frame, plane)) * format->bytesPerSample;
+        const int height = vsapi->getFrameHeight(frame, plane);
+        vsh::bitblt(
+            vsapi->getWritePtr(frame, plane), vsapi->getStride(frame, plane), srcp, row_size,
+            row_size, height);
+        srcp += row_size * height;
+    }
+}
+
+#ifndef _WIN32
+
+static inline bool send_all(int socket, const void * data, size_t size) noexcept {
+    auto bytes = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+        const auto sent = ::send(socket, bytes, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+static inline bool recv_all(int socket, void * data, size_t size) noexcept {
+    auto bytes = static_cast<uint8_t *>(data);
+    while (size > 0) {
+        const auto received = ::recv(socket, bytes, size, 0);
+        if (received <= 0) {
+            return false;
+        }
+        bytes += received;
+        size -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+// `file` is passed to the peer if not negative
+static inline bool send_message(int socket, const Writer & message, int file = -1) noexcept {
+    const auto size = static_cast<uint32_t>(message.buffer.size());
+
+    if (file >= 0) {
+        iovec iov { const_cast<uint32_t *>(&size), sizeof(size) };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] {};
+        msghdr header {};
+        header.msg_iov = &iov;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        auto * cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &file, sizeof(int));
+        if (::sendmsg(socket, &header, MSG_NOSIGNAL) != sizeof(size)) {
+            return false;
+        }
+    } else if (!send_all(socket, &size, sizeof(size))) {
+        return false;
+    }
+
+    return send_all(socket, message.buffer.data(), size);
+}
+
+// a file passed by the peer is stored in `file` if not null, which is -1 otherwise
+static inline bool recv_message(int socket, std::vector<uint8_t> & message, int * file = nullptr) noexcept {
+    uint32_t size;
+
+    iovec iov { &size, sizeof(size) };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] {};
+    msghdr header {};
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    const auto received = ::recvmsg(socket, &header, 0);
+    if (received <= 0) {
+        return false;
+    }
+
+    int passed_file = -1;
+    for (auto * cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&passed_file, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (file) {
+        *file = passed_file;
+    } else if (passed_file >= 0) {
+        ::close(passed_file);
+    }
+
+    if (!recv_all(socket, reinterpret_cast<uint8_t *>(&size) + received, sizeof(size) - received) ||
+        size > max_message_size
+    ) {
+        return false;
+    }
+
+    try {
+        message.resize(size);
+    } catch (const std::bad_alloc &) {
+        return false;
+    }
+    return recv_all(socket, message.data(), size);
+}
+
+class SharedMemory {
+public:
+    SharedMemory() = default;
+    SharedMemory(const SharedMemory &) = delete;
+    SharedMemory & operator=(const SharedMemory &) = delete;
+
+    ~SharedMemory() {
+        if (data) {
+            ::munmap(data, size);
+        }
+        if (file >= 0) {
+            ::close(file);
+        }
+    }
+
+    // creates an unnamed segment of `size` bytes
+    bool create(size_t size, std::string & error) {
+        static std::atomic<uint32_t> counter {};
+        const auto name = (
+            "/bm3d-" + std::to_string(::getpid()) + "-" + std::to_string(counter.fetch_add(1)));
+        file = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (file < 0) {
+            error = "failed to create shared memory \"" + name + "\"";
+            return false;
+        }
+        ::shm_unlink(name.c_str());
+        if (::ftruncate(file, static_cast<off_t>(size)) != 0) {
+            error = "failed to allocate " + std::to_string(size) + " bytes of shared memory";
+            return false;
+        }
+        return map(size, error);
+    }
+
+    // maps a segment created by the peer, `file` is owned by the object
+    bool open(int file, size_t size, std::string & error) {
+        this->file = file;
+        struct stat status;
+        if (::fstat(file, &status) != 0 || static_cast<size_t>(status.st_size) < size) {
+            error = "invalid shared memory";
+            return false;
+        }
+        return map(size, error);
+    }
+
+    uint8_t * data {};
+    size_t size {};
+    int file { -1 };
+
+private:
+    bool map(size_t size, std::string & error) {
+        void * address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        if (address == MAP_FAILED) {
+            error = "failed to map " + std::to_string(size) + " bytes of shared memory";
+            return false;
+        }
+        data = static_cast<uint8_t *>(address);
+        this->size = size;
+        return true;
+    }
+};
+
+#endif // _WIN32
+
+// filter instance of a server
+class Client {
+public:
+    Client(const Client &) = delete;
+    Client & operator=(const Client &) = delete;
+
+    // creates a filter instance of `args` on the server at `path` for input of `src_vi`,
+    // whose output must be of `vi`, returns null on failure
+    static std::unique_ptr<Client> connect(
+        const std::string & path, const VSMap * args,
+        const VSVideoInfo & src_vi, const VSVideoInfo & vi, bool has_ref, int radius,
+        VSCore * core, const VSAPI * vsapi, std::string & error
+    ) {
+#ifdef _WIN32
+        error = "\"server\" is not supported on Windows";
+        return nullptr;
+#else
+        std::unique_ptr<Client> client { new Client };
+        client->path = path;
+        client->vi = vi;
+        client->input_size = packed_frame_size(src_vi.format, src_vi.width, src_vi.height);
+        client->output_size = packed_frame_size(vi.format, vi.width, vi.height);
+        client->capacity = (2 * radius + 1) * (has_ref ? 2 : 1);
+
+        // diagnostics are local, and batches of V-BM3D would request frames
+        // outside of the window submitted by a request
+        auto & hello = client->hello;
+        hello.put<uint32_t>(protocol_magic);
+        hello.put<uint32_t>(protocol_version);
+        write_map(hello, args, vsapi, { "server", "trace", "perf", "batch" });
+        write_video_info(hello, src_vi, core, vsapi);
+        hello.put<uint8_t>(has_ref);
+        hello.put<uint64_t>(client->capacity * client->input_size + client->output_size);
+        hello.put<uint64_t>(client->capacity * client->input_size);
+
+        // validates the instance
+        auto connection = client->open(core, vsapi, error);
+        if (!connection) {
+            return nullptr;
+        }
+        client->idle.push_back(std::move(connection));
+        return client;
+#endif
+    }
+
+    // computes frame `n` from the input frames of its window,
+    // as pairs of frame numbers and frames, returns null on failure
+    const VSFrame * process(
+        int n,
+        const std::vector<std::pair<int, const VSFrame *>> & src_window,
+        const std::vector<std::pair<int, const VSFrame *>> & ref_window,
+        VSCore * core, const VSAPI * vsapi, std::string & error,
+        int64_t & transfer_ns
+    ) {
+#ifdef _WIN32
+        error = "\"server\" is not supported on Windows";
+        return nullptr;
+#else
+        std::unique_ptr<Connection> connection;
+        {
+            std::lock_guard _ { lock };
+            if (!idle.empty()) {
+                connection = std::move(idle.back());
+                idle.pop_back();
+            }
+        }
+        if (!connection) {
+            connection = open(core, vsapi, error);
+            if (!connection) {
+                return nullptr;
+            }
+        }
+
+        const auto transfer_start = std::chrono::steady_clock::now();
+        const auto elapsed_ns = [](std::chrono::steady_clock::time_point start) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        };
+
+        Writer request;
+        request.put<int32_t>(n);
+        request.put<uint32_t>(static_cast<uint32_t>(src_window.size() + ref_window.size()));
+        size_t offset = 0;
+        const auto submit = [&](FrameRole role, const auto & window) {
+            for (const auto & [number, frame] : window) {
+                request.put<uint8_t>(role);
+                request.put<int32_t>(number);
+                write_map(request, vsapi->getFramePropertiesRO(frame), vsapi);
+                pack_frame(connection->memory.data + offset, frame, vsapi);
+                offset += input_size;
+            }
+        };
+        submit(role_clip, src_window);
+        submit(role_ref, ref_window);
+        transfer_ns = elapsed_ns(transfer_start);
+
+        std::vector<uint8_t> response;
+        if (!send_message(connection->socket, request) || !recv_message(connection->socket, response)) {
+            error = "lost connection to server \"" + path + "\"";
+            return nullptr;
+        }
+
+        Reader reader { response };
+        if (reader.get<uint8_t>() != 0) {
+            error = "server: " + reader.get_string();
+            release(std::move(connection));
+            return nullptr;
+        }
+        reader.get_string();
+
+        const auto output_start = std::chrono::steady_clock::now();
+        auto dst_frame = vsapi->newVideoFrame(&vi.format, vi.width, vi.height, nullptr, core);
+        if (!read_map(reader, vsapi->getFramePropertiesRW(dst_frame), vsapi)) {
+            vsapi->freeFrame(dst_frame);
+            error = "invalid response of server \"" + path + "\"";
+            return nullptr;
+        }
+        unpack_frame(dst_frame, connection->memory.data + capacity * input_size, vsapi);
+        transfer_ns += elapsed_ns(output_start);
+
+        release(std::move(connection));
+        return dst_frame;
+#endif
+    }
+
+private:
+    Client() = default;
+
+#ifndef _WIN32
+    struct Connection {
+        Connection() = default;
+        Connection(const Connection &) = delete;
+        Connection & operator=(const Connection &) = delete;
+
+        ~Connection() {
+            if (socket >= 0) {
+                ::close(socket);
+            }
+        }
+
+        int socket { -1 };
+        SharedMemory memory;
+    };
+
+    std::unique_ptr<Connection> open(VSCore * core, const VSAPI * vsapi, std::string & error) {
+        auto connection = std::make_unique<Connection>();
+
+        sockaddr_un address {};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            error = "socket path \"" + path + "\" is too long";
+            return nullptr;
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        connection->socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connection->socket >= 0) {
+            ::fcntl(connection->socket, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+            int enabled = 1;
+            ::setsockopt(connection->socket, SOL_SOCKET, SO_NOSIGPIPE, &enabled, sizeof(enabled));
+#endif
+        }
+        if (connection->socket < 0 ||
+            ::connect(connection->socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+        ) {
+            error = "failed to connect to server \"" + path + "\"";
+            return nullptr;
+        }
+
+        if (!connection->memory.create(capacity * input_size + output_size, error)) {
+            return nullptr;
+        }
+
+        std::vector<uint8_t> response;
+        if (!send_message(connection->socket, hello, connection->memory.file) ||
+            !recv_message(connection->socket, response)
+        ) {
+            error = "lost connection to server \"" + path + "\"";
+            return nullptr;
+        }
+
+        Reader reader { response };
+        const auto status = reader.get<uint8_t>();
+        const auto message = reader.get_string();
+        if (status != 0) {
+            error = "server: " + message;
+            return nullptr;
+        }
+
+        VSVideoInfo server_vi {};
+        if (!read_video_info(reader, server_vi, core, vsapi)) {
+            error = "invalid response of server \"" + path + "\"";
+            return nullptr;
+        }
+        if (!vsh::isSameVideoFormat(&server_vi.format, &vi.format) ||
+            server_vi.width != vi.width || server_vi.height != vi.height
+        ) {
+            error = "output of server \"" + path + "\" is of a different format or dimensions";
+            return nullptr;
+        }
+
+        return connection;
+    }
+
+    void release(std::unique_ptr<Connection> connection) {
+        std::lock_guard _ { lock };
+        idle.push_back(std::move(connection));
+    }
+
+    std::mutex lock;
+    std::vector<std::unique_ptr<Connection>> idle;
+#endif
+
+    std::string path;
+    VSVideoInfo vi;
+    Writer hello;
+    size_t input_size;
+    size_t output_size;
+    size_t capacity; // of input frames of a request
+};
+
+} // namespace remote
@@ -0,0 +1,416 @@
+// Long-lived denoising server of the BM3D plugins
+//
+// Usage: bm3d_server [--engine NAMESPACE] [--plugin PATH] [--threads N] SOCKET
+//
+// Serves `BM3D(server=SOCKET)` of the `cpu` version, see "remote.h". Filter
+// instances of the engine (`bm3dcpu` by default, or e.g. `bm3dcuda_rtc`) are
+// created on the first connection of each combination of arguments and input
+// format, and are kept and reused by later connections, so that their buffers,
+// compiled kernels and caches stay warm across client processes. Connections
+// are served in parallel by the thread pool of a single VapourSynth core.
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <VapourSynth4.h>
+#include <VSHelper4.h>
+
+#include "remote.h"
+
+// source filter of the input frames of the current request of a connection
+//
+// Clients request frames of a window clamped to their clip, so requests of
+// frames outside of the submitted ones are clamped to them in the same way,
+// and filter instances do not depend on the length of the clip.
+struct MailboxData {
+    std::vector<std::pair<int, const VSFrame *>> frames; // sorted by frame number
+
+    void clear(const VSAPI * vsapi) noexcept {
+        for (const auto & item : frames) {
+            vsapi->freeFrame(item.second);
+        }
+        frames.clear();
+    }
+};
+
+static const VSFrame *VS_CC MailboxGetFrame(
+    int n, int activationReason, void *instanceData, void **frameData,
+    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi
+) {
+
+    auto * d = static_cast<MailboxData *>(instanceData);
+
+    if (activationReason == arInitial) {
+        if (d->frames.empty()) {
+            vsapi->setFilterError("bm3d_server: no input frames", frameCtx);
+            return nullptr;
+        }
+        const auto & frames = d->frames;
+        n = std::clamp(n, frames.front().first, frames.back().first);
+        for (const auto & [number, frame] : frames) {
+            if (number == n) {
+                return vsapi->addFrameRef(frame);
+            }
+        }
+        vsapi->setFilterError(
+            ("bm3d_server: frame " + std::to_string(n) + " was not submitted").c_str(), frameCtx);
+    }
+
+    return nullptr;
+}
+
+static void VS_CC MailboxFree(
+    void *instanceData, VSCore *core, const VSAPI *vsapi
+) noexcept {
+
+    auto * d = static_cast<MailboxData *>(instanceData);
+    d->clear(vsapi);
+    delete d;
+}
+
+// filter instance of the engine, used by one connection at a time
+struct Instance {
+    VSNode * node;
+    VSVideoInfo vi; // of output frames
+    VSVideoInfo src_vi;
+    MailboxData * mailboxes[2]; // of `remote::FrameRole`, owned by their nodes
+};
+
+struct Server {
+    const VSAPI * vsapi;
+    VSCore * core;
+    VSPlugin * engine;
+
+    // idle instances keyed by arguments and input format
+    std::unordered_map<std::string, std::vector<std::unique_ptr<Instance>>> instances;
+    std::mutex lock;
+};
+
+static std::unique_ptr<Instance> create_instance(
+    Server & server, VSMap * args, const VSVideoInfo & src_vi, bool has_ref, std::string & error
+) {
+
+    const auto * vsapi = server.vsapi;
+    auto * core = server.core;
+
+    auto instance = std::make_unique<Instance>();
+    instance->src_vi = src_vi;
+    instance->src_vi.fpsNum = 0;
+    instance->src_vi.fpsDen = 1;
+    instance->src_vi.numFrames = std::numeric_limits<int>::max() / 2;
+
+    const char * keys[] { "clip", "ref" };
+    for (int role = 0; role < 2; ++role) {
+        if (role == remote::role_ref && !has_ref) {
+            instance->mailboxes[role] = nullptr;
+            continue;
+        }
+
+        auto mailbox = new MailboxData {};
+        instance->mailboxes[role] = mailbox;
+
+        auto map = vsapi->createMap();
+        vsapi->createVideoFilter(
+            map, "Mailbox", &instance->src_vi, MailboxGetFrame, MailboxFree,
+            fmParallel, nullptr, 0, mailbox, core);
+        auto node = vsapi->mapGetNode(map, "clip", 0, nullptr);
+        vsapi->freeMap(map);
+        // frames of the same number differ between requests
+        vsapi->setCacheMode(node, cmForceDisable);
+        vsapi->mapConsumeNode(args, keys[role], node, maReplace);
+    }
+
+    auto result = vsapi->invoke(server.engine, "BM3D", args);
+    if (auto error_message = vsapi->mapGetError(result); error_message) {
+        error = error_message;
+        vsapi->freeMap(result);
+        return nullptr;
+    }
+
+    instance->node = vsapi->mapGetNode(result, "clip", 0, nullptr);
+    vsapi->freeMap(result);
+    vsapi->setCacheMode(instance->node, cmForceDisable);
+    instance->vi = *vsapi->getVideoInfo(instance->node);
+
+    return instance;
+}
+
+// serves requests of a connection until it is closed by the client
+static void serve_requests(
+    Server & server, int socket, Instance & instance, const remote::SharedMemory & memory,
+    size_t output_offset
+) {
+
+    const auto * vsapi = server.vsapi;
+    auto * core = server.core;
+
+    const auto & src_vi = instance.src_vi;
+    const size_t input_size = remote::packed_frame_size(src_vi.format, src_vi.width, src_vi.height);
+
+    std::vector<uint8_t> message;
+    while (remote::recv_message(socket, message)) {
+        remote::Reader request { message };
+        const int n = request.get<int32_t>();
+        const auto num_frames = request.get<uint32_t>();
+
+        // input frames must not overlap the output frame
+        bool valid = request.ok && static_cast<uint64_t>(num_frames) * input_size <= output_offset;
+        for (uint32_t i = 0; i < num_frames && valid; ++i) {
+            const auto role = request.get<uint8_t>();
+            const int number = request.get<int32_t>();
+            auto * mailbox = role <= remote::role_ref ? instance.mailboxes[role] : nullptr;
+            if (!mailbox) {
+                valid = false;
+                break;
+            }
+            auto frame = vsapi->newVideoFrame(&src_vi.format, src_vi.width, src_vi.height, nullptr, core);
+            valid = remote::read_map(request, vsapi->getFramePropertiesRW(frame), vsapi);
+            remote::unpack_frame(frame, memory.data + i * input_size, vsapi);
+            mailbox->frames.emplace_back(number, frame);
+        }
+
+        const VSFrame * frame = nullptr;
+        char error_message[1024] { "invalid request" };
+        if (valid) {
+            for (auto * mailbox : instance.mailboxes) {
+                if (mailbox) {
+                    std::sort(mailbox->frames.begin(), mailbox->frames.end());
+                }
+            }
+            frame = vsapi->getFrame(n, instance.node, error_message, sizeof(error_message));
+        }
+
+        for (auto * mailbox : instance.mailboxes) {
+            if (mailbox) {
+                mailbox->clear(vsapi);
+            }
+        }
+
+        remote::Writer response;
+        if (!frame) {
+            response.put<uint8_t>(1);
+            response.put_string(error_message);
+        } else {
+            remote::pack_frame(memory.data + output_offset, frame, vsapi);
+            response.put<uint8_t>(0);
+            response.put_string({});
+            remote::write_map(response, vsapi->getFramePropertiesRO(frame), vsapi);
+            vsapi->freeFrame(frame);
+        }
+        if (!remote::send_message(socket, response)) {
+            return;
+        }
+    }
+}
+
+static void serve(Server & server, int socket) {
+    const auto * vsapi = server.vsapi;
+    auto * core = server.core;
+
+    std::vector<uint8_t> message;
+    int file = -1;
+    if (!remote::recv_message(socket, message, &file)) {
+        ::close(socket);
+        return;
+    }
+
+    remote::SharedMemory memory;
+    if (file >= 0) {
+        memory.file = file;
+    }
+
+    const auto handshake = [&]() -> std::string {
+        remote::Reader hello { message };
+        if (hello.get<uint32_t>() != remote::protocol_magic ||
+            hello.get<uint32_t>() != remote::protocol_version
+        ) {
+            return "incompatible client";
+        }
+
+        // arguments, input format and the presence of "ref" identify instances
+        const size_t key_begin = hello.position;
+        auto args = vsapi->createMap();
+        const bool args_ok = remote::read_map(hello, args, vsapi);
+        VSVideoInfo src_vi {};
+        const bool vi_ok = remote::read_video_info(hello, src_vi, core, vsapi);
+        const bool has_ref = hello.get<uint8_t>() != 0;
+        const std::string key {
+            reinterpret_cast<const char *>(hello.data + key_begin), hello.position - key_begin };
+        const auto memory_size = hello.get<uint64_t>();
+        const auto output_offset = hello.get<uint64_t>();
+
+        if (!args_ok || !vi_ok || !hello.ok || memory.file < 0) {
+            vsapi->freeMap(args);
+            return "invalid handshake";
+        }
+
+        std::unique_ptr<Instance> instance;
+        {
+            std::lock_guard _ { server.lock };
+            auto & idle = server.instances[key];
+            if (!idle.empty()) {
+                instance = std::move(idle.back());
+                idle.pop_back();
+            }
+        }
+        std::string error;
+        if (!instance) {
+            instance = create_instance(server, args, src_vi, has_ref, error);
+        }
+        vsapi->freeMap(args);
+        if (!instance) {
+            return error;
+        }
+
+        const auto & vi = instance->vi;
+        const size_t input_size = remote::packed_frame_size(src_vi.format, src_vi.width, src_vi.height);
+        const size_t output_size = remote::packed_frame_size(vi.format, vi.width, vi.height);
+        // `output_offset` and `memory_size` are checked without overflow,
+        // and the mapping is checked against the size of the segment
+        if (memory_size > std::numeric_limits<size_t>::max() ||
+            output_offset < input_size || output_offset > memory_size ||
+            output_size > memory_size - output_offset
+        ) {
+            error = "invalid handshake";
+        } else {
+            memory.open(memory.file, memory_size, error);
+        }
+
+        if (error.empty()) {
+            remote::Writer response;
+            response.put<uint8_t>(0);
+            response.put_string({});
+            remote::write_video_info(response, vi, core, vsapi);
+            if (remote::send_message(socket, response)) {
+                serve_requests(server, socket, *instance, memory, output_offset);
+            }
+        }
+
+        std::lock_guard _ { server.lock };
+        server.instances[key].push_back(std::move(instance));
+        return error;
+    };
+
+    if (auto error = handshake(); !error.empty()) {
+        remote::Writer response;
+        response.put<uint8_t>(1);
+        response.put_string(error);
+        remote::send_message(socket, response);
+    }
+
+    ::close(socket);
+}
+
+static void VS_CC log_handler(int msgType, const char *msg, void *userData) {
+    if (msgType >= mtInformation) {
+        std::fprintf(stderr, "%s\n", msg);
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string engine_namespace = "bm3dcpu";
+    std::string plugin_path;
+    int threads = 0;
+    std::string path;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--engine" && i + 1 < argc) {
+            engine_namespace = argv[++i];
+        } else if (arg == "--plugin" && i + 1 < argc) {
+            plugin_path = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+        } else if (path.empty() && arg.rfind("--", 0) != 0) {
+            path = arg;
+        } else {
+            path.clear();
+            break;
+        }
+    }
+
+    if (path.empty()) {
+        std::fprintf(stderr, "usage: bm3d_server [--engine NAMESPACE] [--plugin PATH] [--threads N] SOCKET\n");
+        return 2;
+    }
+
+    const VSAPI * vsapi = getVapourSynthAPI(VAPOURSYNTH_API_VERSION);
+    if (!vsapi) {
+        std::fprintf(stderr, "bm3d_server: failed to initialize VapourSynth\n");
+        return 1;
+    }
+
+    Server server;
+    server.vsapi = vsapi;
+    server.core = vsapi->createCore(0);
+    vsapi->addLogHandler(log_handler, nullptr, nullptr, server.core);
+    if (threads > 0) {
+        vsapi->setThreadCount(threads, server.core);
+    }
+
+    if (!plugin_path.empty()) {
+        auto args = vsapi->createMap();
+        vsapi->mapSetData(args, "path", plugin_path.c_str(), -1, dtUtf8, maReplace);
+        auto result = vsapi->invoke(
+            vsapi->getPluginByID("com.vapoursynth.std", server.core), "LoadPlugin", args);
+        vsapi->freeMap(args);
+        if (auto error = vsapi->mapGetError(result); error) {
+            std::fprintf(stderr, "bm3d_server: %s\n", error);
+            return 1;
+        }
+        vsapi->freeMap(result);
+    }
+
+    server.engine = vsapi->getPluginByNamespace(engine_namespace.c_str(), server.core);
+    if (!server.engine) {
+        std::fprintf(stderr, "bm3d_server: plugin \"%s\" not found\n", engine_namespace.c_str());
+        return 1;
+    }
+
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::fprintf(stderr, "bm3d_server: socket path \"%s\" is too long\n", path.c_str());
+        return 1;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(path.c_str());
+    // the socket is only accessible to the user of the server
+    const auto mask = ::umask(0077);
+    const bool bound = listener >= 0 &&
+        ::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+    ::umask(mask);
+    if (!bound || ::listen(listener, 64) != 0) {
+        std::fprintf(stderr, "bm3d_server: failed to listen on \"%s\"\n", path.c_str());
+        return 1;
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);
+    std::fprintf(stderr, "bm3d_server: serving %s on \"%s\"\n", engine_namespace.c_str(), path.c_str());
+
+    while (true) {
+        int socket = ::accept(listener, nullptr, nullptr);
+        if (socket < 0) {
+            continue;
+        }
+        std::thread { serve, std::ref(server), socket }.detach();
+    }
+}
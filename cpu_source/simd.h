@@ -0,0 +1,507 @@
+// Thin 8-wide vector abstraction used by the kernels of BM3DCPU
+//
+// Backends:
+// - AVX2 (and AVX-512, which is the AVX2 backend compiled with AVX-512VL enabled),
+// - NEON on aarch64,
+// - scalar, selected if none of the above is available or `BM3D_SIMD_SCALAR` is defined.
+//
+// `vfloat` and `vint` hold 8 lanes of float and int32_t respectively.
+// Masks are vectors whose lanes are either all zeros or all ones.
+// `vrcp` is an approximate reciprocal whose precision is implementation-defined.
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if !defined(BM3D_SIMD_SCALAR) && defined(__AVX2__)
+#define BM3D_SIMD_X86
+#include <immintrin.h>
+#include "cpuid.h"
+#elif !defined(BM3D_SIMD_SCALAR) && defined(__aarch64__) && defined(__ARM_NEON)
+#define BM3D_SIMD_NEON
+#include <arm_neon.h>
+#elif !defined(BM3D_SIMD_SCALAR)
+#define BM3D_SIMD_SCALAR
+#endif
+
+#if defined(BM3D_SIMD_X86)
+
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+static constexpr const char * simd_name = "AVX-512";
+#else
+static constexpr const char * simd_name = "AVX2";
+#endif
+
+static inline bool simd_supported() noexcept {
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+    return cpu_supports_avx512();
+#else
+    return cpu_supports_avx2();
+#endif
+}
+
+using vfloat = __m256;
+using vint = __m256i;
+
+static inline vfloat vsetf(float x) noexcept { return _mm256_set1_ps(x); }
+static inline vint vseti(int x) noexcept { return _mm256_set1_epi32(x); }
+
+static inline vfloat vsetrf(
+    float e0, float e1, float e2, float e3, float e4, float e5, float e6, float e7
+) noexcept {
+    return _mm256_setr_ps(e0, e1, e2, e3, e4, e5, e6, e7);
+}
+
+static inline vint vsetri(
+    int e0, int e1, int e2, int e3, int e4, int e5, int e6, int e7
+) noexcept {
+    return _mm256_setr_epi32(e0, e1, e2, e3, e4, e5, e6, e7);
+}
+
+static inline vfloat vloadf(const float * p) noexcept { return _mm256_load_ps(p); }
+static inline vfloat vloaduf(const float * p) noexcept { return _mm256_loadu_ps(p); }
+static inline vint vloadui(const int * p) noexcept {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+static inline void vstore(float * p, vfloat x) noexcept { _mm256_store_ps(p, x); }
+static inline void vstoreu(float * p, vfloat x) noexcept { _mm256_storeu_ps(p, x); }
+static inline void vstoreu(int * p, vint x) noexcept {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), x);
+}
+// non-temporal store to aligned memory
+static inline void vstream(float * p, vfloat x) noexcept { _mm256_stream_ps(p, x); }
+
+static inline vint vcasti(vfloat x) noexcept { return _mm256_castps_si256(x); }
+static inline vfloat vcastf(vint x) noexcept { return _mm256_castsi256_ps(x); }
+static inline vfloat vcvt(vint x) noexcept { return _mm256_cvtepi32_ps(x); }
+
+static inline vfloat vadd(vfloat a, vfloat b) noexcept { return _mm256_add_ps(a, b); }
+static inline vfloat vsub(vfloat a, vfloat b) noexcept { return _mm256_sub_ps(a, b); }
+static inline vfloat vmul(vfloat a, vfloat b) noexcept { return _mm256_mul_ps(a, b); }
+// a * b + c
+static inline vfloat vfmadd(vfloat a, vfloat b, vfloat c) noexcept { return _mm256_fmadd_ps(a, b, c); }
+// -(a * b) + c
+static inline vfloat vfnmadd(vfloat a, vfloat b, vfloat c) noexcept { return _mm256_fnmadd_ps(a, b, c); }
+// a * b - c
+static inline vfloat vfmsub(vfloat a, vfloat b, vfloat c) noexcept { return _mm256_fmsub_ps(a, b, c); }
+static inline vfloat vrcp(vfloat x) noexcept { return _mm256_rcp_ps(x); }
+static inline vfloat vand(vfloat a, vfloat b) noexcept { return _mm256_and_ps(a, b); }
+static inline vfloat vxor(vfloat a, vfloat b) noexcept { return _mm256_xor_ps(a, b); }
+
+static inline vint vadd(vint a, vint b) noexcept { return _mm256_add_epi32(a, b); }
+static inline vint vsub(vint a, vint b) noexcept { return _mm256_sub_epi32(a, b); }
+static inline vint vand(vint a, vint b) noexcept { return _mm256_and_si256(a, b); }
+
+static inline vfloat vcmplt(vfloat a, vfloat b) noexcept { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline vfloat vcmpge(vfloat a, vfloat b) noexcept { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+static inline vint vcmpeq(vint a, vint b) noexcept { return _mm256_cmpeq_epi32(a, b); }
+
+// bit i of the result is the sign bit of lane i
+static inline int vmovemask(vfloat x) noexcept { return _mm256_movemask_ps(x); }
+
+// selects lanes of `b` where `mask` is set
+static inline vfloat vblendv(vfloat a, vfloat b, vfloat mask) noexcept {
+    return _mm256_blendv_ps(a, b, mask);
+}
+static inline vint vblendv(vint a, vint b, vint mask) noexcept {
+    return _mm256_blendv_epi8(a, b, mask);
+}
+
+// selects lane i of `b` where bit i of `imm` is set
+template <int imm>
+static inline vfloat vblend(vfloat a, vfloat b) noexcept {
+    return _mm256_blend_ps(a, b, imm);
+}
+
+// lane i of the result is lane (index[i] & 7) of `x`
+static inline vfloat vpermute(vfloat x, vint index) noexcept {
+    return _mm256_permutevar8x32_ps(x, index);
+}
+static inline vint vpermute(vint x, vint index) noexcept {
+    return _mm256_permutevar8x32_epi32(x, index);
+}
+
+// sum of lanes, broadcasted to all lanes
+static inline vfloat vreduce_add(vfloat x) noexcept {
+    x = _mm256_add_ps(x, _mm256_permute_ps(x, 0b10110001));
+    x = _mm256_add_ps(x, _mm256_permute_ps(x, 0b01001110));
+    x = _mm256_add_ps(x, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(x), 0b01001110)));
+    return x;
+}
+
+// sum of lanes, broadcasted to all lanes
+static inline vint vreduce_add(vint x) noexcept {
+    x = _mm256_add_epi32(x, _mm256_castps_si256(_mm256_permute_ps(_mm256_castsi256_ps(x), 0b10110001)));
+    x = _mm256_add_epi32(x, _mm256_castps_si256(_mm256_permute_ps(_mm256_castsi256_ps(x), 0b01001110)));
+    x = _mm256_add_epi32(x, _mm256_permute4x64_epi64(x, 0b01001110));
+    return x;
+}
+
+// Transposition of a 8x8 block.
+static inline void vtranspose(vfloat block[8]) noexcept {
+    for (int i = 0; i < 4; ++i) {
+        __m256 temp1 = _mm256_shuffle_ps(block[i * 2], block[i * 2 + 1], 0b10001000);
+        __m256 temp2 = _mm256_shuffle_ps(block[i * 2], block[i * 2 + 1], 0b11011101);
+        block[i * 2] = temp1;
+        block[i * 2 + 1] = temp2;
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        __m256 temp1 = _mm256_shuffle_ps(block[i + (i & -2)], block[i + (i & -2) + 2], 0b10001000);
+        __m256 temp2 = _mm256_shuffle_ps(block[i + (i & -2)], block[i + (i & -2) + 2], 0b11011101);
+        block[i + (i & -2)] = temp1;
+        block[i + (i & -2) + 2] = temp2;
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        __m256 temp1 = _mm256_permute2f128_ps(block[i], block[i + 4], 0b00100000);
+        __m256 temp2 = _mm256_permute2f128_ps(block[i], block[i + 4], 0b00110001);
+        block[i] = temp1;
+        block[i + 4] = temp2;
+    }
+}
+
+static inline int popcount(unsigned int x) noexcept { return _mm_popcnt_u32(x); }
+
+#elif defined(BM3D_SIMD_NEON)
+
+static constexpr const char * simd_name = "NEON";
+
+static inline bool simd_supported() noexcept { return true; }
+
+struct vfloat { float32x4_t lo, hi; };
+struct vint { int32x4_t lo, hi; };
+
+static inline vfloat vsetf(float x) noexcept { return { vdupq_n_f32(x), vdupq_n_f32(x) }; }
+static inline vint vseti(int x) noexcept { return { vdupq_n_s32(x), vdupq_n_s32(x) }; }
+
+static inline vfloat vsetrf(
+    float e0, float e1, float e2, float e3, float e4, float e5, float e6, float e7
+) noexcept {
+    const float data[8] { e0, e1, e2, e3, e4, e5, e6, e7 };
+    return { vld1q_f32(&data[0]), vld1q_f32(&data[4]) };
+}
+
+static inline vint vsetri(
+    int e0, int e1, int e2, int e3, int e4, int e5, int e6, int e7
+) noexcept {
+    const int32_t data[8] { e0, e1, e2, e3, e4, e5, e6, e7 };
+    return { vld1q_s32(&data[0]), vld1q_s32(&data[4]) };
+}
+
+static inline vfloat vloadf(const float * p) noexcept { return { vld1q_f32(p), vld1q_f32(p + 4) }; }
+static inline vfloat vloaduf(const float * p) noexcept { return vloadf(p); }
+static inline vint vloadui(const int * p) noexcept {
+    return { vld1q_s32(reinterpret_cast<const int32_t *>(p)), vld1q_s32(reinterpret_cast<const int32_t *>(p) + 4) };
+}
+
+static inline void vstore(float * p, vfloat x) noexcept { vst1q_f32(p, x.lo); vst1q_f32(p + 4, x.hi); }
+static inline void vstoreu(float * p, vfloat x) noexcept { vstore(p, x); }
+static inline void vstoreu(int * p, vint x) noexcept {
+    vst1q_s32(reinterpret_cast<int32_t *>(p), x.lo);
+    vst1q_s32(reinterpret_cast<int32_t *>(p) + 4, x.hi);
+}
+static inline void vstream(float * p, vfloat x) noexcept { vstore(p, x); }
+
+static inline vint vcasti(vfloat x) noexcept { return { vreinterpretq_s32_f32(x.lo), vreinterpretq_s32_f32(x.hi) }; }
+static inline vfloat vcastf(vint x) noexcept { return { vreinterpretq_f32_s32(x.lo), vreinterpretq_f32_s32(x.hi) }; }
+static inline vfloat vcvt(vint x) noexcept { return { vcvtq_f32_s32(x.lo), vcvtq_f32_s32(x.hi) }; }
+
+static inline vfloat vadd(vfloat a, vfloat b) noexcept { return { vaddq_f32(a.lo, b.lo), vaddq_f32(a.hi, b.hi) }; }
+static inline vfloat vsub(vfloat a, vfloat b) noexcept { return { vsubq_f32(a.lo, b.lo), vsubq_f32(a.hi, b.hi) }; }
+static inline vfloat vmul(vfloat a, vfloat b) noexcept { return { vmulq_f32(a.lo, b.lo), vmulq_f32(a.hi, b.hi) }; }
+static inline vfloat vfmadd(vfloat a, vfloat b, vfloat c) noexcept {
+    return { vfmaq_f32(c.lo, a.lo, b.lo), vfmaq_f32(c.hi, a.hi, b.hi) };
+}
+static inline vfloat vfnmadd(vfloat a, vfloat b, vfloat c) noexcept {
+    return { vfmsq_f32(c.lo, a.lo, b.lo), vfmsq_f32(c.hi, a.hi, b.hi) };
+}
+static inline vfloat vfmsub(vfloat a, vfloat b, vfloat c) noexcept {
+    return { vnegq_f32(vfmsq_f32(c.lo, a.lo, b.lo)), vnegq_f32(vfmsq_f32(c.hi, a.hi, b.hi)) };
+}
+static inline vfloat vrcp(vfloat x) noexcept {
+    // one Newton-Raphson step for precision comparable to `rcpps`
+    float32x4_t lo = vrecpeq_f32(x.lo);
+    float32x4_t hi = vrecpeq_f32(x.hi);
+    return { vmulq_f32(lo, vrecpsq_f32(x.lo, lo)), vmulq_f32(hi, vrecpsq_f32(x.hi, hi)) };
+}
+static inline vfloat vand(vfloat a, vfloat b) noexcept {
+    return vcastf({ vandq_s32(vcasti(a).lo, vcasti(b).lo), vandq_s32(vcasti(a).hi, vcasti(b).hi) });
+}
+static inline vfloat vxor(vfloat a, vfloat b) noexcept {
+    return vcastf({ veorq_s32(vcasti(a).lo, vcasti(b).lo), veorq_s32(vcasti(a).hi, vcasti(b).hi) });
+}
+
+static inline vint vadd(vint a, vint b) noexcept { return { vaddq_s32(a.lo, b.lo), vaddq_s32(a.hi, b.hi) }; }
+static inline vint vsub(vint a, vint b) noexcept { return { vsubq_s32(a.lo, b.lo), vsubq_s32(a.hi, b.hi) }; }
+static inline vint vand(vint a, vint b) noexcept { return { vandq_s32(a.lo, b.lo), vandq_s32(a.hi, b.hi) }; }
+
+static inline vfloat vcmplt(vfloat a, vfloat b) noexcept {
+    return {
+        vreinterpretq_f32_u32(vcltq_f32(a.lo, b.lo)),
+        vreinterpretq_f32_u32(vcltq_f32(a.hi, b.hi))
+    };
+}
+static inline vfloat vcmpge(vfloat a, vfloat b) noexcept {
+    return {
+        vreinterpretq_f32_u32(vcgeq_f32(a.lo, b.lo)),
+        vreinterpretq_f32_u32(vcgeq_f32(a.hi, b.hi))
+    };
+}
+static inline vint vcmpeq(vint a, vint b) noexcept {
+    return {
+        vreinterpretq_s32_u32(vceqq_s32(a.lo, b.lo)),
+        vreinterpretq_s32_u32(vceqq_s32(a.hi, b.hi))
+    };
+}
+
+static inline int vmovemask(vfloat x) noexcept {
+    const int32_t weights[4] { 1, 2, 4, 8 };
+    int32x4_t w = vld1q_s32(weights);
+    uint32x4_t lo = vshrq_n_u32(vreinterpretq_u32_f32(x.lo), 31);
+    uint32x4_t hi = vshrq_n_u32(vreinterpretq_u32_f32(x.hi), 31);
+    return vaddvq_s32(vmulq_s32(vreinterpretq_s32_u32(lo), w)) |
+        (vaddvq_s32(vmulq_s32(vreinterpretq_s32_u32(hi), w)) << 4);
+}
+
+static inline vint vblendv(vint a, vint b, vint mask) noexcept {
+    uint32x4_t lo = vreinterpretq_u32_s32(vshrq_n_s32(mask.lo, 31));
+    uint32x4_t hi = vreinterpretq_u32_s32(vshrq_n_s32(mask.hi, 31));
+    return { vbslq_s32(lo, b.lo, a.lo), vbslq_s32(hi, b.hi, a.hi) };
+}
+static inline vfloat vblendv(vfloat a, vfloat b, vfloat mask) noexcept {
+    return vcastf(vblendv(vcasti(a), vcasti(b), vcasti(mask)));
+}
+
+template <int imm>
+static inline vfloat vblend(vfloat a, vfloat b) noexcept {
+    return vblendv(a, b, vcastf(vsetri(
+        (imm & 1) ? -1 : 0, (imm & 2) ? -1 : 0, (imm & 4) ? -1 : 0, (imm & 8) ? -1 : 0,
+        (imm & 16) ? -1 : 0, (imm & 32) ? -1 : 0, (imm & 64) ? -1 : 0, (imm & 128) ? -1 : 0)));
+}
+
+static inline vint vpermute(vint x, vint index) noexcept {
+    // byte-wise table lookup on the 32-byte vector
+    uint8x16x2_t table { vreinterpretq_u8_s32(x.lo), vreinterpretq_u8_s32(x.hi) };
+    const uint8_t offsets[16] { 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3 };
+    uint8x16_t offset = vld1q_u8(offsets);
+    auto byte_index = [&](int32x4_t lane_index) {
+        // (lane_index & 7) * 4 replicated to each byte of the lane, plus byte offsets
+        uint32x4_t base = vmulq_n_u32(vandq_u32(vreinterpretq_u32_s32(lane_index), vdupq_n_u32(7)), 4 * 0x01010101u);
+        return vaddq_u8(vreinterpretq_u8_u32(base), offset);
+    };
+    return {
+        vreinterpretq_s32_u8(vqtbl2q_u8(table, byte_index(index.lo))),
+        vreinterpretq_s32_u8(vqtbl2q_u8(table, byte_index(index.hi)))
+    };
+}
+static inline vfloat vpermute(vfloat x, vint index) noexcept {
+    return vcastf(vpermute(vcasti(x), index));
+}
+
+static inline vfloat vreduce_add(vfloat x) noexcept {
+    float32x4_t pairs = vpaddq_f32(x.lo, x.hi); // {0+1, 2+3, 4+5, 6+7}
+    float32x4_t quads = vpaddq_f32(pairs, pairs);
+    float sum = vgetq_lane_f32(quads, 0) + vgetq_lane_f32(quads, 1);
+    return vsetf(sum);
+}
+
+static inline vint vreduce_add(vint x) noexcept {
+    int sum = vaddvq_s32(vaddq_s32(x.lo, x.hi));
+    return vseti(sum);
+}
+
+// Transposition of a 8x8 block.
+static inline void vtranspose(vfloat block[8]) noexcept {
+    // transposes the 4x4 sub-blocks and swaps the off-diagonal ones
+    auto transpose4 = [](float32x4_t & r0, float32x4_t & r1, float32x4_t & r2, float32x4_t & r3) {
+        float32x4x2_t t01 = vtrnq_f32(r0, r1);
+        float32x4x2_t t23 = vtrnq_f32(r2, r3);
+        r0 = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+        r1 = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+        r2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+        r3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+    };
+
+    transpose4(block[0].lo, block[1].lo, block[2].lo, block[3].lo);
+    transpose4(block[0].hi, block[1].hi, block[2].hi, block[3].hi);
+    transpose4(block[4].lo, block[5].lo, block[6].lo, block[7].lo);
+    transpose4(block[4].hi, block[5].hi, block[6].hi, block[7].hi);
+
+    for (int i = 0; i < 4; ++i) {
+        float32x4_t temp = block[i].hi;
+        block[i].hi = block[i + 4].lo;
+        block[i + 4].lo = temp;
+    }
+}
+
+static inline int popcount(unsigned int x) noexcept {
+    return vaddv_u8(vcnt_u8(vcreate_u8(x)));
+}
+
+#else // BM3D_SIMD_SCALAR
+
+static constexpr const char * simd_name = "scalar";
+
+static inline bool simd_supported() noexcept { return true; }
+
+struct vfloat { float v[8]; };
+struct vint { int32_t v[8]; };
+
+static inline vfloat vsetf(float x) noexcept { return { x, x, x, x, x, x, x, x }; }
+static inline vint vseti(int x) noexcept { return { x, x, x, x, x, x, x, x }; }
+
+static inline vfloat vsetrf(
+    float e0, float e1, float e2, float e3, float e4, float e5, float e6, float e7
+) noexcept {
+    return { e0, e1, e2, e3, e4, e5, e6, e7 };
+}
+
+static inline vint vsetri(
+    int e0, int e1, int e2, int e3, int e4, int e5, int e6, int e7
+) noexcept {
+    return { e0, e1, e2, e3, e4, e5, e6, e7 };
+}
+
+static inline vfloat vloadf(const float * p) noexcept {
+    vfloat r;
+    std::memcpy(r.v, p, sizeof(r.v));
+    return r;
+}
+static inline vfloat vloaduf(const float * p) noexcept { return vloadf(p); }
+static inline vint vloadui(const int * p) noexcept {
+    vint r;
+    std::memcpy(r.v, p, sizeof(r.v));
+    return r;
+}
+
+static inline void vstore(float * p, vfloat x) noexcept { std::memcpy(p, x.v, sizeof(x.v)); }
+static inline void vstoreu(float * p, vfloat x) noexcept { vstore(p, x); }
+static inline void vstoreu(int * p, vint x) noexcept { std::memcpy(p, x.v, sizeof(x.v)); }
+static inline void vstream(float * p, vfloat x) noexcept { vstore(p, x); }
+
+static inline vint vcasti(vfloat x) noexcept {
+    vint r;
+    std::memcpy(r.v, x.v, sizeof(r.v));
+    return r;
+}
+static inline vfloat vcastf(vint x) noexcept {
+    vfloat r;
+    std::memcpy(r.v, x.v, sizeof(r.v));
+    return r;
+}
+
+template <typename T, typename F>
+static inline T vmap(F f) noexcept {
+    T r;
+    for (int i = 0; i < 8; ++i) {
+        r.v[i] = f(i);
+    }
+    return r;
+}
+
+static inline vfloat vcvt(vint x) noexcept {
+    return vmap<vfloat>([&](int i) { return static_cast<float>(x.v[i]); });
+}
+
+static inline vfloat vadd(vfloat a, vfloat b) noexcept { return vmap<vfloat>([&](int i) { return a.v[i] + b.v[i]; }); }
+static inline vfloat vsub(vfloat a, vfloat b) noexcept { return vmap<vfloat>([&](int i) { return a.v[i] - b.v[i]; }); }
+static inline vfloat vmul(vfloat a, vfloat b) noexcept { return vmap<vfloat>([&](int i) { return a.v[i] * b.v[i]; }); }
+static inline vfloat vfmadd(vfloat a, vfloat b, vfloat c) noexcept {
+    return vmap<vfloat>([&](int i) { return std::fma(a.v[i], b.v[i], c.v[i]); });
+}
+static inline vfloat vfnmadd(vfloat a, vfloat b, vfloat c) noexcept {
+    return vmap<vfloat>([&](int i) { return std::fma(-a.v[i], b.v[i], c.v[i]); });
+}
+static inline vfloat vfmsub(vfloat a, vfloat b, vfloat c) noexcept {
+    return vmap<vfloat>([&](int i) { return std::fma(a.v[i], b.v[i], -c.v[i]); });
+}
+static inline vfloat vrcp(vfloat x) noexcept { return vmap<vfloat>([&](int i) { return 1.f / x.v[i]; }); }
+
+static inline vint vadd(vint a, vint b) noexcept {
+    return vmap<vint>([&](int i) { return static_cast<int32_t>(static_cast<uint32_t>(a.v[i]) + static_cast<uint32_t>(b.v[i])); });
+}
+static inline vint vsub(vint a, vint b) noexcept {
+    return vmap<vint>([&](int i) { return static_cast<int32_t>(static_cast<uint32_t>(a.v[i]) - static_cast<uint32_t>(b.v[i])); });
+}
+static inline vint vand(vint a, vint b) noexcept { return vmap<vint>([&](int i) { return a.v[i] & b.v[i]; }); }
+static inline vfloat vand(vfloat a, vfloat b) noexcept { return vcastf(vand(vcasti(a), vcasti(b))); }
+static inline vfloat vxor(vfloat a, vfloat b) noexcept {
+    vint x = vcasti(a), y = vcasti(b);
+    return vcastf(vmap<vint>([&](int i) { return x.v[i] ^ y.v[i]; }));
+}
+
+static inline vfloat vcmplt(vfloat a, vfloat b) noexcept {
+    return vcastf(vmap<vint>([&](int i) { return a.v[i] < b.v[i] ? -1 : 0; }));
+}
+static inline vfloat vcmpge(vfloat a, vfloat b) noexcept {
+    return vcastf(vmap<vint>([&](int i) { return a.v[i] >= b.v[i] ? -1 : 0; }));
+}
+static inline vint vcmpeq(vint a, vint b) noexcept {
+    return vmap<vint>([&](int i) { return a.v[i] == b.v[i] ? -1 : 0; });
+}
+
+static inline int vmovemask(vfloat x) noexcept {
+    vint bits = vcasti(x);
+    int mask = 0;
+    for (int i = 0; i < 8; ++i) {
+        mask |= (bits.v[i] < 0) << i;
+    }
+    return mask;
+}
+
+static inline vint vblendv(vint a, vint b, vint mask) noexcept {
+    return vmap<vint>([&](int i) { return mask.v[i] < 0 ? b.v[i] : a.v[i]; });
+}
+static inline vfloat vblendv(vfloat a, vfloat b, vfloat mask) noexcept {
+    return vcastf(vblendv(vcasti(a), vcasti(b), vcasti(mask)));
+}
+
+template <int imm>
+static inline vfloat vblend(vfloat a, vfloat b) noexcept {
+    return vmap<vfloat>([&](int i) { return ((imm >> i) & 1) ? b.v[i] : a.v[i]; });
+}
+
+static inline vint vpermute(vint x, vint index) noexcept {
+    return vmap<vint>([&](int i) { return x.v[index.v[i] & 7]; });
+}
+static inline vfloat vpermute(vfloat x, vint index) noexcept {
+    return vmap<vfloat>([&](int i) { return x.v[index.v[i] & 7]; });
+}
+
+// same order of summation as the AVX2 backend
+static inline vfloat vreduce_add(vfloat x) noexcept {
+    const float * v = x.v;
+    float sum = ((v[0] + v[1]) + (v[2] + v[3])) + ((v[4] + v[5]) + (v[6] + v[7]));
+    return vsetf(sum);
+}
+
+static inline vint vreduce_add(vint x) noexcept {
+    uint32_t sum = 0;
+    for (int i = 0; i < 8; ++i) {
+        sum += static_cast<uint32_t>(x.v[i]);
+    }
+    return vseti(static_cast<int32_t>(sum));
+}
+
+// Transposition of a 8x8 block.
+static inline void vtranspose(vfloat block[8]) noexcept {
+    for (int i = 0; i < 8; ++i) {
+        for (int j = i + 1; j < 8; ++j) {
+            float temp = block[i].v[j];
+            block[i].v[j] = block[j].v[i];
+            block[j].v[i] = temp;
+        }
+    }
+}
+
+static inline int popcount(unsigned int x) noexcept {
+    int count = 0;
+    for (; x; x &= x - 1) {
+        ++count;
+    }
+    return count;
+}
+
+#endif
@@ -0,0 +1,365 @@
+// Cross-check of the SIMD backends of BM3DCPU
+//
+// The same program is built twice, once for the SIMD backend of the target
+// (`bm3d_simd_test`) and once with `BM3D_SIMD_SCALAR` (`bm3d_simd_test_scalar`).
+// Both evaluate the primitives of simd.h and a few short passes of `bm3d`
+// on deterministic input, and the results of the scalar build serve as reference:
+//
+//     bm3d_simd_test_scalar write reference.bin
+//     bm3d_simd_test compare reference.bin
+
+#include <cstdio>
+
+#include "source.cpp"
+
+static constexpr uint32_t results_magic = 0x42334453; // "SD3B"
+
+// deterministic pseudo-random numbers in [0, 1)
+struct Random {
+    uint32_t state;
+
+    float next() noexcept {
+        state = state * 1664525u + 1013904223u;
+        return static_cast<float>(state >> 8) / static_cast<float>(1 << 24);
+    }
+};
+
+// zero-initialized frame memory with the alignment of `vloadf`
+struct AlignedFree {
+    void operator()(float * p) const noexcept { vsh::vsh_aligned_free(p); }
+};
+
+static std::unique_ptr<float[], AlignedFree> aligned_floats(size_t size) {
+    float * p = vsh::vsh_aligned_malloc<float>(sizeof(float) * size, 32);
+    std::memset(p, 0, sizeof(float) * size);
+    return std::unique_ptr<float[], AlignedFree> { p };
+}
+
+struct Results {
+    std::vector<float> values;
+    std::vector<std::string> names; // name of the test of each value
+
+    void add(const char * name, float value) {
+        values.push_back(value);
+        names.emplace_back(name);
+    }
+
+    void add(const char * name, vfloat x) {
+        float lanes[8];
+        vstoreu(lanes, x);
+        for (float lane : lanes) {
+            add(name, lane);
+        }
+    }
+
+    void add(const char * name, vint x) {
+        int lanes[8];
+        vstoreu(lanes, x);
+        for (int lane : lanes) {
+            add(name, static_cast<float>(lane));
+        }
+    }
+};
+
+static void test_primitives(Results & results) {
+    Random random { 1 };
+
+    float fa[8], fb[8], fc[8];
+    int ia[8], ib[8];
+    for (int i = 0; i < 8; ++i) {
+        fa[i] = random.next() * 4.f - 2.f;
+        fb[i] = random.next() * 4.f - 2.f;
+        fc[i] = random.next() * 4.f - 2.f;
+        ia[i] = static_cast<int>(random.next() * 2000.f) - 1000;
+        ib[i] = static_cast<int>(random.next() * 2000.f) - 1000;
+    }
+    // equal lanes for the comparisons
+    fb[3] = fa[3];
+    ib[5] = ia[5];
+
+    const vfloat a = vloaduf(fa);
+    const vfloat b = vloaduf(fb);
+    const vfloat c = vloaduf(fc);
+    const vint ai = vloadui(ia);
+    const vint bi = vloadui(ib);
+
+    results.add("vsetf", vsetf(0.75f));
+    results.add("vseti", vseti(-3));
+    results.add("vsetrf", vsetrf(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f));
+    results.add("vsetri", vsetri(7, 6, 5, 4, 3, 2, 1, 0));
+    results.add("vcvt", vcvt(ai));
+
+    results.add("vadd", vadd(a, b));
+    results.add("vsub", vsub(a, b));
+    results.add("vmul", vmul(a, b));
+    results.add("vfmadd", vfmadd(a, b, c));
+    results.add("vfnmadd", vfnmadd(a, b, c));
+    results.add("vfmsub", vfmsub(a, b, c));
+    results.add("vrcp", vrcp(a));
+
+    results.add("vadd(vint)", vadd(ai, bi));
+    results.add("vsub(vint)", vsub(ai, bi));
+    results.add("vand(vint)", vand(ai, bi));
+
+    const vfloat lt = vcmplt(a, b);
+    const vfloat ge = vcmpge(a, b);
+    const vint eq = vcmpeq(ai, bi);
+    results.add("vcmplt", static_cast<float>(vmovemask(lt)));
+    results.add("vcmpge", static_cast<float>(vmovemask(ge)));
+    results.add("vcmpeq", vcvt(eq));
+    results.add("vand", vand(a, lt));
+    results.add("vxor", vxor(a, vsetf(-0.f)));
+    results.add("vcasti", vcasti(vsetf(1.f)));
+    results.add("vcastf", vcastf(vseti(0x3f800000)));
+
+    results.add("vblendv", vblendv(a, b, lt));
+    results.add("vblendv(vint)", vblendv(ai, bi, eq));
+    results.add("vblend", vblend<0b10110010>(a, b));
+
+    const vint index = vsetri(3, 0, 7, 7, 1, 6, 2, 5);
+    results.add("vpermute", vpermute(a, index));
+    results.add("vpermute(vint)", vpermute(ai, index));
+    results.add("shuffle_up", shuffle_up(ai));
+
+    results.add("vreduce_add", vreduce_add(a));
+    results.add("vreduce_add(vint)", vreduce_add(ai));
+
+    vfloat block[8];
+    for (int i = 0; i < 8; ++i) {
+        block[i] = vsetrf(
+            8.f * i + 0.f, 8.f * i + 1.f, 8.f * i + 2.f, 8.f * i + 3.f,
+            8.f * i + 4.f, 8.f * i + 5.f, 8.f * i + 6.f, 8.f * i + 7.f);
+    }
+    vtranspose(block);
+    for (const auto & row : block) {
+        results.add("vtranspose", row);
+    }
+
+    for (unsigned int x : { 0u, 1u, 0xffu, 0x80000001u, 0xdeadbeefu }) {
+        results.add("popcount", static_cast<float>(popcount(x)));
+    }
+}
+
+// noisy gradient in [0, 1]
+static void fill_plane(float * dstp, int width, int height, int stride, uint32_t seed) {
+    Random random { seed };
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            float value = 0.25f + 0.5f * (x + 2 * y) / (width + 2 * height) + 0.1f * (random.next() - 0.5f);
+            dstp[y * stride + x] = value;
+        }
+    }
+}
+
+template <bool chroma>
+static void run_bm3d(
+    Results & results, const char * name,
+    int radius, bool final_, bool nlm, int tile_size
+) {
+    constexpr int width = 64;
+    constexpr int height = 48;
+    constexpr int stride = width;
+    constexpr int plane_size = stride * height;
+    constexpr int block_step = 4;
+    constexpr int bm_range = 6;
+    constexpr int ps_num = 2;
+    constexpr int ps_range = 4;
+
+    const int temporal_width = 2 * radius + 1;
+    const int planes = num_planes(chroma);
+
+    const size_t src_size = static_cast<size_t>(plane_size) * planes * temporal_width;
+    auto src = aligned_floats(src_size);
+    for (int i = 0; i < planes * temporal_width; ++i) {
+        fill_plane(&src[static_cast<size_t>(i) * plane_size], width, height, stride, 7 + i);
+    }
+
+    std::vector<const float *> srcps;
+    std::vector<const float *> matchps;
+    for (int plane = 0; plane < planes; ++plane) {
+        for (int i = 0; i < temporal_width; ++i) {
+            srcps.push_back(&src[static_cast<size_t>(plane * temporal_width + i) * plane_size]);
+        }
+    }
+    for (int i = 0; i < temporal_width; ++i) {
+        matchps.push_back(srcps[i]);
+    }
+
+    std::array<float, num_planes(chroma)> sigma;
+    for (auto & s : sigma) {
+        s = 10.f * ((3.f / 4.f) / 255.f * 64.f * (final_ ? 1.0f : 2.7f));
+    }
+
+    // the basic estimate is simulated by a smoothed source
+    auto ref = aligned_floats(src_size);
+    for (size_t i = 0; i < src_size; ++i) {
+        ref[i] = 0.5f * src[i] + 0.5f * src[i - (i % plane_size != 0)];
+    }
+    std::vector<const float *> refps;
+    for (const float * srcp : srcps) {
+        refps.push_back(&ref[srcp - src.get()]);
+    }
+
+    const size_t output_size = radius == 0
+        ? static_cast<size_t>(plane_size)
+        : static_cast<size_t>(plane_size) * 2 * temporal_width;
+    auto dst = aligned_floats(output_size * planes);
+    std::array<float * VS_RESTRICT, num_planes(chroma)> dstps;
+    for (int plane = 0; plane < planes; ++plane) {
+        dstps[plane] = &dst[output_size * plane];
+    }
+
+    auto buffer = aligned_floats(static_cast<size_t>(plane_size) * 2 * planes);
+    std::vector<float> tile_buffer(tile_buffer_size(tile_size, block_step, bm_range, chroma));
+    SearchStats stats {};
+
+    const auto dispatch = [&](auto temporal_tag, auto final_tag) {
+        constexpr bool temporal = decltype(temporal_tag)::value;
+        constexpr bool is_final = decltype(final_tag)::value;
+
+        std::conditional_t<is_final, const float * VS_RESTRICT *, std::nullptr_t> refps_arg {};
+        if constexpr (is_final) {
+            refps_arg = refps.data();
+        }
+        std::conditional_t<temporal, std::nullptr_t, float * VS_RESTRICT> buffer_arg {};
+        if constexpr (!temporal) {
+            buffer_arg = buffer.get();
+        }
+
+        bm3d<temporal, chroma, is_final>(
+            dstps, stride, srcps.data(), refps_arg, matchps.data(),
+            width, height, sigma, block_step, bm_range,
+            radius, ps_num, ps_range, 0.f,
+            false, nlm, buffer_arg, tile_size, tile_buffer.data(), 0, height, stats,
+            nullptr, 0);
+
+        if constexpr (!temporal) {
+            bm3d_aggregation<chroma>(dstps, stride, buffer.get(), sigma, false, width, height, 0, height);
+        }
+    };
+
+    if (radius == 0) {
+        if (final_) {
+            dispatch(std::false_type {}, std::true_type {});
+        } else {
+            dispatch(std::false_type {}, std::false_type {});
+        }
+    } else {
+        if (final_) {
+            dispatch(std::true_type {}, std::true_type {});
+        } else {
+            dispatch(std::true_type {}, std::false_type {});
+        }
+    }
+
+    for (size_t i = 0; i < output_size * planes; ++i) {
+        results.add(name, dst[i]);
+    }
+}
+
+static void test_bm3d(Results & results) {
+    run_bm3d<false>(results, "bm3d basic", 0, false, false, 0);
+    run_bm3d<false>(results, "bm3d final", 0, true, false, 0);
+    run_bm3d<false>(results, "bm3d tiled", 0, false, false, 16);
+    run_bm3d<false>(results, "bm3d nlm", 0, false, true, 0);
+    run_bm3d<false>(results, "v-bm3d basic", 1, false, false, 0);
+    run_bm3d<false>(results, "v-bm3d final", 1, true, false, 0);
+    run_bm3d<true>(results, "cbm3d basic", 0, false, false, 0);
+    run_bm3d<true>(results, "cbm3d final", 0, true, false, 0);
+}
+
+// Results of different backends may differ in rounding, in the precision of
+// `vrcp` and, in rare cases, in the choice of blocks of similar distances.
+static int compare(const Results & results, const std::vector<float> & reference) {
+    if (reference.size() != results.values.size()) {
+        std::fprintf(stderr, "size mismatch: %zu vs %zu\n", results.values.size(), reference.size());
+        return 1;
+    }
+
+    constexpr float primitive_tolerance = 1e-3f; // relative
+    constexpr float pixel_tolerance = 5e-2f;
+    constexpr float mean_tolerance = 1e-4f;
+
+    int failures = 0;
+    double error_sum = 0.0;
+    size_t num_pixels = 0;
+
+    for (size_t i = 0; i < reference.size(); ++i) {
+        const std::string & name = results.names[i];
+        const float value = results.values[i];
+        const float error = std::abs(value - reference[i]);
+        const bool is_pixel = name.find("bm3d") != std::string::npos;
+
+        bool ok;
+        if (is_pixel) {
+            ok = std::isfinite(value) && error <= pixel_tolerance;
+            error_sum += error;
+            ++num_pixels;
+        } else {
+            ok = error <= primitive_tolerance * std::max(1.f, std::abs(reference[i]));
+        }
+
+        if (!ok && failures++ < 20) {
+            std::fprintf(stderr, "%s [%zu]: %g vs %g\n", name.c_str(), i, value, reference[i]);
+        }
+    }
+
+    const double mean_error = num_pixels ? error_sum / num_pixels : 0.0;
+    std::printf("%s vs scalar: %d mismatches, mean error of pixels %g\n", simd_name, failures, mean_error);
+
+    return (failures == 0 && mean_error <= mean_tolerance) ? 0 : 1;
+}
+
+int main(int argc, char ** argv) {
+    if (argc != 3 || (std::strcmp(argv[1], "write") != 0 && std::strcmp(argv[1], "compare") != 0)) {
+        std::fprintf(stderr, "usage: %s write|compare <file>\n", argv[0]);
+        return 2;
+    }
+
+    if (!simd_supported()) {
+        std::fprintf(stderr, "%s is not supported by the cpu\n", simd_name);
+        return 2;
+    }
+
+    Results results;
+    test_primitives(results);
+    test_bm3d(results);
+
+    if (std::strcmp(argv[1], "write") == 0) {
+        FILE * file = std::fopen(argv[2], "wb");
+        if (!file) {
+            std::perror(argv[2]);
+            return 2;
+        }
+        const uint32_t header[2] { results_magic, static_cast<uint32_t>(results.values.size()) };
+        bool ok = std::fwrite(header, sizeof(header), 1, file) == 1 &&
+            std::fwrite(results.values.data(), sizeof(float), results.values.size(), file) == results.values.size();
+        ok = (std::fclose(file) == 0) && ok;
+        if (!ok) {
+            std::fprintf(stderr, "failed to write %s\n", argv[2]);
+            return 2;
+        }
+        std::printf("%s: %zu values written\n", simd_name, results.values.size());
+        return 0;
+    }
+
+    FILE * file = std::fopen(argv[2], "rb");
+    if (!file) {
+        std::perror(argv[2]);
+        return 2;
+    }
+    uint32_t header[2] {};
+    std::vector<float> reference;
+    bool ok = std::fread(header, sizeof(header), 1, file) == 1 && header[0] == results_magic;
+    if (ok) {
+        reference.resize(header[1]);
+        ok = std::fread(reference.data(), sizeof(float), reference.size(), file) == reference.size();
+    }
+    std::fclose(file);
+    if (!ok) {
+        std::fprintf(stderr, "invalid reference %s\n", argv[2]);
+        return 2;
+    }
+
+    return compare(results, reference);
+}
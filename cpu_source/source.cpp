@@ -26,6 +26,9 @@
 // [2] K. Dabov, A. Foi and K. Egiazarian,
 //     "Video denoising by sparse 3D transform-domain collaborative filtering,"
 //     proceedings of the 15th European Signal Processing Conference, 2007, pp. 145-149.
+// [3] A. Buades, B. Coll and J.-M. Morel,
+//     "Non-Local Means Denoising,"
+//     Image Processing On Line, vol. 1, pp. 208-212, 2011, doi: 10.5201/ipol.2011.bcm_nlm.
 
 // Wordings:
 // The coordinate of a block is denoted by the coordinate of its top-left pixel.
@@ -44,11 +47,18 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <limits>
+#include <list>
+#include <memory>
 #include <mutex>
 #include <shared_mutex>
 #include <stdexcept>
@@ -56,15 +66,19 @@
 #include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include <VapourSynth4.h>
 #include <VSHelper4.h>
 
-#include <immintrin.h>
-
-#include "cpuid.h"
+#include "simd.h"
+#include "artifact.h"
+#include "perf.h"
+#include "remote.h"
+#include "spill.h"
+#include "trace.h"
 
 static VSPlugin * myself = nullptr;
 
@@ -79,60 +93,83 @@ struct BM3DData {
     int radius;
     int ps_num[3];
     int ps_range[3];
+    float ps_gate;
+    int coverage; // minimum coverage of skipped reference blocks, 0 if disabled
+    int tile; // size of tiles of tile-local accumulation in spatial BM3D, 0 if disabled
     bool chroma;
+    bool opp; // RGB input of CBM3D, processed in the opponent color space
+    bool nlm; // weighted averaging of groups instead of collaborative filtering
+    bool fields; // fields of interlaced frames are processed separately
     bool zero_init;
 
+    // the only plane of output frames of V-BM3D if unprocessed planes are pruned,
+    // which are of `pruned_format`, -1 otherwise
+    int pruned_plane;
+    VSVideoFormat pruned_format;
+
     bool process[3]; // sigma != 0
 
-    std::unordered_map<std::thread::id, float *> buffer; // not used by V-BM3D
+    std::unordered_map<std::thread::id, float *> buffer; // not used by V-BM3D, except for RGB input
     std::shared_mutex buffer_lock;
-};
 
-// shuffle_up({0, 1, ..., 7}) => {0, 0, 1, ..., 6}
-static inline __m256i shuffle_up(__m256i x) noexcept {
-    __m256i pre_mask { _mm256_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6) };
-    return _mm256_permutevar8x32_epi32(x, pre_mask);
-}
+    // V-BM3D of `batch` consecutive frames sharing one window of input frames
+    int batch;
+    std::list<std::pair<int, const VSFrame *>> batch_cache; // computed but not yet requested
+    int batch_cache_capacity;
+    std::unordered_set<int> batch_pending; // first frames of batches being computed
+    std::mutex batch_lock;
+    std::condition_variable batch_cv;
 
-// Reduction operation of YMM lanes
-static inline __m256 reduce_add(__m256 x) noexcept {
-    x = _mm256_add_ps(x, _mm256_permute_ps(x, 0b10110001));
-    x = _mm256_add_ps(x, _mm256_permute_ps(x, 0b01001110));
-    x = _mm256_add_ps(x, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(x), 0b01001110)));
-    return x;
-}
+    // statistics of the predictive search, reported when the filter is freed
+    std::atomic<int64_t> num_searched;
+    std::atomic<int64_t> num_skipped;
+
+    std::shared_ptr<TraceFile> trace; // null if disabled
+    uint32_t trace_instance;
+
+    // budget of the plugin-wide `ArtifactStore` in bytes, 0 if not used
+    size_t artifact_budget;
 
-// Reduction operation of YMM lanes
-static inline __m256i reduce_add(__m256i x) noexcept {
-    x = _mm256_add_epi32(x, _mm256_castps_si256(_mm256_permute_ps(_mm256_castsi256_ps(x), 0b10110001)));
-    x = _mm256_add_epi32(x, _mm256_castps_si256(_mm256_permute_ps(_mm256_castsi256_ps(x), 0b01001110)));
-    x = _mm256_add_epi32(x, _mm256_permute4x64_epi64(x, 0b01001110));
-    return x;
+    PerfSummary perf; // reported when the filter is freed
+    std::string perf_path; // JSON output of `perf`, empty if disabled
+
+    // frames are denoised by a `bm3d_server` process, see "remote.h", null if local
+    std::unique_ptr<remote::Client> remote;
+};
+
+// indices of stages and caches of `BM3DData::perf`
+enum BM3DPerfStage { bm3d_stage_prepare, bm3d_stage_denoise };
+enum BM3DPerfCache { bm3d_cache_batch, bm3d_cache_artifact };
+
+// shuffle_up({0, 1, ..., 7}) => {0, 0, 1, ..., 6}
+static inline vint shuffle_up(vint x) noexcept {
+    vint pre_mask { vsetri(0, 0, 1, 2, 3, 4, 5, 6) };
+    return vpermute(x, pre_mask);
 }
 
 static inline void load_block(
-    __m256 dst[8], const float * srcp, int stride
+    vfloat dst[8], const float * srcp, int stride
 ) noexcept {
 
     for (int i = 0; i < 8; ++i) {
-        dst[i] = _mm256_loadu_ps(&srcp[i * stride]);
+        dst[i] = vloaduf(&srcp[i * stride]);
     }
 }
 
 // Returns the sum of square distance of input blocks
-static inline __m256 compute_distance(
-    const __m256 reference_block[8], const __m256 candidate_block[8]
+static inline vfloat compute_distance(
+    const vfloat reference_block[8], const vfloat candidate_block[8]
 ) noexcept {
 
     // manual unroll
-    __m256 errors[2] {};
+    vfloat errors[2] {};
 
     for (int i = 0; i < 8; ++i) {
-        __m256 row_diff = _mm256_sub_ps(reference_block[i], candidate_block[i]);
-        errors[i % 2] = _mm256_fmadd_ps(row_diff, row_diff, errors[i % 2]);
+        vfloat row_diff = vsub(reference_block[i], candidate_block[i]);
+        errors[i % 2] = vfmadd(row_diff, row_diff, errors[i % 2]);
     }
 
-    return reduce_add(_mm256_add_ps(errors[0], errors[1]));
+    return vreduce_add(vadd(errors[0], errors[1]));
 }
 
 // Given a `reference_block`, finds 8 most similar blocks
@@ -144,7 +181,7 @@ static inline void block_matching(
     std::array<float, 8> & errors,
     std::array<int, 8> & index_x,
     std::array<int, 8> & index_y,
-    const __m256 reference_block[8],
+    const vfloat reference_block[8],
     const float * srcp, int stride,
     int width, int height,
     int bm_range, int x, int y
@@ -155,7 +192,7 @@ static inline void block_matching(
         0,
         0, 0, 0, 0, 0, 0, 0, -1,
         0, 0, 0, 0, 0, 0, 0, 0 };
-    __m256i shift_base = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    vint shift_base = vsetri(0, 1, 2, 3, 4, 5, 6, 7);
 
     // clamps candidate locations to be within the plane
     int left = std::max(x - bm_range, 0);
@@ -163,43 +200,42 @@ static inline void block_matching(
     int top = std::max(y - bm_range, 0);
     int bottom = std::min(y + bm_range, height - 8);
 
-    __m256 errors8 { _mm256_loadu_ps(errors.data()) };
-    __m256i index8_x { _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index_x.data())) };
-    __m256i index8_y { _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index_y.data())) };
+    vfloat errors8 { vloaduf(errors.data()) };
+    vint index8_x { vloadui(index_x.data()) };
+    vint index8_y { vloadui(index_y.data()) };
 
     const float * srcp_row = &srcp[top * stride + left];
     for (int row = top; row <= bottom; ++row) {
         const float * srcp = srcp_row; // pointer to 2D neighborhoods
         for (int col = left; col <= right; ++col) {
-            __m256 candidate_block[8];
+            vfloat candidate_block[8];
             load_block(candidate_block, srcp, stride);
 
-            __m256 error = compute_distance(reference_block, candidate_block);
+            vfloat error = compute_distance(reference_block, candidate_block);
 
-            __m256 flag { _mm256_cmp_ps(error, errors8, _CMP_LT_OQ) };
+            vfloat flag { vcmplt(error, errors8) };
 
-            if (int imask = _mm256_movemask_ps(flag); imask) {
-                __m256i shuffle_mask = _mm256_add_epi32(
-                    shift_base, _mm256_castps_si256(flag));
-                __m256 pre_error = _mm256_permutevar8x32_ps(
+            if (int imask = vmovemask(flag); imask) {
+                vint shuffle_mask = vadd(
+                    shift_base, vcasti(flag));
+                vfloat pre_error = vpermute(
                     errors8, shuffle_mask);
-                __m256i pre_index_x = _mm256_permutevar8x32_epi32(
+                vint pre_index_x = vpermute(
                     index8_x, shuffle_mask);
-                __m256i pre_index_y = _mm256_permutevar8x32_epi32(
+                vint pre_index_y = vpermute(
                     index8_y, shuffle_mask);
 
-                int count = _mm_popcnt_u32(static_cast<unsigned int>(imask));
-                __m256 blend_mask = _mm256_castsi256_ps(_mm256_loadu_si256(
-                    reinterpret_cast<const __m256i *>(&blend[count])));
-                errors8 = _mm256_blendv_ps(
+                int count = popcount(static_cast<unsigned int>(imask));
+                vfloat blend_mask = vcastf(vloadui(&blend[count]));
+                errors8 = vblendv(
                     pre_error, error, blend_mask);
-                index8_x = _mm256_castps_si256(_mm256_blendv_ps(
-                    _mm256_castsi256_ps(pre_index_x),
-                    _mm256_castsi256_ps(_mm256_set1_epi32(col)),
+                index8_x = vcasti(vblendv(
+                    vcastf(pre_index_x),
+                    vcastf(vseti(col)),
                     blend_mask));
-                index8_y = _mm256_castps_si256(_mm256_blendv_ps(
-                    _mm256_castsi256_ps(pre_index_y),
-                    _mm256_castsi256_ps(_mm256_set1_epi32(row)),
+                index8_y = vcasti(vblendv(
+                    vcastf(pre_index_y),
+                    vcastf(vseti(row)),
                     blend_mask));
             }
 
@@ -209,23 +245,35 @@ static inline void block_matching(
         srcp_row += stride;
     }
 
-    _mm256_storeu_ps(errors.data(), errors8);
-    _mm256_storeu_si256(reinterpret_cast<__m256i *>(index_x.data()), index8_x);
-    _mm256_storeu_si256(reinterpret_cast<__m256i *>(index_y.data()), index8_y);
+    vstoreu(errors.data(), errors8);
+    vstoreu(index_x.data(), index8_x);
+    vstoreu(index_y.data(), index8_y);
 }
 
+// Numbers of temporal block searches performed and skipped by the predictive search,
+// i.e. searches of one neighbouring frame for one reference block
+struct SearchStats {
+    int64_t num_searched;
+    int64_t num_skipped;
+};
+
 // Similar to function `block_matching`, but with candidate locations
 // extended to other planes on the temporal axis
 // and using predictive search instead of exhaustive search.
+//
+// The search in a direction stops at a frame whose best match has an error
+// above `ps_gate` times that of the worst spatial match, e.g. in occlusion,
+// fast motion or flashes. The gate is disabled if `ps_gate` is zero.
 static inline void block_matching_temporal(
     std::array<float, 8> & errors,
     std::array<int, 8> & index_x,
     std::array<int, 8> & index_y,
     std::array<int, 8> & index_z,
-    const __m256 reference_block[8],
+    const vfloat reference_block[8],
     const float * VS_RESTRICT global_srcps[/* 2 * radius + 1 */],
     int stride, int width, int height, int bm_range,
-    int x, int y, int radius, int ps_num, int ps_range
+    int x, int y, int radius, int ps_num, int ps_range,
+    float ps_gate, SearchStats & stats
 ) noexcept {
 
     // helper data
@@ -233,7 +281,7 @@ static inline void block_matching_temporal(
         0,
         0, 0, 0, 0, 0, 0, 0, -1,
         0, 0, 0, 0, 0, 0, 0, 0 };
-    __m256i shift_base = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    vint shift_base = vsetri(0, 1, 2, 3, 4, 5, 6, 7);
 
     int center = radius;
 
@@ -246,10 +294,12 @@ static inline void block_matching_temporal(
 
     index_z.fill(center);
 
-    __m256 errors8 { _mm256_loadu_ps(errors.data()) };
-    __m256i index8_x { _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index_x.data())) };
-    __m256i index8_y { _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index_y.data())) };
-    __m256i index8_z { _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index_z.data())) };
+    const float gate_threshold = ps_gate * errors[7];
+
+    vfloat errors8 { vloaduf(errors.data()) };
+    vint index8_x { vloadui(index_x.data()) };
+    vint index8_y { vloadui(index_y.data()) };
+    vint index8_z { vloadui(index_z.data()) };
 
     std::array<int, 8> center_index8_x { index_x };
     std::array<int, 8> center_index8_y { index_y };
@@ -273,125 +323,137 @@ static inline void block_matching_temporal(
                     ps_range, last_index8_x[i], last_index8_y[i]);
             }
             for (int i = 0; i < ps_num; ++i) {
-                __m256 error = _mm256_set1_ps(frame_errors8[i]);
+                vfloat error = vsetf(frame_errors8[i]);
 
-                __m256 flag { _mm256_cmp_ps(error, errors8, _CMP_LT_OQ) };
+                vfloat flag { vcmplt(error, errors8) };
 
-                if (int imask = _mm256_movemask_ps(flag); imask) {
-                    __m256i shuffle_mask = _mm256_add_epi32(
-                        shift_base, _mm256_castps_si256(flag));
-                    __m256 pre_error = _mm256_permutevar8x32_ps(
+                if (int imask = vmovemask(flag); imask) {
+                    vint shuffle_mask = vadd(
+                        shift_base, vcasti(flag));
+                    vfloat pre_error = vpermute(
                         errors8, shuffle_mask);
-                    __m256i pre_index_x = _mm256_permutevar8x32_epi32(
+                    vint pre_index_x = vpermute(
                         index8_x, shuffle_mask);
-                    __m256i pre_index_y = _mm256_permutevar8x32_epi32(
+                    vint pre_index_y = vpermute(
                         index8_y, shuffle_mask);
-                    __m256i pre_index_z = _mm256_permutevar8x32_epi32(
+                    vint pre_index_z = vpermute(
                         index8_z, shuffle_mask);
 
-                    int count = _mm_popcnt_u32(static_cast<unsigned int>(imask));
-                    __m256 blend_mask = _mm256_castsi256_ps(_mm256_loadu_si256(
-                        reinterpret_cast<const __m256i *>(&blend[count])));
-                    errors8 = _mm256_blendv_ps(
+                    int count = popcount(static_cast<unsigned int>(imask));
+                    vfloat blend_mask = vcastf(vloadui(&blend[count]));
+                    errors8 = vblendv(
                         pre_error, error, blend_mask);
-                    index8_x = _mm256_castps_si256(_mm256_blendv_ps(
-                        _mm256_castsi256_ps(pre_index_x),
-                        _mm256_castsi256_ps(_mm256_set1_epi32(frame_index8_x[i])),
+                    index8_x = vcasti(vblendv(
+                        vcastf(pre_index_x),
+                        vcastf(vseti(frame_index8_x[i])),
                         blend_mask));
-                    index8_y = _mm256_castps_si256(_mm256_blendv_ps(
-                        _mm256_castsi256_ps(pre_index_y),
-                        _mm256_castsi256_ps(_mm256_set1_epi32(frame_index8_y[i])),
+                    index8_y = vcasti(vblendv(
+                        vcastf(pre_index_y),
+                        vcastf(vseti(frame_index8_y[i])),
                         blend_mask));
-                    index8_z = _mm256_castps_si256(_mm256_blendv_ps(
-                        _mm256_castsi256_ps(pre_index_z),
-                        _mm256_castsi256_ps(_mm256_set1_epi32(z)),
+                    index8_z = vcasti(vblendv(
+                        vcastf(pre_index_z),
+                        vcastf(vseti(z)),
                         blend_mask));
                 }
             }
 
             last_index8_x = frame_index8_x;
             last_index8_y = frame_index8_y;
+
+            ++stats.num_searched;
+            if (ps_gate > 0.f && frame_errors8[0] > gate_threshold) {
+                stats.num_skipped += radius - t;
+                break;
+            }
         }
     }
 
-    _mm256_storeu_ps(errors.data(), errors8);
-    _mm256_storeu_si256(reinterpret_cast<__m256i *>(index_x.data()), index8_x);
-    _mm256_storeu_si256(reinterpret_cast<__m256i *>(index_y.data()), index8_y);
-    _mm256_storeu_si256(reinterpret_cast<__m256i *>(index_z.data()), index8_z);
+    vstoreu(errors.data(), errors8);
+    vstoreu(index_x.data(), index8_x);
+    vstoreu(index_y.data(), index8_y);
+    vstoreu(index_z.data(), index8_z);
 }
 
 // Set the first element in the arrays of coordinates to be (`x`, `y`)
-// if the coordinate is not in the array
+// if the coordinate is not in the array,
+// with `errors` shifted accordingly and a zero distance to itself
 static inline void insert_if_not_in(
+    std::array<float, 8> &errors8_data,
     std::array<int, 8> &index8_x_data,
     std::array<int, 8> &index8_y_data,
     int x, int y
 ) noexcept {
 
-    const __m256i first_mask { _mm256_setr_epi32(0xFFFFFFFF, 0, 0, 0, 0, 0, 0, 0) };
+    const vint first_mask { vsetri(0xFFFFFFFF, 0, 0, 0, 0, 0, 0, 0) };
 
-    __m256i index8_x { _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index8_x_data.data())) };
-    __m256i index8_y { _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index8_y_data.data())) };
+    vint index8_x { vloadui(index8_x_data.data()) };
+    vint index8_y { vloadui(index8_y_data.data()) };
 
-    __m256i current_index_x { _mm256_set1_epi32(x) };
-    __m256i current_index_y { _mm256_set1_epi32(y) };
-    __m256i flag {
-        _mm256_and_si256(
-            _mm256_cmpeq_epi32(index8_x, current_index_x),
-            _mm256_cmpeq_epi32(index8_y, current_index_y))
+    vint current_index_x { vseti(x) };
+    vint current_index_y { vseti(y) };
+    vint flag {
+        vand(
+            vcmpeq(index8_x, current_index_x),
+            vcmpeq(index8_y, current_index_y))
     };
 
-    if (!_mm256_movemask_ps(_mm256_castsi256_ps(flag))) {
-        __m256i pre_index_x { shuffle_up(index8_x) };
-        __m256i pre_index_y { shuffle_up(index8_y) };
-        index8_x = _mm256_blendv_epi8(pre_index_x, current_index_x, first_mask);
-        index8_y = _mm256_blendv_epi8(pre_index_y, current_index_y, first_mask);
+    if (!vmovemask(vcastf(flag))) {
+        vint pre_errors { shuffle_up(vcasti(vloaduf(errors8_data.data()))) };
+        vint pre_index_x { shuffle_up(index8_x) };
+        vint pre_index_y { shuffle_up(index8_y) };
+        vstoreu(errors8_data.data(), vcastf(vblendv(pre_errors, vseti(0), first_mask)));
+        index8_x = vblendv(pre_index_x, current_index_x, first_mask);
+        index8_y = vblendv(pre_index_y, current_index_y, first_mask);
     }
 
-    _mm256_storeu_si256(reinterpret_cast<__m256i *>(index8_x_data.data()), index8_x);
-    _mm256_storeu_si256(reinterpret_cast<__m256i *>(index8_y_data.data()), index8_y);
+    vstoreu(index8_x_data.data(), index8_x);
+    vstoreu(index8_y_data.data(), index8_y);
 }
 
 // Temporal version of function `insert_if_not_in`
 static inline void insert_if_not_in_temporal(
+    std::array<float, 8> &errors8_data,
     std::array<int, 8> &index8_x_data,
     std::array<int, 8> &index8_y_data,
     std::array<int, 8> &index8_z_data,
     int x, int y, int z
 ) noexcept {
 
-    const __m256i first_mask { _mm256_setr_epi32(0xFFFFFFFF, 0, 0, 0, 0, 0, 0, 0) };
+    const vint first_mask { vsetri(0xFFFFFFFF, 0, 0, 0, 0, 0, 0, 0) };
 
-    __m256i index8_x { _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index8_x_data.data())) };
-    __m256i index8_y { _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index8_y_data.data())) };
-    __m256i index8_z { _mm256_loadu_si256(reinterpret_cast<const __m256i *>(index8_z_data.data())) };
+    vint index8_x { vloadui(index8_x_data.data()) };
+    vint index8_y { vloadui(index8_y_data.data()) };
+    vint index8_z { vloadui(index8_z_data.data()) };
 
-    __m256i current_index_x { _mm256_set1_epi32(x) };
-    __m256i current_index_y { _mm256_set1_epi32(y) };
-    __m256i current_index_z { _mm256_set1_epi32(z) };
-    __m256i flag {
-        _mm256_and_si256(_mm256_and_si256(
-            _mm256_cmpeq_epi32(index8_x, current_index_x),
-            _mm256_cmpeq_epi32(index8_y, current_index_y)),
-            _mm256_cmpeq_epi32(index8_z, current_index_z))
+    vint current_index_x { vseti(x) };
+    vint current_index_y { vseti(y) };
+    vint current_index_z { vseti(z) };
+    vint flag {
+        vand(vand(
+            vcmpeq(index8_x, current_index_x),
+            vcmpeq(index8_y, current_index_y)),
+            vcmpeq(index8_z, current_index_z))
     };
 
-    if (!_mm256_movemask_ps(_mm256_castsi256_ps(flag))) {
-        __m256i pre_index_x { shuffle_up(index8_x) };
-        __m256i pre_index_y { shuffle_up(index8_y) };
-        __m256i pre_index_z { shuffle_up(index8_z) };
-        index8_x = _mm256_blendv_epi8(pre_index_x, current_index_x, first_mask);
-        index8_y = _mm256_blendv_epi8(pre_index_y, current_index_y, first_mask);
-        index8_z = _mm256_blendv_epi8(pre_index_z, current_index_z, first_mask);
+    if (!vmovemask(vcastf(flag))) {
+        vint pre_errors { shuffle_up(vcasti(vloaduf(errors8_data.data()))) };
+        vint pre_index_x { shuffle_up(index8_x) };
+        vint pre_index_y { shuffle_up(index8_y) };
+        vint pre_index_z { shuffle_up(index8_z) };
+        vstoreu(errors8_data.data(), vcastf(vblendv(pre_errors, vseti(0), first_mask)));
+        index8_x = vblendv(pre_index_x, current_index_x, first_mask);
+        index8_y = vblendv(pre_index_y, current_index_y, first_mask);
+        index8_z = vblendv(pre_index_z, current_index_z, first_mask);
     }
 
-    _mm256_storeu_si256(reinterpret_cast<__m256i *>(index8_x_data.data()), index8_x);
-    _mm256_storeu_si256(reinterpret_cast<__m256i *>(index8_y_data.data()), index8_y);
-    _mm256_storeu_si256(reinterpret_cast<__m256i *>(index8_z_data.data()), index8_z);
+    vstoreu(index8_x_data.data(), index8_x);
+    vstoreu(index8_y_data.data(), index8_y);
+    vstoreu(index8_z_data.data(), index8_z);
 }
 
 static inline void load_3d_group(
-    __m256 dst[64], const float * VS_RESTRICT srcp, int stride,
+    vfloat dst[64], const float * VS_RESTRICT srcp, int stride,
     const std::array<int, 8> &index_x, const std::array<int, 8> &index_y
 ) noexcept {
 
@@ -404,7 +466,7 @@ static inline void load_3d_group(
 }
 
 // Temporal version of function `load_3d_group`
-static inline void load_3d_group_temporal(__m256 dst[64],
+static inline void load_3d_group_temporal(vfloat dst[64],
     const float * VS_RESTRICT srcps[/* 2 * radius + 1 */], int stride,
     const std::array<int, 8> &index_x,
     const std::array<int, 8> &index_y,
@@ -420,11 +482,63 @@ static inline void load_3d_group_temporal(__m256 dst[64],
     }
 }
 
+// Coefficients of the opponent color transform, i.e.
+// Y = (R + G + B) / 3, U = (R - B) / 2, V = (R - 2G + B) / 4
+static constexpr float opp_coeffs[3][3] {
+    { 1.f / 3.f, 1.f / 3.f, 1.f / 3.f },
+    { 1.f / 2.f, 0.f, -1.f / 2.f },
+    { 1.f / 4.f, -1.f / 2.f, 1.f / 4.f }
+};
+
+// Computes a plane of the opponent color space from 3D groups of RGB planes
+static inline void opp_group(
+    vfloat dst[64], const vfloat rgb_group[3][64], int plane
+) noexcept {
+
+    vfloat coeff_r = vsetf(opp_coeffs[plane][0]);
+    vfloat coeff_g = vsetf(opp_coeffs[plane][1]);
+    vfloat coeff_b = vsetf(opp_coeffs[plane][2]);
+
+    for (int i = 0; i < 64; ++i) {
+        dst[i] = vfmadd(coeff_r, rgb_group[0][i],
+            vfmadd(coeff_g, rgb_group[1][i],
+                vmul(coeff_b, rgb_group[2][i])));
+    }
+}
+
+// Computes the Y plane of the opponent color space,
+// which is used in block-matching of RGB input
+static inline void opp_luma(
+    float * VS_RESTRICT dstp,
+    const float * VS_RESTRICT srcp_r,
+    const float * VS_RESTRICT srcp_g,
+    const float * VS_RESTRICT srcp_b,
+    int stride, int width, int height
+) noexcept {
+
+    vfloat coeff = vsetf(opp_coeffs[0][0]);
+
+    for (int row_i = 0; row_i < height; ++row_i) {
+        for (int col_i = 0; col_i < width; col_i += 8) {
+            vfloat r = vloadf(&srcp_r[col_i]);
+            vfloat g = vloadf(&srcp_g[col_i]);
+            vfloat b = vloadf(&srcp_b[col_i]);
+            vstore(&dstp[col_i],
+                vmul(coeff, vadd(vadd(r, g), b)));
+        }
+
+        dstp += stride;
+        srcp_r += stride;
+        srcp_g += stride;
+        srcp_b += stride;
+    }
+}
+
 // FFTW-style 1D transform
 template <auto transform_impl, int stride=1, int howmany=8, int howmany_stride=8>
-static inline void transform_pack8(__m256 data[64]) noexcept {
+static inline void transform_pack8(vfloat data[64]) noexcept {
     for (int iter = 0; iter < howmany; ++iter, data += howmany_stride) {
-        __m256 v[8];
+        vfloat v[8];
 
         for (int i = 0; i < 8; ++i) {
             v[i] = data[i * stride];
@@ -442,243 +556,289 @@ static inline void transform_pack8(__m256 data[64]) noexcept {
 // Modified from fftw-3.3.9 generated code:
 // fftw-3.3.9/rdft/scalar/r2r/e10_8.c and e01_8.c
 template <bool forward>
-static inline void dct(__m256 block[8]) noexcept {
+static inline void dct(vfloat block[8]) noexcept {
     if constexpr (forward) {
-        __m256 KP414213562 { _mm256_set1_ps(+0.414213562373095048801688724209698078569671875) };
-        __m256 KP1_847759065 { _mm256_set1_ps(+1.847759065022573512256366378793576573644833252) };
-        __m256 KP198912367 { _mm256_set1_ps(+0.198912367379658006911597622644676228597850501) };
-        __m256 KP1_961570560 { _mm256_set1_ps(1.961570560806460898252364472268478073947867462) };
-        __m256 KP1_414213562 { _mm256_set1_ps(+1.414213562373095048801688724209698078569671875) };
-        __m256 KP668178637 { _mm256_set1_ps(+0.668178637919298919997757686523080761552472251) };
-        __m256 KP1_662939224 { _mm256_set1_ps(+1.662939224605090474157576755235811513477121624) };
-        __m256 KP707106781 { _mm256_set1_ps(+0.707106781186547524400844362104849039284835938) };
-        __m256 neg_mask { _mm256_set1_ps(-0.0f) };
+        vfloat KP414213562 { vsetf(+0.414213562373095048801688724209698078569671875) };
+        vfloat KP1_847759065 { vsetf(+1.847759065022573512256366378793576573644833252) };
+        vfloat KP198912367 { vsetf(+0.198912367379658006911597622644676228597850501) };
+        vfloat KP1_961570560 { vsetf(1.961570560806460898252364472268478073947867462) };
+        vfloat KP1_414213562 { vsetf(+1.414213562373095048801688724209698078569671875) };
+        vfloat KP668178637 { vsetf(+0.668178637919298919997757686523080761552472251) };
+        vfloat KP1_662939224 { vsetf(+1.662939224605090474157576755235811513477121624) };
+        vfloat KP707106781 { vsetf(+0.707106781186547524400844362104849039284835938) };
+        vfloat neg_mask { vsetf(-0.0f) };
 
         auto T1 = block[0];
         auto T2 = block[7];
-        auto T3 = _mm256_sub_ps(T1, T2);
-        auto Tj = _mm256_add_ps(T1, T2);
+        auto T3 = vsub(T1, T2);
+        auto Tj = vadd(T1, T2);
         auto Tc = block[4];
         auto Td = block[3];
-        auto Te = _mm256_sub_ps(Tc, Td);
-        auto Tk = _mm256_add_ps(Tc, Td);
+        auto Te = vsub(Tc, Td);
+        auto Tk = vadd(Tc, Td);
         auto T4 = block[2];
         auto T5 = block[5];
-        auto T6 = _mm256_sub_ps(T4, T5);
+        auto T6 = vsub(T4, T5);
         auto T7 = block[1];
         auto T8 = block[6];
-        auto T9 = _mm256_sub_ps(T7, T8);
-        auto Ta = _mm256_add_ps(T6, T9);
-        auto Tn = _mm256_add_ps(T7, T8);
-        auto Tf = _mm256_sub_ps(T6, T9);
-        auto Tm = _mm256_add_ps(T4, T5);
-        auto Tb = _mm256_fnmadd_ps(KP707106781, Ta, T3);
-        auto Tg = _mm256_fnmadd_ps(KP707106781, Tf, Te);
-        block[3] = _mm256_mul_ps(KP1_662939224, _mm256_fmadd_ps(KP668178637, Tg, Tb));
-        block[5] = _mm256_xor_ps(neg_mask, _mm256_mul_ps(KP1_662939224, _mm256_fnmadd_ps(KP668178637, Tb, Tg)));
-        auto Tp = _mm256_add_ps(Tj, Tk);
-        auto Tq = _mm256_add_ps(Tm, Tn);
-        block[4] = _mm256_mul_ps(KP1_414213562, _mm256_sub_ps(Tp, Tq));
-        block[0] = _mm256_mul_ps(KP1_414213562, _mm256_add_ps(Tp, Tq));
-        auto Th = _mm256_fmadd_ps(KP707106781, Ta, T3);
-        auto Ti = _mm256_fmadd_ps(KP707106781, Tf, Te);
-        block[1] = _mm256_mul_ps(KP1_961570560, _mm256_fnmadd_ps(KP198912367, Ti, Th));
-        block[7] = _mm256_mul_ps(KP1_961570560, _mm256_fmadd_ps(KP198912367, Th, Ti));
-        auto Tl = _mm256_sub_ps(Tj, Tk);
-        auto To = _mm256_sub_ps(Tm, Tn);
-        block[2] = _mm256_mul_ps(KP1_847759065, _mm256_fnmadd_ps(KP414213562, To, Tl));
-        block[6] = _mm256_mul_ps(KP1_847759065, _mm256_fmadd_ps(KP414213562, Tl, To));
+        auto T9 = vsub(T7, T8);
+        auto Ta = vadd(T6, T9);
+        auto Tn = vadd(T7, T8);
+        auto Tf = vsub(T6, T9);
+        auto Tm = vadd(T4, T5);
+        auto Tb = vfnmadd(KP707106781, Ta, T3);
+        auto Tg = vfnmadd(KP707106781, Tf, Te);
+        block[3] = vmul(KP1_662939224, vfmadd(KP668178637, Tg, Tb));
+        block[5] = vxor(neg_mask, vmul(KP1_662939224, vfnmadd(KP668178637, Tb, Tg)));
+        auto Tp = vadd(Tj, Tk);
+        auto Tq = vadd(Tm, Tn);
+        block[4] = vmul(KP1_414213562, vsub(Tp, Tq));
+        block[0] = vmul(KP1_414213562, vadd(Tp, Tq));
+        auto Th = vfmadd(KP707106781, Ta, T3);
+        auto Ti = vfmadd(KP707106781, Tf, Te);
+        block[1] = vmul(KP1_961570560, vfnmadd(KP198912367, Ti, Th));
+        block[7] = vmul(KP1_961570560, vfmadd(KP198912367, Th, Ti));
+        auto Tl = vsub(Tj, Tk);
+        auto To = vsub(Tm, Tn);
+        block[2] = vmul(KP1_847759065, vfnmadd(KP414213562, To, Tl));
+        block[6] = vmul(KP1_847759065, vfmadd(KP414213562, Tl, To));
     } else {
-        __m256 KP1_662939224 { _mm256_set1_ps(+1.662939224605090474157576755235811513477121624) };
-        __m256 KP668178637 { _mm256_set1_ps(+0.668178637919298919997757686523080761552472251) };
-        __m256 KP1_961570560 { _mm256_set1_ps(+1.961570560806460898252364472268478073947867462) };
-        __m256 KP198912367 { _mm256_set1_ps(+0.198912367379658006911597622644676228597850501) };
-        __m256 KP1_847759065 { _mm256_set1_ps(+1.847759065022573512256366378793576573644833252) };
-        __m256 KP707106781 { _mm256_set1_ps(+0.707106781186547524400844362104849039284835938) };
-        __m256 KP414213562 { _mm256_set1_ps(+0.414213562373095048801688724209698078569671875) };
-        __m256 KP1_414213562 { _mm256_set1_ps(+1.414213562373095048801688724209698078569671875) };
-
-        auto T1 = _mm256_mul_ps(KP1_414213562, block[0]);
+        vfloat KP1_662939224 { vsetf(+1.662939224605090474157576755235811513477121624) };
+        vfloat KP668178637 { vsetf(+0.668178637919298919997757686523080761552472251) };
+        vfloat KP1_961570560 { vsetf(+1.961570560806460898252364472268478073947867462) };
+        vfloat KP198912367 { vsetf(+0.198912367379658006911597622644676228597850501) };
+        vfloat KP1_847759065 { vsetf(+1.847759065022573512256366378793576573644833252) };
+        vfloat KP707106781 { vsetf(+0.707106781186547524400844362104849039284835938) };
+        vfloat KP414213562 { vsetf(+0.414213562373095048801688724209698078569671875) };
+        vfloat KP1_414213562 { vsetf(+1.414213562373095048801688724209698078569671875) };
+
+        auto T1 = vmul(KP1_414213562, block[0]);
         auto T2 = block[4];
-        auto T3 = _mm256_fmadd_ps(KP1_414213562, T2, T1);
-        auto Tj = _mm256_fnmadd_ps(KP1_414213562, T2, T1);
+        auto T3 = vfmadd(KP1_414213562, T2, T1);
+        auto Tj = vfnmadd(KP1_414213562, T2, T1);
         auto T4 = block[2];
         auto T5 = block[6];
-        auto T6 = _mm256_fmadd_ps(KP414213562, T5, T4);
-        auto Tk = _mm256_fmsub_ps(KP414213562, T4, T5);
+        auto T6 = vfmadd(KP414213562, T5, T4);
+        auto Tk = vfmsub(KP414213562, T4, T5);
         auto T8 = block[1];
         auto Td = block[7];
         auto T9 = block[5];
         auto Ta = block[3];
-        auto Tb = _mm256_add_ps(T9, Ta);
-        auto Te = _mm256_sub_ps(Ta, T9);
-        auto Tc = _mm256_fmadd_ps(KP707106781, Tb, T8);
-        auto Tn = _mm256_fnmadd_ps(KP707106781, Te, Td);
-        auto Tf = _mm256_fmadd_ps(KP707106781, Te, Td);
-        auto Tm = _mm256_fnmadd_ps(KP707106781, Tb, T8);
-        auto T7 = _mm256_fmadd_ps(KP1_847759065, T6, T3);
-        auto Tg = _mm256_fmadd_ps(KP198912367, Tf, Tc);
-        block[7] = _mm256_fnmadd_ps(KP1_961570560, Tg, T7);
-        block[0] = _mm256_fmadd_ps(KP1_961570560, Tg, T7);
-        auto Tp = _mm256_fnmadd_ps(KP1_847759065, Tk, Tj);
-        auto Tq = _mm256_fmadd_ps(KP668178637, Tm, Tn);
-        block[5] = _mm256_fnmadd_ps(KP1_662939224, Tq, Tp);
-        block[2] = _mm256_fmadd_ps(KP1_662939224, Tq, Tp);
-        auto Th = _mm256_fnmadd_ps(KP1_847759065, T6, T3);
-        auto Ti = _mm256_fnmadd_ps(KP198912367, Tc, Tf);
-        block[3] = _mm256_fnmadd_ps(KP1_961570560, Ti, Th);
-        block[4] = _mm256_fmadd_ps(KP1_961570560, Ti, Th);
-        auto Tl = _mm256_fmadd_ps(KP1_847759065, Tk, Tj);
-        auto To = _mm256_fnmadd_ps(KP668178637, Tn, Tm);
-        block[6] = _mm256_fnmadd_ps(KP1_662939224, To, Tl);
-        block[1] = _mm256_fmadd_ps(KP1_662939224, To, Tl);
-    }
-}
-
-// Transposition of a 8x8 block.
-static inline void transpose(__m256 block[8]) noexcept {
-    for (int i = 0; i < 4; ++i) {
-        __m256 temp1 = _mm256_shuffle_ps(block[i * 2], block[i * 2 + 1], 0b10001000);
-        __m256 temp2 = _mm256_shuffle_ps(block[i * 2], block[i * 2 + 1], 0b11011101);
-        block[i * 2] = temp1;
-        block[i * 2 + 1] = temp2;
-    }
-
-    for (int i = 0; i < 4; ++i) {
-        __m256 temp1 = _mm256_shuffle_ps(block[i + (i & -2)], block[i + (i & -2) + 2], 0b10001000);
-        __m256 temp2 = _mm256_shuffle_ps(block[i + (i & -2)], block[i + (i & -2) + 2], 0b11011101);
-        block[i + (i & -2)] = temp1;
-        block[i + (i & -2) + 2] = temp2;
-    }
-
-    for (int i = 0; i < 4; ++i) {
-        __m256 temp1 = _mm256_permute2f128_ps(block[i], block[i + 4], 0b00100000);
-        __m256 temp2 = _mm256_permute2f128_ps(block[i], block[i + 4], 0b00110001);
-        block[i] = temp1;
-        block[i + 4] = temp2;
+        auto Tb = vadd(T9, Ta);
+        auto Te = vsub(Ta, T9);
+        auto Tc = vfmadd(KP707106781, Tb, T8);
+        auto Tn = vfnmadd(KP707106781, Te, Td);
+        auto Tf = vfmadd(KP707106781, Te, Td);
+        auto Tm = vfnmadd(KP707106781, Tb, T8);
+        auto T7 = vfmadd(KP1_847759065, T6, T3);
+        auto Tg = vfmadd(KP198912367, Tf, Tc);
+        block[7] = vfnmadd(KP1_961570560, Tg, T7);
+        block[0] = vfmadd(KP1_961570560, Tg, T7);
+        auto Tp = vfnmadd(KP1_847759065, Tk, Tj);
+        auto Tq = vfmadd(KP668178637, Tm, Tn);
+        block[5] = vfnmadd(KP1_662939224, Tq, Tp);
+        block[2] = vfmadd(KP1_662939224, Tq, Tp);
+        auto Th = vfnmadd(KP1_847759065, T6, T3);
+        auto Ti = vfnmadd(KP198912367, Tc, Tf);
+        block[3] = vfnmadd(KP1_961570560, Ti, Th);
+        block[4] = vfmadd(KP1_961570560, Ti, Th);
+        auto Tl = vfmadd(KP1_847759065, Tk, Tj);
+        auto To = vfnmadd(KP668178637, Tn, Tm);
+        block[6] = vfnmadd(KP1_662939224, To, Tl);
+        block[1] = vfmadd(KP1_662939224, To, Tl);
     }
 }
 
-static inline __m256 hard_thresholding(__m256 data[64], float _sigma) noexcept {
+static inline vfloat hard_thresholding(vfloat data[64], float _sigma) noexcept {
     // number of retained (non-zero) coefficients
-    __m256i nnz {};
+    vint nnz {};
 
-    __m256 sigma = _mm256_set1_ps(_sigma);
+    vfloat sigma = vsetf(_sigma);
 
-    __m256 thr_mask = _mm256_setr_ps(0.f, 1.f, 1.f, 1.f, 1.f, 1.f, 1.f, 1.f);
+    vfloat thr_mask = vsetrf(0.f, 1.f, 1.f, 1.f, 1.f, 1.f, 1.f, 1.f);
 
-    __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFFu));
-    __m256 scaler = _mm256_set1_ps(1.f / 4096.f);
+    vfloat abs_mask = vcastf(vseti(0x7FFFFFFFu));
+    vfloat scaler = vsetf(1.f / 4096.f);
 
     for (int i = 0; i < 64; ++i) {
         auto val = data[i];
 
-        __m256 thr;
+        vfloat thr;
         if (i == 0) {
             // protects DC component
-            thr = _mm256_mul_ps(sigma, thr_mask);
+            thr = vmul(sigma, thr_mask);
         } else {
             thr = sigma;
         }
 
-        __m256 _flag = _mm256_cmp_ps(_mm256_and_ps(val, abs_mask), thr, _CMP_GE_OQ);
-        __m256i flag = _mm256_castps_si256(_flag);
+        vfloat _flag = vcmpge(vand(val, abs_mask), thr);
+        vint flag = vcasti(_flag);
 
-        nnz = _mm256_sub_epi32(nnz, flag);
-        data[i] = _mm256_and_ps(_mm256_mul_ps(val, scaler), _flag);
+        nnz = vsub(nnz, flag);
+        data[i] = vand(vmul(val, scaler), _flag);
     }
 
-    nnz = reduce_add(nnz);
+    nnz = vreduce_add(nnz);
 
-    return _mm256_rcp_ps(_mm256_cvtepi32_ps(nnz));
+    return vrcp(vcvt(nnz));
 }
 
-static inline __m256 collaborative_hard(__m256 data[64], float _sigma) noexcept {
+static inline vfloat collaborative_hard(vfloat data[64], float _sigma) noexcept {
     constexpr int stride1 = 1;
     constexpr int stride2 = stride1 * 8;
 
     for (int ndim = 0; ndim < 2; ++ndim) {
         transform_pack8<dct<true>, stride1, 8, stride2>(data);
-        transform_pack8<transpose, stride1, 8, stride2>(data);
+        transform_pack8<vtranspose, stride1, 8, stride2>(data);
     }
     transform_pack8<dct<true>, stride2, 8, stride1>(data);
 
-    __m256 adaptive_weight = hard_thresholding(data, _sigma);
+    vfloat adaptive_weight = hard_thresholding(data, _sigma);
 
     for (int ndim = 0; ndim < 2; ++ndim) {
         transform_pack8<dct<false>, stride1, 8, stride2>(data);
-        transform_pack8<transpose, stride1, 8, stride2>(data);
+        transform_pack8<vtranspose, stride1, 8, stride2>(data);
     }
     transform_pack8<dct<false>, stride2, 8, stride1>(data);
 
     return adaptive_weight;
 }
 
-static inline __m256 wiener_filtering(__m256 data[64], __m256 ref[64], float _sigma) noexcept {
-    __m256 norm {};
-    __m256 sigma = _mm256_set1_ps(_sigma);
-    __m256 sqr_sigma = _mm256_mul_ps(sigma, sigma);
+static inline vfloat wiener_filtering(vfloat data[64], vfloat ref[64], float _sigma) noexcept {
+    vfloat norm {};
+    vfloat sigma = vsetf(_sigma);
+    vfloat sqr_sigma = vmul(sigma, sigma);
 
-    __m256 scaler = _mm256_set1_ps(1.f / 4096.f);
+    vfloat scaler = vsetf(1.f / 4096.f);
 
     for (int i = 0; i < 64; ++i) {
         auto val = data[i];
         auto ref_val = ref[i];
-        auto sqr_ref = _mm256_mul_ps(ref_val, ref_val);
-        auto coeff = _mm256_mul_ps(sqr_ref, _mm256_rcp_ps(_mm256_add_ps(sqr_ref, sqr_sigma)));
+        auto sqr_ref = vmul(ref_val, ref_val);
+        auto coeff = vmul(sqr_ref, vrcp(vadd(sqr_ref, sqr_sigma)));
 
         if (i == 0) {
             // protects DC component
-            __m256 ones = _mm256_set1_ps(1.f);
-            coeff = _mm256_blend_ps(coeff, ones, 0b00000001);
+            vfloat ones = vsetf(1.f);
+            coeff = vblend<0b00000001>(coeff, ones);
         }
 
-        norm = _mm256_fmadd_ps(coeff, coeff, norm);
-        data[i] = _mm256_mul_ps(_mm256_mul_ps(val, scaler), coeff);
+        norm = vfmadd(coeff, coeff, norm);
+        data[i] = vmul(vmul(val, scaler), coeff);
     }
 
-    norm = reduce_add(norm);
+    norm = vreduce_add(norm);
 
-    return _mm256_rcp_ps(norm);
+    return vrcp(norm);
 }
 
-static inline __m256 collaborative_wiener(__m256 data[64], __m256 ref[64], float _sigma) {
+static inline vfloat collaborative_wiener(vfloat data[64], vfloat ref[64], float _sigma) {
     constexpr int stride1 = 1;
     constexpr int stride2 = stride1 * 8;
 
     for (int ndim = 0; ndim < 2; ++ndim) {
         transform_pack8<dct<true>, stride1, 8, stride2>(data);
-        transform_pack8<transpose, stride1, 8, stride2>(data);
+        transform_pack8<vtranspose, stride1, 8, stride2>(data);
     }
     transform_pack8<dct<true>, stride2, 8, stride1>(data);
 
     for (int ndim = 0; ndim < 2; ++ndim) {
         transform_pack8<dct<true>, stride1, 8, stride2>(ref);
-        transform_pack8<transpose, stride1, 8, stride2>(ref);
+        transform_pack8<vtranspose, stride1, 8, stride2>(ref);
     }
     transform_pack8<dct<true>, stride2, 8, stride1>(ref);
 
-    __m256 adaptive_weight = wiener_filtering(data, ref, _sigma);
+    vfloat adaptive_weight = wiener_filtering(data, ref, _sigma);
 
     for (int ndim = 0; ndim < 2; ++ndim) {
         transform_pack8<dct<false>, stride1, 8, stride2>(data);
-        transform_pack8<transpose, stride1, 8, stride2>(data);
+        transform_pack8<vtranspose, stride1, 8, stride2>(data);
     }
     transform_pack8<dct<false>, stride2, 8, stride1>(data);
 
     return adaptive_weight;
 }
 
+// 3D transforms of `num_groups` groups computed pass by pass over all groups,
+// which interleaves the independent transforms
+template <bool forward>
+static inline void transform_3d_batch(vfloat * const groups[], int num_groups) noexcept {
+    constexpr int stride1 = 1;
+    constexpr int stride2 = stride1 * 8;
+
+    for (int ndim = 0; ndim < 2; ++ndim) {
+        for (int i = 0; i < num_groups; ++i) {
+            transform_pack8<dct<forward>, stride1, 8, stride2>(groups[i]);
+        }
+        for (int i = 0; i < num_groups; ++i) {
+            transform_pack8<vtranspose, stride1, 8, stride2>(groups[i]);
+        }
+    }
+    for (int i = 0; i < num_groups; ++i) {
+        transform_pack8<dct<forward>, stride2, 8, stride1>(groups[i]);
+    }
+}
+
+// Blockwise NL-means [3] estimation of a group, which replaces collaborative
+// filtering in `nlm` mode. The blocks are averaged with weights
+// exp(-max(d - 2 * `match_sigma`^2, 0) / (0.4 * `_sigma`)^2), where d is the
+// mean square distance of a block to the reference block on the matching plane
+// given by the `errors` of block-matching, and the average replaces every block
+// of the group. Slots not filled by the search hold the reference block itself.
+// The weights are stored in `block_weights`, and the effective number of
+// averaged blocks is returned as the aggregation weight.
+static inline vfloat nlm_averaging(
+    vfloat data[64], std::array<float, 8> & block_weights,
+    const std::array<float, 8> & errors, float _sigma, float match_sigma
+) noexcept {
+
+    const float bias = 2.f * match_sigma * match_sigma;
+    const float h = 0.4f * _sigma;
+    const float scale = -1.f / (h * h);
+
+    float sum_weights = 0.f;
+    float sum_sqr_weights = 0.f;
+    for (int i = 0; i < 8; ++i) {
+        float distance = errors[i] < std::numeric_limits<float>::max() ? errors[i] : 0.f;
+        float weight = std::exp(std::max(distance * (1.f / 64.f) - bias, 0.f) * scale);
+        block_weights[i] = weight;
+        sum_weights += weight;
+        sum_sqr_weights += weight * weight;
+    }
+
+    vfloat average[8] {};
+    for (int i = 0; i < 8; ++i) {
+        vfloat weight = vsetf(block_weights[i]);
+        for (int j = 0; j < 8; ++j) {
+            average[j] = vfmadd(weight, data[i * 8 + j], average[j]);
+        }
+    }
+
+    vfloat normalizer = vsetf(1.f / sum_weights);
+    for (int j = 0; j < 8; ++j) {
+        average[j] = vmul(average[j], normalizer);
+    }
+    for (int i = 0; i < 8; ++i) {
+        for (int j = 0; j < 8; ++j) {
+            data[i * 8 + j] = average[j];
+        }
+    }
+
+    return vsetf(sum_weights * sum_weights / sum_sqr_weights);
+}
+
 // Accumulate block-wise estimates and the corresponding weights in buffers.
+// The weight of the i-th block is further scaled by `block_weights[i]` if not null.
 // The Kaiser window weighting is not implemented.
 static inline void local_accumulation(
     float * VS_RESTRICT wdstp,
     float * VS_RESTRICT weightp,
     int stride,
-    const __m256 denoising_group[64],
+    const vfloat denoising_group[64],
     const std::array<int, 8> &index_x,
     const std::array<int, 8> &index_y,
-    __m256 adaptive_weight
+    vfloat adaptive_weight,
+    const float * block_weights = nullptr
 ) noexcept {
 
     for (int i = 0; i < 8; ++i) {
@@ -688,30 +848,37 @@ static inline void local_accumulation(
         float * block_wdstp = &wdstp[y * stride + x];
         float * block_weightp = &weightp[y * stride + x];
 
+        vfloat block_weight = adaptive_weight;
+        if (block_weights) {
+            block_weight = vmul(block_weight, vsetf(block_weights[i]));
+        }
+
         for (int j = 0; j < 8; ++j) {
-            __m256 wdst = _mm256_loadu_ps(&block_wdstp[j * stride]);
-            wdst = _mm256_fmadd_ps(adaptive_weight, denoising_group[i * 8 + j], wdst);
-            _mm256_storeu_ps(&block_wdstp[j * stride], wdst);
+            vfloat wdst = vloaduf(&block_wdstp[j * stride]);
+            wdst = vfmadd(block_weight, denoising_group[i * 8 + j], wdst);
+            vstoreu(&block_wdstp[j * stride], wdst);
 
-            __m256 weight = _mm256_loadu_ps(&block_weightp[j * stride]);
-            weight = _mm256_add_ps(weight, adaptive_weight);
-            _mm256_storeu_ps(&block_weightp[j * stride], weight);
+            vfloat weight = vloaduf(&block_weightp[j * stride]);
+            weight = vadd(weight, block_weight);
+            vstoreu(&block_weightp[j * stride], weight);
         }
     }
 }
 
 // Accumulates block-wise estimates and the corresponding weights in buffers.
+// The weight of the i-th block is further scaled by `block_weights[i]` if not null.
 // The Kaiser window weighting is not implemented.
 static inline void local_accumulation_temporal(
     float * VS_RESTRICT wdstp,
     float * VS_RESTRICT weightp,
     int stride,
-    const __m256 denoising_group[64],
+    const vfloat denoising_group[64],
     const std::array<int, 8> &index_x,
     const std::array<int, 8> &index_y,
     const std::array<int, 8> &index_z,
-    __m256 adaptive_weight,
-    int height
+    vfloat adaptive_weight,
+    int height,
+    const float * block_weights = nullptr
 ) noexcept {
 
     for (int i = 0; i < 8; ++i) {
@@ -722,18 +889,44 @@ static inline void local_accumulation_temporal(
         float * block_wdstp = &wdstp[z * height * stride * 2 + y * stride + x];
         float * block_weightp = &weightp[z * height * stride * 2 + y * stride + x];
 
+        vfloat block_weight = adaptive_weight;
+        if (block_weights) {
+            block_weight = vmul(block_weight, vsetf(block_weights[i]));
+        }
+
         for (int j = 0; j < 8; ++j) {
-            __m256 wdst = _mm256_loadu_ps(&block_wdstp[j * stride]);
-            wdst = _mm256_fmadd_ps(adaptive_weight, denoising_group[i * 8 + j], wdst);
-            _mm256_storeu_ps(&block_wdstp[j * stride], wdst);
+            vfloat wdst = vloaduf(&block_wdstp[j * stride]);
+            wdst = vfmadd(block_weight, denoising_group[i * 8 + j], wdst);
+            vstoreu(&block_wdstp[j * stride], wdst);
 
-            __m256 weight = _mm256_loadu_ps(&block_weightp[j * stride]);
-            weight = _mm256_add_ps(weight, adaptive_weight);
-            _mm256_storeu_ps(&block_weightp[j * stride], weight);
+            vfloat weight = vloaduf(&block_weightp[j * stride]);
+            weight = vadd(weight, block_weight);
+            vstoreu(&block_weightp[j * stride], weight);
         }
     }
 }
 
+// Adds a tile-local accumulation buffer of `width` x `height`
+// to the co-located region of a frame-sized one.
+static inline void merge_accumulation(
+    float * VS_RESTRICT dstp, int stride,
+    const float * VS_RESTRICT srcp, int width, int height
+) noexcept {
+
+    for (int row_i = 0; row_i < height; ++row_i) {
+        int col_i = 0;
+        for (; col_i + 8 <= width; col_i += 8) {
+            vstoreu(&dstp[col_i], vadd(vloaduf(&dstp[col_i]), vloaduf(&srcp[col_i])));
+        }
+        for (; col_i < width; ++col_i) {
+            dstp[col_i] += srcp[col_i];
+        }
+
+        dstp += stride;
+        srcp += width;
+    }
+}
+
 // Realize the aggregation by element-wise division.
 static inline void aggregation(
     float * VS_RESTRICT dstp, int stride,
@@ -744,10 +937,10 @@ static inline void aggregation(
 
     for (int row_i = 0; row_i < height; ++row_i) {
         for (int col_i = 0; col_i < width; col_i += 8) {
-            __m256 wdst = _mm256_load_ps(&wdstp[col_i]);
-            __m256 weight = _mm256_load_ps(&weightp[col_i]);
-            __m256 dst = _mm256_mul_ps(wdst, _mm256_rcp_ps(weight));
-            _mm256_stream_ps(&dstp[col_i], dst);
+            vfloat wdst = vloadf(&wdstp[col_i]);
+            vfloat weight = vloadf(&weightp[col_i]);
+            vfloat dst = vmul(wdst, vrcp(weight));
+            vstream(&dstp[col_i], dst);
         }
 
         dstp += stride;
@@ -756,16 +949,150 @@ static inline void aggregation(
     }
 }
 
+// Realize the aggregation of planes in the opponent color space
+// by element-wise division, followed by the inverse color transform.
+static inline void aggregation_opp(
+    const std::array<float * VS_RESTRICT, 3> &dstps, int stride,
+    const float * VS_RESTRICT buffer,
+    int width, int height, int num_rows
+) noexcept {
+
+    const float * wdstp_y = &buffer[0];
+    const float * weightp_y = &buffer[height * stride];
+    const float * wdstp_u = &buffer[height * stride * 2];
+    const float * weightp_u = &buffer[height * stride * 3];
+    const float * wdstp_v = &buffer[height * stride * 4];
+    const float * weightp_v = &buffer[height * stride * 5];
+    float * dstp_r = dstps[0];
+    float * dstp_g = dstps[1];
+    float * dstp_b = dstps[2];
+
+    vfloat coeff_v1 = vsetf(2.f / 3.f);
+    vfloat coeff_v2 = vsetf(4.f / 3.f);
+
+    for (int row_i = 0; row_i < num_rows; ++row_i) {
+        for (int col_i = 0; col_i < width; col_i += 8) {
+            vfloat y = vmul(
+                vloadf(&wdstp_y[col_i]),
+                vrcp(vloadf(&weightp_y[col_i])));
+            vfloat u = vmul(
+                vloadf(&wdstp_u[col_i]),
+                vrcp(vloadf(&weightp_u[col_i])));
+            vfloat v = vmul(
+                vloadf(&wdstp_v[col_i]),
+                vrcp(vloadf(&weightp_v[col_i])));
+
+            vfloat y_v = vfmadd(coeff_v1, v, y);
+            vstream(&dstp_r[col_i], vadd(y_v, u));
+            vstream(&dstp_g[col_i], vfnmadd(coeff_v2, v, y));
+            vstream(&dstp_b[col_i], vsub(y_v, u));
+        }
+
+        wdstp_y += stride;
+        weightp_y += stride;
+        wdstp_u += stride;
+        weightp_u += stride;
+        wdstp_v += stride;
+        weightp_v += stride;
+        dstp_r += stride;
+        dstp_g += stride;
+        dstp_b += stride;
+    }
+}
+
+// Coverage map of the adaptive scan of reference blocks,
+// which counts the block estimates accumulated in each 4x4 cell of a plane.
+// Only cells fully covered by a block are counted, so that the count is
+// a lower bound on the number of estimates of every pixel in the cell.
+static constexpr int coverage_cell_size = 4;
+
+static constexpr int coverage_width(int width) noexcept {
+    return (width + coverage_cell_size - 1) / coverage_cell_size;
+}
+
+static constexpr int coverage_height(int height) noexcept {
+    return (height + coverage_cell_size - 1) / coverage_cell_size;
+}
+
+// Returns whether every pixel of the block at (`x`, `y`)
+// has received at least `min_coverage` estimates.
+static inline bool is_covered(
+    const uint8_t * VS_RESTRICT coverage, int coverage_stride,
+    int x, int y, int min_coverage
+) noexcept {
+
+    for (int cy = y / coverage_cell_size; cy <= (y + 7) / coverage_cell_size; ++cy) {
+        for (int cx = x / coverage_cell_size; cx <= (x + 7) / coverage_cell_size; ++cx) {
+            if (coverage[cy * coverage_stride + cx] < min_coverage) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Counts an estimate of the block at (`x`, `y`), saturating at 255.
+static inline void update_coverage(
+    uint8_t * VS_RESTRICT coverage, int coverage_stride,
+    int x, int y
+) noexcept {
+
+    const int cx_begin = (x + coverage_cell_size - 1) / coverage_cell_size;
+    const int cx_end = (x + 8) / coverage_cell_size;
+    const int cy_begin = (y + coverage_cell_size - 1) / coverage_cell_size;
+    const int cy_end = (y + 8) / coverage_cell_size;
+
+    for (int cy = cy_begin; cy < cy_end; ++cy) {
+        for (int cx = cx_begin; cx < cx_end; ++cx) {
+            uint8_t & count = coverage[cy * coverage_stride + cx];
+            count += (count != 255);
+        }
+    }
+}
+
 // Returns number of planes of data processed by a call
 // to the processing kernel `bm3d`
 static constexpr int num_planes(bool chroma) noexcept {
     return chroma ? 3 : 1;
 }
 
+// Returns the size in floats of `tile_buffer` of `bm3d`, which holds
+// a pair of accumulation buffers per plane of a tile and its surroundings
+static constexpr size_t tile_buffer_size(
+    int tile_size, int block_step, int bm_range, bool chroma
+) noexcept {
+    const size_t side = (tile_size + block_step - 1) / block_step * block_step + 2 * bm_range + 8;
+    return side * side * 2 * num_planes(chroma);
+}
+
 // Core implementation of the (V-)BM3D denoising algorithm.
+// The aggregation step is performed separately by `bm3d_aggregation`.
 // For V-BM3D, the accumulation of values from neighborhood frames and
-// the aggregation step are not performed here
-// and is left for `bm3d.VAggregate()`.
+// the aggregation step are left for `bm3d.VAggregate()`.
+//
+// Only reference blocks whose (unclamped) vertical coordinates are in
+// [`y_begin`, `y_end`) are processed, where `y_begin` is a multiple of `block_step`.
+// Estimates of rows before `std::min(y_end, height - 8) - bm_range` are
+// not modified by reference blocks after `y_end` in spatial denoising.
+//
+// Block-matching is performed on `matchps`, which are the first plane of
+// `refps` (or `srcps` in basic estimation) except for RGB input (`opp`),
+// where the Y planes of the opponent color space are used instead.
+//
+// If `nlm` is set, the blocks of each group are averaged with weights derived
+// from their distances on `matchps` (see `nlm_averaging`) instead of
+// collaborative filtering, and `refps` is only used in block-matching.
+//
+// If `coverage` is not null, reference blocks whose pixels have all received
+// at least `min_coverage` estimates of the current frame are skipped.
+// `coverage` persists across calls on bands of the same plane.
+//
+// If `tile_size` is positive in spatial denoising, reference blocks are visited
+// in square tiles of `tile_size` (rounded up to `block_step`) in raster order.
+// Estimates of a tile are accumulated in `tile_buffer`, which covers the tile
+// and the reach of block-matching around it and is small enough to stay in cache,
+// and then merged into `buffer` in one pass (see `tile_buffer_size`).
 template <bool temporal, bool chroma, bool final_>
 static inline void bm3d(
     std::array<float * VS_RESTRICT, num_planes(chroma)> &dstps,
@@ -775,81 +1102,156 @@ static inline void bm3d(
         final_,
         const float * VS_RESTRICT [/* num_planes(chroma) * (2 * radius + 1) */],
         std::nullptr_t> refps,
+    const float * VS_RESTRICT matchps[/* 2 * radius + 1 */],
     int width, int height,
     const std::array<float, num_planes(chroma)> &sigma,
     int block_step, int bm_range, int radius, int ps_num, int ps_range,
-    std::conditional_t<temporal, std::nullptr_t, float * VS_RESTRICT> buffer
+    float ps_gate,
+    bool opp, bool nlm,
+    std::conditional_t<temporal, std::nullptr_t, float * VS_RESTRICT> buffer,
+    int tile_size, float * VS_RESTRICT tile_buffer,
+    int y_begin, int y_end,
+    SearchStats & stats,
+    uint8_t * VS_RESTRICT coverage, int min_coverage
 ) noexcept {
 
     const int temporal_width = 2 * radius + 1;
     const int center = radius;
+    const int coverage_stride = coverage_width(width);
 
-    for (int _y = 0; _y < height - 8 + block_step; _y += block_step) {
-        int y = std::min(_y, height - 8); // clamp
+    // planes in the opponent color space are always accumulated
+    // since they are mixed back in the inverse transform
+    const auto is_accumulated = [&](int plane) {
+        return !(chroma && !opp && sigma[plane] < std::numeric_limits<float>::epsilon());
+    };
 
-        for (int _x = 0; _x < width - 8 + block_step; _x += block_step) {
-            int x = std::min(_x, width - 8); // clamp
+    // region of the frame covered by `tile_buffer` in tile-local accumulation
+    const bool tiled = !temporal && tile_size > 0;
+    int tile_x {};
+    int tile_y {};
+    int tile_width {};
+    int tile_height {};
+
+    // collaborative filtering and accumulation of a matched group
+    const auto filter = [&](
+        const std::array<float, 8> & errors,
+        const std::array<int, 8> & index_x,
+        const std::array<int, 8> & index_y,
+        [[maybe_unused]] const std::array<int, 8> & index_z
+    ) {
+        std::array<float, 8> block_weights;
+
+        // loads groups of `planes` of the input and, if `ref_groups` is not null,
+        // of the basic estimate in one pass over the matched blocks
+        const auto load_groups = [&](
+            vfloat src_groups[][64], [[maybe_unused]] vfloat ref_groups[][64],
+            const int planes[], int count
+        ) {
+            const auto block = [&](const float * VS_RESTRICT const planeps[], int plane, int i) {
+                if constexpr (temporal) {
+                    return &planeps[plane * temporal_width + index_z[i]][index_y[i] * stride + index_x[i]];
+                } else {
+                    return &planeps[plane][index_y[i] * stride + index_x[i]];
+                }
+            };
 
-            __m256 reference_block[8];
-            if constexpr (final_) {
-                load_block(reference_block, &refps[center][y * stride + x], stride);
-            } else {
-                load_block(reference_block, &srcps[center][y * stride + x], stride);
+            for (int i = 0; i < 8; ++i) {
+                for (int j = 0; j < count; ++j) {
+                    const int plane = planes[j];
+                    load_block(&src_groups[plane][i * 8], block(srcps, plane, i), stride);
+                    if constexpr (final_) {
+                        if (ref_groups) {
+                            load_block(&ref_groups[plane][i * 8], block(refps, plane, i), stride);
+                        }
+                    }
+                }
             }
+        };
 
-            std::array<float, 8> errors;
-            errors.fill(std::numeric_limits<float>::max());
+        // RGB groups of the input and the basic estimate,
+        // shared by all planes of the opponent color space
+        vfloat rgb_groups[2][3][64];
+        if (chroma && opp) {
+            constexpr int rgb_planes[] { 0, 1, 2 };
+            // the basic estimate is only used in block-matching in `nlm` mode
+            load_groups(rgb_groups[0], final_ && !nlm ? rgb_groups[1] : nullptr, rgb_planes, 3);
+        }
 
-            std::array<int, 8> index_x;
-            index_x.fill(x);
-            std::array<int, 8> index_y;
-            index_y.fill(y);
-            std::array<int, 8> index_z;
-            index_z.fill(center);
+        // In the final estimation of CBM3D, the groups of all filtered planes
+        // are loaded in one pass, and Wiener filtered with their transforms
+        // computed together.
+        const bool filter_planes = chroma && final_ && !nlm;
+        vfloat plane_groups[2][num_planes(chroma)][64];
+        vfloat plane_weights[num_planes(chroma)];
+        if constexpr (chroma && final_) {
+            if (filter_planes) {
+                int filtered_planes[3];
+                int num_filtered = 0;
+                for (int plane = 0; plane < 3; ++plane) {
+                    if (sigma[plane] < std::numeric_limits<float>::epsilon()) {
+                        // unprocessed plane of the opponent color space is passed through
+                        plane_weights[plane] = vsetf(1.f);
+                        if (opp) {
+                            opp_group(plane_groups[0][plane], rgb_groups[0], plane);
+                        }
+                    } else {
+                        filtered_planes[num_filtered++] = plane;
+                    }
+                }
 
-            if constexpr (temporal) {
-                decltype(srcps) input;
-                if constexpr (final_) {
-                    input = refps;
+                if (opp) {
+                    for (int j = 0; j < num_filtered; ++j) {
+                        const int plane = filtered_planes[j];
+                        opp_group(plane_groups[0][plane], rgb_groups[0], plane);
+                        opp_group(plane_groups[1][plane], rgb_groups[1], plane);
+                    }
                 } else {
-                    input = srcps;
+                    load_groups(plane_groups[0], plane_groups[1], filtered_planes, num_filtered);
                 }
 
-                block_matching_temporal(
-                    errors, index_x, index_y, index_z,
-                    reference_block,
-                    input, stride,
-                    width, height,
-                    bm_range, x, y, radius, ps_num, ps_range
-                );
+                vfloat * groups[2 * num_planes(chroma)] {};
+                for (int j = 0; j < num_filtered; ++j) {
+                    groups[2 * j] = plane_groups[0][filtered_planes[j]];
+                    groups[2 * j + 1] = plane_groups[1][filtered_planes[j]];
+                }
+                transform_3d_batch<true>(groups, 2 * num_filtered);
 
-                insert_if_not_in_temporal(index_x, index_y, index_z, x, y, center);
-            } else {
-                std::remove_reference_t<decltype(srcps[0])> input;
-                if constexpr (final_) {
-                    input = refps[0];
-                } else {
-                    input = srcps[0];
+                for (int j = 0; j < num_filtered; ++j) {
+                    const int plane = filtered_planes[j];
+                    plane_weights[plane] = wiener_filtering(
+                        plane_groups[0][plane], plane_groups[1][plane], sigma[plane]);
+                    groups[j] = plane_groups[0][plane];
                 }
+                transform_3d_batch<false>(groups, num_filtered);
+            }
+        }
 
-                block_matching(
-                    errors, index_x, index_y,
-                    reference_block,
-                    input, stride,
-                    width, height,
-                    bm_range, x, y
-                );
+        std::array<int, 8> tile_index_x;
+        std::array<int, 8> tile_index_y;
+        if (tiled) {
+            for (int i = 0; i < 8; ++i) {
+                tile_index_x[i] = index_x[i] - tile_x;
+                tile_index_y[i] = index_y[i] - tile_y;
+            }
+        }
 
-                insert_if_not_in(index_x, index_y, x, y);
+        for (int plane = 0; plane < num_planes(chroma); ++plane) {
+            if (!is_accumulated(plane)) {
+                continue;
             }
 
-            for (int plane = 0; plane < num_planes(chroma); ++plane) {
-                if (chroma && sigma[plane] < std::numeric_limits<float>::epsilon()) {
-                    continue;
-                }
+            vfloat group[64];
+            vfloat * denoising_group = group;
+            vfloat adaptive_weight;
+            bool weighted_blocks = false;
 
-                __m256 denoising_group[64];
-                if constexpr (temporal) {
+            if (filter_planes) { // filtered above
+                denoising_group = plane_groups[0][plane];
+                adaptive_weight = plane_weights[plane];
+            } else {
+                if (chroma && opp) {
+                    opp_group(denoising_group, rgb_groups[0], plane);
+                } else if constexpr (temporal) {
                     load_3d_group_temporal(
                         denoising_group, &srcps[plane * temporal_width],
                         stride, index_x, index_y, index_z);
@@ -858,9 +1260,18 @@ static inline void bm3d(
                         denoising_group, srcps[plane], stride, index_x, index_y);
                 }
 
-                __m256 adaptive_weight;
-                if constexpr (final_) { // final estimation
-                    __m256 basic_estimate_group[64];
+                if (chroma && opp && sigma[plane] < std::numeric_limits<float>::epsilon()) {
+                    // unprocessed plane is passed through
+                    adaptive_weight = vsetf(1.f);
+                } else if (nlm) {
+                    // `sigma` is scaled in `BM3DCreate`
+                    constexpr float scale = 1.f / ((3.f / 4.f) * 64.f * (final_ ? 1.0f : 2.7f));
+                    adaptive_weight = nlm_averaging(
+                        denoising_group, block_weights, errors,
+                        sigma[plane] * scale, sigma[0] * scale);
+                    weighted_blocks = true;
+                } else if constexpr (final_) { // final estimation
+                    vfloat basic_estimate_group[64];
                     if constexpr (temporal) {
                         load_3d_group_temporal(
                             basic_estimate_group, &refps[plane * temporal_width],
@@ -875,358 +1286,1002 @@ static inline void bm3d(
                     adaptive_weight = collaborative_hard(
                         denoising_group, sigma[plane]);
                 }
-
-                if constexpr (temporal) {
-                    local_accumulation_temporal(
-                        &dstps[plane][0],
-                        &dstps[plane][height * stride],
-                        stride, denoising_group,
-                        index_x, index_y, index_z,
-                        adaptive_weight,
-                        height);
-                } else {
-                    local_accumulation(
-                        &buffer[height * stride * 2 * plane],
-                        &buffer[height * stride * (2 * plane + 1)],
-                        stride, denoising_group,
-                        index_x, index_y,
-                        adaptive_weight);
-                }
             }
-        }
-    }
 
-    if constexpr (!temporal) {
-        for (int plane = 0; plane < num_planes(chroma); ++plane) {
-            if (!chroma || !(sigma[plane] < std::numeric_limits<float>::epsilon())) {
-                aggregation(
-                    dstps[plane], stride,
+            if constexpr (temporal) {
+                local_accumulation_temporal(
+                    &dstps[plane][0],
+                    &dstps[plane][height * stride],
+                    stride, denoising_group,
+                    index_x, index_y, index_z,
+                    adaptive_weight,
+                    height,
+                    weighted_blocks ? block_weights.data() : nullptr);
+            } else if (tiled) {
+                const size_t tile_plane_size = static_cast<size_t>(tile_width) * tile_height;
+                local_accumulation(
+                    &tile_buffer[tile_plane_size * 2 * plane],
+                    &tile_buffer[tile_plane_size * (2 * plane + 1)],
+                    tile_width, denoising_group,
+                    tile_index_x, tile_index_y,
+                    adaptive_weight,
+                    weighted_blocks ? block_weights.data() : nullptr);
+            } else {
+                local_accumulation(
                     &buffer[height * stride * 2 * plane],
                     &buffer[height * stride * (2 * plane + 1)],
-                    width, height
-                );
+                    stride, denoising_group,
+                    index_x, index_y,
+                    adaptive_weight,
+                    weighted_blocks ? block_weights.data() : nullptr);
             }
         }
-    }
-}
-
-static const VSFrame *VS_CC BM3DGetFrame(
-    int n, int activationReason, void *instanceData, void **frameData,
-    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi
-) {
-
-    auto * d = static_cast<BM3DData *>(instanceData);
+    };
 
-    if (activationReason == arInitial) {
-        int start_frame = std::max(n - d->radius, 0);
-        int end_frame = std::min(n + d->radius, d->vi->numFrames - 1);
+    // a tile spans unclamped coordinates of reference blocks in
+    // [`tx_begin`, `tx_end`) x [`ty_begin`, `ty_end`), and its region contains
+    // all blocks matched within `bm_range` of them
+    const auto begin_tile = [&](int tx_begin, int tx_end, int ty_begin, int ty_end) {
+        tile_x = std::max(std::min(tx_begin, width - 8) - bm_range, 0);
+        tile_y = std::max(std::min(ty_begin, height - 8) - bm_range, 0);
+        tile_width = std::min(std::min(tx_end - 1, width - 8) + bm_range, width - 8) + 8 - tile_x;
+        tile_height = std::min(std::min(ty_end - 1, height - 8) + bm_range, height - 8) + 8 - tile_y;
+        std::fill_n(
+            tile_buffer, static_cast<size_t>(tile_width) * tile_height * 2 * num_planes(chroma), 0.f);
+    };
 
-        for (int i = start_frame; i <= end_frame; ++i) {
-            vsapi->requestFrameFilter(i, d->node, frameCtx);
-        }
-        if (d->ref_node != nullptr) {
-            for (int i = start_frame; i <= end_frame; ++i) {
-                vsapi->requestFrameFilter(i, d->ref_node, frameCtx);
-            }
-        }
-    } else if (activationReason == arAllFramesReady) {
-        const int radius = d->radius;
-        const int center = radius;
-        const int temporal_width = 2 * radius + 1;
-        const std::vector src_frames = [&](){
-            std::vector<const VSFrame *> temp;
-            temp.reserve(temporal_width);
-            for (int i = -d->radius; i <= d->radius; ++i) {
-                int clamped_n = std::clamp(n + i, 0, d->vi->numFrames - 1);
-                temp.push_back(vsapi->getFrameFilter(clamped_n, d->node, frameCtx));
-            }
-            return temp;
-        }();
-        const std::vector ref_frames = [&](){
-            std::vector<const VSFrame *> temp;
-            if (d->ref_node) {
-                temp.reserve(temporal_width);
-                for (int i = -d->radius; i <= d->radius; ++i) {
-                    int clamped_n = std::clamp(n + i, 0, d->vi->numFrames - 1);
-                    temp.push_back(vsapi->getFrameFilter(clamped_n, d->ref_node, frameCtx));
-                }
-            }
-            return temp;
-        }();
-        const VSFrame * const src_frame = src_frames[center];
-        VSFrame * const dst_frame = [&](){
-            if (radius == 0) {
-                const VSFrame * fr[] {
-                    d->process[0] ? nullptr : src_frame,
-                    d->process[1] ? nullptr : src_frame,
-                    d->process[2] ? nullptr : src_frame
-                };
-                const int pl[] { 0, 1, 2 };
-                return vsapi->newVideoFrame2(
-                    &d->vi->format, d->vi->width, d->vi->height,
-                    fr, pl, src_frame, core);
-            } else {
-                auto frame = vsapi->newVideoFrame(
-                    &d->vi->format, d->vi->width, d->vi->height * 2 * temporal_width,
-                    src_frame, core);
-                for (int i = 0; i < d->vi->format.numPlanes; ++i) {
-                    if (d->zero_init && !d->process[i]) {
-                        auto ptr = vsapi->getWritePtr(frame, i);
-                        auto height = vsapi->getFrameHeight(frame, i);
-                        auto pitch = vsapi->getStride(frame, i);
-                        memset(ptr, 0, height * pitch);
-                    }
+    const auto end_tile = [&]() {
+        if constexpr (!temporal) {
+            const size_t tile_plane_size = static_cast<size_t>(tile_width) * tile_height;
+            for (int i = 0; i < 2 * num_planes(chroma); ++i) {
+                if (is_accumulated(i / 2)) {
+                    merge_accumulation(
+                        &buffer[height * stride * i + tile_y * stride + tile_x], stride,
+                        &tile_buffer[tile_plane_size * i], tile_width, tile_height);
                 }
-                return frame;
             }
-        }();
+        }
+    };
 
-        const auto cast_fp = [](auto * p) {
-            if constexpr (std::is_const_v<std::remove_pointer_t<decltype(p)>>) {
-                return reinterpret_cast<const float *>(p);
-            }
-            else {
-                return reinterpret_cast<float *>(p);
+    // calls `f(tx_begin, tx_end, ty_begin, ty_end)` on tiles in raster order,
+    // the band is a single tile if tile-local accumulation is disabled
+    y_end = std::min(y_end, height - 8 + block_step);
+    const auto for_each_tile = [&](const auto & f) {
+        const int x_end = width - 8 + block_step;
+        const int tile_step = (tile_size + block_step - 1) / block_step * block_step;
+        const int step_x = tiled ? tile_step : x_end;
+        const int step_y = tiled ? tile_step : std::max(y_end - y_begin, 1);
+        for (int ty = y_begin; ty < y_end; ty += step_y) {
+            for (int tx = 0; tx < x_end; tx += step_x) {
+                f(tx, std::min(tx + step_x, x_end), ty, std::min(ty + step_y, y_end));
             }
-        };
-
-        if (d->chroma) {
-            constexpr bool chroma = true;
-
-            std::vector srcps = [&](){
-                std::vector<const float *> temp;
-                temp.reserve(3 * temporal_width);
-                for (int plane = 0; plane < 3; ++plane) {
-                    for (const auto & frame : src_frames) {
-                        temp.push_back(cast_fp(vsapi->getReadPtr(frame, plane)));
-                    }
-                }
-                return temp;
-            }();
-
-            std::array<float * VS_RESTRICT, 3> dstps {
-                const_cast<float * VS_RESTRICT>(cast_fp(vsapi->getWritePtr(dst_frame, 0))),
-                const_cast<float * VS_RESTRICT>(cast_fp(vsapi->getWritePtr(dst_frame, 1))),
-                const_cast<float * VS_RESTRICT>(cast_fp(vsapi->getWritePtr(dst_frame, 2)))
-            };
+        }
+    };
 
-            const int width = vsapi->getFrameWidth(src_frame, 0);
-            const int height = vsapi->getFrameHeight(src_frame, 0);
-            const int stride = vsapi->getStride(src_frame, 0) / sizeof(float);
-            const std::array sigma { d->sigma };
-            const int block_step = d->block_step[0];
-            const int bm_range = d->bm_range[0];
-            const int ps_num = d->ps_num[0];
-            const int ps_range = d->ps_range[0];
+    for_each_tile([&](int tx_begin, int tx_end, int ty_begin, int ty_end) {
+        if (tiled) {
+            begin_tile(tx_begin, tx_end, ty_begin, ty_end);
+        }
 
-            float * buffer {};
-            if (radius == 0) {
-                const auto thread_id = std::this_thread::get_id();
-                bool init = true;
+        for (int _y = ty_begin; _y < ty_end; _y += block_step) {
+            int y = std::min(_y, height - 8); // clamp
 
-                d->buffer_lock.lock_shared();
+            for (int _x = tx_begin; _x < tx_end; _x += block_step) {
+                int x = std::min(_x, width - 8); // clamp
 
-                try {
-                    const auto & const_buffer = d->buffer;
-                    buffer = const_buffer.at(thread_id);
-                } catch (const std::out_of_range &) {
-                    init = false;
+                if (coverage && is_covered(coverage, coverage_stride, x, y, min_coverage)) {
+                    continue;
                 }
 
-                d->buffer_lock.unlock_shared();
+                vfloat reference_block[8];
+                load_block(reference_block, &matchps[center][y * stride + x], stride);
 
-                if (!init) {
-                    buffer = vsh::vsh_aligned_malloc<float>(
-                        sizeof(float) * stride * height * 2 * num_planes(chroma), 32);
-
-                    std::lock_guard _ { d->buffer_lock };
-                    d->buffer.emplace(thread_id, buffer);
-                }
-            }
+                std::array<float, 8> errors;
+                errors.fill(std::numeric_limits<float>::max());
 
-            if (radius == 0) {
-                memset(buffer, 0, sizeof(float) * stride * height * 2 * num_planes(chroma));
-            } else {
-                 for (const auto & dstp : dstps) {
-                    memset(dstp, 0, sizeof(float) * stride * height * 2 * temporal_width);
-                 }
-            }
+                std::array<int, 8> index_x;
+                index_x.fill(x);
+                std::array<int, 8> index_y;
+                index_y.fill(y);
+                std::array<int, 8> index_z;
+                index_z.fill(center);
 
-            if (d->ref_node == nullptr) {
-                constexpr bool final_ = false;
-                if (radius == 0) {
-                    constexpr bool temporal = false;
-                    bm3d<temporal, chroma, final_>(
-                        dstps, stride, srcps.data(), nullptr,
+                if constexpr (temporal) {
+                    block_matching_temporal(
+                        errors, index_x, index_y, index_z,
+                        reference_block,
+                        matchps, stride,
                         width, height,
-                        sigma, block_step, bm_range,
-                        radius, ps_num, ps_range,
-                        buffer);
+                        bm_range, x, y, radius, ps_num, ps_range,
+                        ps_gate, stats
+                    );
+
+                    insert_if_not_in_temporal(errors, index_x, index_y, index_z, x, y, center);
                 } else {
-                    constexpr bool temporal = true;
-                    bm3d<temporal, chroma, final_>(
-                        dstps, stride, srcps.data(), nullptr,
+                    block_matching(
+                        errors, index_x, index_y,
+                        reference_block,
+                        matchps[0], stride,
                         width, height,
-                        sigma, block_step, bm_range,
-                        radius, ps_num, ps_range,
-                        nullptr);
+                        bm_range, x, y
+                    );
+
+                    insert_if_not_in(errors, index_x, index_y, x, y);
                 }
 
-            } else {
-                constexpr bool final_ = true;
-                std::vector refps = [&](){
-                    std::vector<const float *> temp;
-                    temp.reserve(3 * temporal_width);
-                    for (int plane = 0; plane < 3; ++plane) {
-                        for (const auto & frame : ref_frames) {
-                            temp.push_back(cast_fp(vsapi->getReadPtr(frame, plane)));
+                if (coverage) {
+                    for (int i = 0; i < 8; ++i) {
+                        // estimates of neighborhood frames are not aggregated to the current frame
+                        if (!temporal || index_z[i] == center) {
+                            update_coverage(coverage, coverage_stride, index_x[i], index_y[i]);
                         }
                     }
-                    return temp;
-                }();
+                }
+
+                filter(errors, index_x, index_y, index_z);
+            }
+        }
+
+        if (tiled) {
+            end_tile();
+        }
+    });
+}
+
+// Aggregation step of spatial denoising of `bm3d`, on rows in [`row_begin`, `row_end`).
+template <bool chroma>
+static inline void bm3d_aggregation(
+    std::array<float * VS_RESTRICT, num_planes(chroma)> &dstps,
+    int stride,
+    const float * VS_RESTRICT buffer,
+    const std::array<float, num_planes(chroma)> &sigma,
+    bool opp,
+    int width, int height,
+    int row_begin, int row_end
+) noexcept {
+
+    if (row_begin >= row_end) {
+        return;
+    }
+
+    const int offset = row_begin * stride;
+
+    if constexpr (chroma) {
+        if (opp) {
+            // planes of the buffer are addressed relative to the full height
+            std::array<float * VS_RESTRICT, 3> dstps_rows {
+                &dstps[0][offset], &dstps[1][offset], &dstps[2][offset]
+            };
+
+            aggregation_opp(dstps_rows, stride, &buffer[offset], width, height, row_end - row_begin);
+            return;
+        }
+    }
+
+    for (int plane = 0; plane < num_planes(chroma); ++plane) {
+        if (!chroma || !(sigma[plane] < std::numeric_limits<float>::epsilon())) {
+            aggregation(
+                &dstps[plane][offset], stride,
+                &buffer[height * stride * 2 * plane + offset],
+                &buffer[height * stride * (2 * plane + 1) + offset],
+                width, row_end - row_begin
+            );
+        }
+    }
+}
+
+// reads per-frame overrides of "sigma" and "bm_range" from frame properties
+// "_BM3D_sigma" and "_BM3D_bm_range", which follow the same rules as the arguments,
+// returns an error message on invalid values
+//
+// planes not processed by the filter are not affected, and zero "sigma" is only
+// accepted on RGB input of CBM3D, where the plane is passed through
+static inline std::string get_overrides(
+    std::array<float, 3> & sigma, int bm_range[3],
+    const VSMap * props, const bool process[3], bool final_, bool opp,
+    const VSAPI * vsapi
+) noexcept {
+
+    int error;
+
+    int num_sigma = vsapi->mapNumElements(props, "_BM3D_sigma");
+    for (int i = 0; i < 3 && num_sigma > 0; ++i) {
+        float value = static_cast<float>(
+            vsapi->mapGetFloat(props, "_BM3D_sigma", std::min(i, num_sigma - 1), &error));
+
+        if (error) {
+            return "\"_BM3D_sigma\" must be of type float";
+        } else if (!process[i]) {
+            continue;
+        } else if (value < 0.f || (!opp && value < std::numeric_limits<float>::epsilon())) {
+            return "\"_BM3D_sigma\" must be positive on processed planes";
+        }
+
+        // assumes grayscale input, hard_thr = 2.7
+        sigma[i] = value * ((3.f / 4.f) / 255.f * 64.f * (final_ ? 1.0f : 2.7f));
+    }
+
+    int num_bm_range = vsapi->mapNumElements(props, "_BM3D_bm_range");
+    for (int i = 0; i < 3 && num_bm_range > 0; ++i) {
+        int64_t value = vsapi->mapGetInt(
+            props, "_BM3D_bm_range", std::min(i, num_bm_range - 1), &error);
+
+        if (error) {
+            return "\"_BM3D_bm_range\" must be of type int";
+        } else if (value <= 0 || value > std::numeric_limits<int>::max()) {
+            return "\"_BM3D_bm_range\" must be positive";
+        }
+
+        bm_range[i] = static_cast<int>(value);
+    }
+
+    return {};
+}
+
+// Denoises a frame from the frames of its temporal window.
+//
+// In batch mode, `batch_index` is the index of the frame in its batch, and
+// Y planes of RGB input computed for the previous frame of the batch are reused.
+static VSFrame * BM3DProcessFrame(
+    const std::vector<const VSFrame *> & src_frames,
+    const std::vector<const VSFrame *> & ref_frames,
+    int batch_index,
+    BM3DData * d, VSFrameContext * frameCtx, VSCore * core, const VSAPI * vsapi
+) {
+
+    const int radius = d->radius;
+    const int center = radius;
+    const int temporal_width = 2 * radius + 1;
+    const VSFrame * const src_frame = src_frames[center];
+    const auto frame_start = PerfSummary::clock::now();
+
+    std::array frame_sigma { d->sigma };
+    int frame_bm_range[3] { d->bm_range[0], d->bm_range[1], d->bm_range[2] };
+    if (auto error = get_overrides(
+            frame_sigma, frame_bm_range, vsapi->getFramePropertiesRO(src_frame),
+            d->process, d->ref_node != nullptr, d->opp, vsapi);
+        !error.empty()
+    ) {
+        vsapi->setFilterError(("BM3D: " + error).c_str(), frameCtx);
+        return nullptr;
+    }
+
+    SearchStats stats {};
+
+    // In `fields` mode, each field is processed as a plane of the rows
+    // of the same parity, i.e. with doubled stride and half height,
+    // directly on the memory of the frames.
+    const int num_fields = d->fields ? 2 : 1;
+
+    // runs `process(field)` on the frame,
+    // or on both fields one after the other in `fields` mode
+    const auto run_fields = [&](const auto & process) {
+        d->perf.add_stage(bm3d_stage_prepare, PerfSummary::elapsed_ns(frame_start));
+        const auto denoise_start = PerfSummary::clock::now();
+
+        for (int field = 0; field < num_fields; ++field) {
+            process(field);
+        }
+
+        d->perf.add_stage(bm3d_stage_denoise, PerfSummary::elapsed_ns(denoise_start));
+    };
+
+    VSFrame * const dst_frame = [&](){
+        if (radius == 0) {
+            const VSFrame * fr[] {
+                d->process[0] ? nullptr : src_frame,
+                d->process[1] ? nullptr : src_frame,
+                d->process[2] ? nullptr : src_frame
+            };
+            const int pl[] { 0, 1, 2 };
+            return vsapi->newVideoFrame2(
+                &d->vi->format, d->vi->width, d->vi->height,
+                fr, pl, src_frame, core);
+        } else if (d->pruned_plane >= 0) {
+            return vsapi->newVideoFrame(
+                &d->pruned_format,
+                vsapi->getFrameWidth(src_frame, d->pruned_plane),
+                vsapi->getFrameHeight(src_frame, d->pruned_plane) * 2 * temporal_width,
+                src_frame, core);
+        } else {
+            auto frame = vsapi->newVideoFrame(
+                &d->vi->format, d->vi->width, d->vi->height * 2 * temporal_width,
+                src_frame, core);
+            for (int i = 0; i < d->vi->format.numPlanes; ++i) {
+                if (d->zero_init && !d->process[i]) {
+                    auto ptr = vsapi->getWritePtr(frame, i);
+                    auto height = vsapi->getFrameHeight(frame, i);
+                    auto pitch = vsapi->getStride(frame, i);
+                    memset(ptr, 0, height * pitch);
+                }
+            }
+            return frame;
+        }
+    }();
+
+    const auto cast_fp = [](auto * p) {
+        if constexpr (std::is_const_v<std::remove_pointer_t<decltype(p)>>) {
+            return reinterpret_cast<const float *>(p);
+        }
+        else {
+            return reinterpret_cast<float *>(p);
+        }
+    };
+
+    if (d->chroma) {
+        constexpr bool chroma = true;
+
+        std::vector srcps = [&](){
+            std::vector<const float *> temp;
+            temp.reserve(3 * temporal_width);
+            for (int plane = 0; plane < 3; ++plane) {
+                for (const auto & frame : src_frames) {
+                    temp.push_back(cast_fp(vsapi->getReadPtr(frame, plane)));
+                }
+            }
+            return temp;
+        }();
+
+        std::vector refps = [&](){
+            std::vector<const float *> temp;
+            temp.reserve(3 * temporal_width);
+            for (int plane = 0; plane < 3; ++plane) {
+                for (const auto & frame : ref_frames) {
+                    temp.push_back(cast_fp(vsapi->getReadPtr(frame, plane)));
+                }
+            }
+            return temp;
+        }();
+
+        std::array<float * VS_RESTRICT, 3> dstps {
+            const_cast<float * VS_RESTRICT>(cast_fp(vsapi->getWritePtr(dst_frame, 0))),
+            const_cast<float * VS_RESTRICT>(cast_fp(vsapi->getWritePtr(dst_frame, 1))),
+            const_cast<float * VS_RESTRICT>(cast_fp(vsapi->getWritePtr(dst_frame, 2)))
+        };
+
+        const int width = vsapi->getFrameWidth(src_frame, 0);
+        const int height = vsapi->getFrameHeight(src_frame, 0);
+        const int stride = vsapi->getStride(src_frame, 0) / sizeof(float);
+        const std::array sigma { frame_sigma };
+        const int block_step = d->block_step[0];
+        const int bm_range = frame_bm_range[0];
+        const int ps_num = d->ps_num[0];
+        const int ps_range = d->ps_range[0];
+
+        // accumulation buffers of spatial BM3D,
+        // followed by Y planes of RGB input of the whole batch used in block-matching
+        // if they are not shared through the artifact store
+        const bool share_luma = d->opp && d->artifact_budget > 0;
+        const int num_accumulation_planes = radius == 0 ? 2 * num_planes(chroma) : 0;
+        const int num_buffer_planes = (
+            num_accumulation_planes + (d->opp && !share_luma ? temporal_width + d->batch - 1 : 0));
+
+        float * buffer {};
+        if (num_buffer_planes > 0) {
+            const auto thread_id = std::this_thread::get_id();
+            bool init = true;
+
+            d->buffer_lock.lock_shared();
+
+            try {
+                const auto & const_buffer = d->buffer;
+                buffer = const_buffer.at(thread_id);
+            } catch (const std::out_of_range &) {
+                init = false;
+            }
+
+            d->buffer_lock.unlock_shared();
+
+            if (!init) {
+                buffer = vsh::vsh_aligned_malloc<float>(
+                    sizeof(float) * stride * height * num_buffer_planes, 32);
+                d->perf.add_memory(sizeof(float) * stride * height * num_buffer_planes);
+
+                std::lock_guard _ { d->buffer_lock };
+                d->buffer.emplace(thread_id, buffer);
+            }
+        }
+
+        if (radius == 0) {
+            memset(buffer, 0, sizeof(float) * stride * height * num_accumulation_planes);
+        } else {
+             for (const auto & dstp : dstps) {
+                memset(dstp, 0, sizeof(float) * stride * height * 2 * temporal_width);
+             }
+        }
+
+        // Y planes of RGB input held from the artifact store
+        std::vector<std::shared_ptr<const float>> shared_lumaps;
+
+        std::vector matchps = [&](){
+            const auto & inputps = d->ref_node ? refps : srcps;
+            const auto & input_frames = d->ref_node ? ref_frames : src_frames;
+            std::vector<const float *> temp;
+            temp.reserve(temporal_width);
+            for (int i = 0; i < temporal_width; ++i) {
+                if (share_luma) {
+                    const ArtifactKey key { input_frames[i], 0, ArtifactType::opp_luma, 0 };
+                    const size_t size = sizeof(float) * stride * height;
+                    bool hit;
+                    auto lumap = ArtifactStore::get().acquire(key, size, [&](float * dstp) {
+                        opp_luma(
+                            dstp,
+                            inputps[i], inputps[temporal_width + i], inputps[2 * temporal_width + i],
+                            stride, width, height);
+                    }, vsapi, hit);
+                    d->perf.add_cache(bm3d_cache_artifact, hit, static_cast<int64_t>(size));
+                    temp.push_back(lumap.get());
+                    shared_lumaps.push_back(std::move(lumap));
+                } else if (d->opp) {
+                    float * lumap = &buffer[
+                        stride * height * (num_accumulation_planes + batch_index + i)];
+                    // only the last frame of the window is new to the batch
+                    if (batch_index == 0 || i == temporal_width - 1) {
+                        opp_luma(
+                            lumap,
+                            inputps[i], inputps[temporal_width + i], inputps[2 * temporal_width + i],
+                            stride, width, height);
+                    }
+                    temp.push_back(lumap);
+                } else {
+                    temp.push_back(inputps[i]);
+                }
+            }
+            return temp;
+        }();
+
+        const int field_stride = stride * num_fields;
+        const int field_height = height / num_fields;
+
+        // shared by all planes of a field
+        std::vector<uint8_t> coverage_maps[2];
+        if (d->coverage > 0) {
+            for (int field = 0; field < num_fields; ++field) {
+                coverage_maps[field].resize(
+                    static_cast<size_t>(coverage_width(width)) * coverage_height(field_height));
+            }
+        }
+
+        // shared by both fields, since it is cleared at the beginning of each tile
+        std::vector<float> tile_buffer_storage;
+        if (radius == 0 && d->tile > 0) {
+            tile_buffer_storage.resize(tile_buffer_size(d->tile, block_step, bm_range, chroma));
+        }
+
+        const auto process = [&](int field) {
+            const auto field_of = [&](auto ps) {
+                for (auto & p : ps) {
+                    p += field * stride;
+                }
+                return ps;
+            };
+            auto field_srcps = field_of(srcps);
+            auto field_refps = field_of(refps);
+            auto field_matchps = field_of(matchps);
+            auto field_dstps = field_of(dstps);
+            float * const field_buffer = buffer ? &buffer[field * stride] : nullptr;
+            float * const tile_buffer = tile_buffer_storage.data();
+            uint8_t * const coverage = coverage_maps[field].empty() ? nullptr : coverage_maps[field].data();
+
+            if (d->ref_node == nullptr) {
+                constexpr bool final_ = false;
                 if (radius == 0) {
                     constexpr bool temporal = false;
                     bm3d<temporal, chroma, final_>(
-                        dstps, stride, srcps.data(), refps.data(),
-                        width, height,
+                        field_dstps, field_stride, field_srcps.data(), nullptr, field_matchps.data(),
+                        width, field_height,
                         sigma, block_step, bm_range,
-                        radius, ps_num, ps_range,
-                        buffer);
+                        radius, ps_num, ps_range, d->ps_gate,
+                        d->opp, d->nlm, field_buffer, d->tile, tile_buffer, 0, field_height, stats,
+                        coverage, d->coverage);
+                    bm3d_aggregation<chroma>(
+                        field_dstps, field_stride, field_buffer, sigma, d->opp,
+                        width, field_height, 0, field_height);
                 } else {
                     constexpr bool temporal = true;
                     bm3d<temporal, chroma, final_>(
-                        dstps, stride, srcps.data(), refps.data(),
-                        width, height,
+                        field_dstps, field_stride, field_srcps.data(), nullptr, field_matchps.data(),
+                        width, field_height,
+                        sigma, block_step, bm_range,
+                        radius, ps_num, ps_range, d->ps_gate,
+                        d->opp, d->nlm, nullptr, 0, nullptr, 0, field_height, stats,
+                        coverage, d->coverage);
+                }
+
+            } else {
+                constexpr bool final_ = true;
+                if (radius == 0) {
+                    constexpr bool temporal = false;
+                    bm3d<temporal, chroma, final_>(
+                        field_dstps, field_stride, field_srcps.data(), field_refps.data(), field_matchps.data(),
+                        width, field_height,
                         sigma, block_step, bm_range,
-                        radius, ps_num, ps_range,
-                        nullptr);
+                        radius, ps_num, ps_range, d->ps_gate,
+                        d->opp, d->nlm, field_buffer, d->tile, tile_buffer, 0, field_height, stats,
+                        coverage, d->coverage);
+                    bm3d_aggregation<chroma>(
+                        field_dstps, field_stride, field_buffer, sigma, d->opp,
+                        width, field_height, 0, field_height);
+                } else {
+                    constexpr bool temporal = true;
+                    bm3d<temporal, chroma, final_>(
+                        field_dstps, field_stride, field_srcps.data(), field_refps.data(), field_matchps.data(),
+                        width, field_height,
+                        sigma, block_step, bm_range,
+                        radius, ps_num, ps_range, d->ps_gate,
+                        d->opp, d->nlm, nullptr, 0, nullptr, 0, field_height, stats,
+                        coverage, d->coverage);
                 }
             }
-        } else {
-            constexpr bool chroma = false;
-
-            for (int plane = 0; plane < d->vi->format.numPlanes; plane++) {
-                if (d->process[plane]) {
-                    std::vector srcps = [&](){
-                        std::vector<const float *> temp;
-                        temp.reserve(temporal_width);
-                        for (const auto & frame : src_frames) {
-                            temp.push_back(cast_fp(vsapi->getReadPtr(frame, plane)));
-                        }
-                        return temp;
-                    }();
-                    std::array<float * VS_RESTRICT, 1> dstps { const_cast<float * VS_RESTRICT>(cast_fp(vsapi->getWritePtr(dst_frame, plane))) };
-
-                    const int width = vsapi->getFrameWidth(src_frame, plane);
-                    const int height = vsapi->getFrameHeight(src_frame, plane);
-                    const int stride = vsapi->getStride(src_frame, plane) / sizeof(float);
-                    const std::array sigma { d->sigma[plane] };
-                    const int block_step = d->block_step[plane];
-                    const int bm_range = d->bm_range[plane];
-                    const int ps_num = d->ps_num[plane];
-                    const int ps_range = d->ps_range[plane];
-
-                    float * buffer {};
-                    if (radius == 0) {
-                        const auto thread_id = std::this_thread::get_id();
-                        bool init = true;
+        };
 
-                        d->buffer_lock.lock_shared();
+        run_fields(process);
+    } else {
+        constexpr bool chroma = false;
+
+        // Planes are processed band by band, so that co-located bands of all planes
+        // are processed while the input rows are still in cache.
+        // Each plane keeps its own parameters and its own block-matching.
+        constexpr int band_height = 32; // in rows of the first plane
+
+        struct PlaneData {
+            std::vector<const float *> srcps;
+            std::vector<const float *> refps;
+            std::array<float * VS_RESTRICT, 1> dstps;
+            int width;
+            int height;
+            int stride;
+            std::array<float, 1> sigma;
+            int block_step;
+            int bm_range;
+            int ps_num;
+            int ps_range;
+            float * buffer; // accumulation buffers of spatial BM3D
+            int num_aggregated_rows;
+            std::vector<uint8_t> coverage; // empty if disabled
+            int field;
+        };
 
-                        try {
-                            const auto & const_buffer = d->buffer;
-                            buffer = const_buffer.at(thread_id);
-                        } catch (const std::out_of_range &) {
-                            init = false;
-                        }
+        // one view of each processed plane per field
+        std::vector<PlaneData> planes;
+        planes.reserve(d->vi->format.numPlanes * num_fields);
+        size_t buffer_size = 0;
+        for (int plane = 0; plane < d->vi->format.numPlanes; plane++) {
+            if (!d->process[plane]) {
+                continue;
+            }
 
-                        d->buffer_lock.unlock_shared();
+            std::vector srcps = [&](){
+                std::vector<const float *> temp;
+                temp.reserve(temporal_width);
+                for (const auto & frame : src_frames) {
+                    temp.push_back(cast_fp(vsapi->getReadPtr(frame, plane)));
+                }
+                return temp;
+            }();
+            std::vector refps = [&](){
+                std::vector<const float *> temp;
+                temp.reserve(temporal_width);
+                for (const auto & frame : ref_frames) {
+                    temp.push_back(cast_fp(vsapi->getReadPtr(frame, plane)));
+                }
+                return temp;
+            }();
 
-                        if (!init) {
-                            buffer = vsh::vsh_aligned_malloc<float>(
-                                sizeof(float) * stride * height * 2 * num_planes(chroma), 32);
+            const int height = vsapi->getFrameHeight(src_frame, plane);
+            const int stride = vsapi->getStride(src_frame, plane) / sizeof(float);
+
+            PlaneData data {};
+            data.srcps = std::move(srcps);
+            data.refps = std::move(refps);
+            const int dst_plane = d->pruned_plane >= 0 ? 0 : plane;
+            data.dstps = { const_cast<float * VS_RESTRICT>(cast_fp(vsapi->getWritePtr(dst_frame, dst_plane))) };
+            data.width = vsapi->getFrameWidth(src_frame, plane);
+            data.height = height;
+            data.stride = stride;
+            data.sigma = { frame_sigma[plane] };
+            data.block_step = d->block_step[plane];
+            data.bm_range = frame_bm_range[plane];
+            data.ps_num = d->ps_num[plane];
+            data.ps_range = d->ps_range[plane];
+            for (int field = 0; field < num_fields; ++field) {
+                PlaneData view = data;
+                for (auto & srcp : view.srcps) {
+                    srcp += field * stride;
+                }
+                for (auto & refp : view.refps) {
+                    refp += field * stride;
+                }
+                view.dstps[0] += field * stride;
+                view.height = height / num_fields;
+                view.stride = stride * num_fields;
+                if (d->coverage > 0) {
+                    view.coverage.resize(
+                        static_cast<size_t>(coverage_width(view.width)) * coverage_height(view.height));
+                }
+                view.field = field;
+                planes.push_back(std::move(view));
+            }
 
-                            std::lock_guard _ { d->buffer_lock };
-                            d->buffer.emplace(thread_id, buffer);
-                        }
-                    }
+            if (radius == 0) {
+                buffer_size += static_cast<size_t>(stride) * height * 2 * num_planes(chroma);
+            }
+        }
 
-                    if (radius == 0) {
-                        memset(buffer, 0, sizeof(float) * stride * height * 2 * num_planes(chroma));
-                    } else {
-                        for (const auto & dstp : dstps) {
-                            memset(dstp, 0, sizeof(float) * stride * height * 2 * temporal_width);
-                        }
+        // shared by all planes and both fields
+        std::vector<float> tile_buffer_storage;
+        if (radius == 0 && d->tile > 0) {
+            size_t tile_size = 0;
+            for (const auto & p : planes) {
+                tile_size = std::max(
+                    tile_size, tile_buffer_size(d->tile, p.block_step, p.bm_range, chroma));
+            }
+            tile_buffer_storage.resize(tile_size);
+        }
+
+        float * buffer {};
+        if (radius == 0 && !planes.empty()) {
+            const auto thread_id = std::this_thread::get_id();
+            bool init = true;
+
+            d->buffer_lock.lock_shared();
+
+            try {
+                const auto & const_buffer = d->buffer;
+                buffer = const_buffer.at(thread_id);
+            } catch (const std::out_of_range &) {
+                init = false;
+            }
+
+            d->buffer_lock.unlock_shared();
+
+            if (!init) {
+                buffer = vsh::vsh_aligned_malloc<float>(sizeof(float) * buffer_size, 32);
+                d->perf.add_memory(sizeof(float) * buffer_size);
+
+                std::lock_guard _ { d->buffer_lock };
+                d->buffer.emplace(thread_id, buffer);
+            }
+
+            memset(buffer, 0, sizeof(float) * buffer_size);
+        }
+
+        // views of a plane are interleaved in its buffers and output frames
+        float * current_buffer = buffer;
+        for (auto & p : planes) {
+            if (radius == 0) {
+                p.buffer = current_buffer + p.field * (p.stride / num_fields);
+                if (p.field == num_fields - 1) {
+                    current_buffer += static_cast<size_t>(p.stride) * p.height * 2 * num_planes(chroma);
+                }
+            } else if (p.field == 0) {
+                for (const auto & dstp : p.dstps) {
+                    memset(dstp, 0, sizeof(float) * p.stride * p.height * 2 * temporal_width);
+                }
+            }
+        }
+
+        const int num_bands = std::max(
+            (d->vi->height / num_fields + band_height - 1) / band_height, 1);
+
+        const auto process = [&](int field) {
+            float * const tile_buffer = tile_buffer_storage.data();
+
+            for (int band = 0; band < num_bands; ++band) {
+                for (auto & p : planes) {
+                    if (p.field != field) {
+                        continue;
                     }
 
+                    const int width = p.width;
+                    const int height = p.height;
+                    const int stride = p.stride;
+                    const auto & sigma = p.sigma;
+                    const int block_step = p.block_step;
+                    const int bm_range = p.bm_range;
+                    const int ps_num = p.ps_num;
+                    const int ps_range = p.ps_range;
+                    auto & dstps = p.dstps;
+                    uint8_t * coverage = p.coverage.empty() ? nullptr : p.coverage.data();
+
+                    // co-located range of vertical coordinates of reference blocks,
+                    // aligned to `block_step`
+                    const auto band_boundary = [&](int i) {
+                        int64_t num_rows = height - 8 + block_step;
+                        int y = static_cast<int>((num_rows * i + num_bands - 1) / num_bands);
+                        return (y + block_step - 1) / block_step * block_step;
+                    };
+                    const int y_begin = band_boundary(band);
+                    const int y_end = band_boundary(band + 1);
+
                     if (d->ref_node == nullptr) {
                         constexpr bool final_ = false;
                         if (radius == 0) {
                             constexpr bool temporal = false;
                             bm3d<temporal, chroma, final_>(
-                                dstps, stride, srcps.data(), nullptr,
+                                dstps, stride, p.srcps.data(), nullptr, p.srcps.data(),
                                 width, height,
                                 sigma, block_step, bm_range,
-                                radius, ps_num, ps_range,
-                                buffer);
+                                radius, ps_num, ps_range, d->ps_gate,
+                                false, d->nlm, p.buffer, d->tile, tile_buffer, y_begin, y_end, stats,
+                                coverage, d->coverage);
                         } else {
                             constexpr bool temporal = true;
                             bm3d<temporal, chroma, final_>(
-                                dstps, stride, srcps.data(), nullptr,
+                                dstps, stride, p.srcps.data(), nullptr, p.srcps.data(),
                                 width, height,
                                 sigma, block_step, bm_range,
-                                radius, ps_num, ps_range,
-                                nullptr);
+                                radius, ps_num, ps_range, d->ps_gate,
+                                false, d->nlm, nullptr, 0, nullptr, y_begin, y_end, stats,
+                                coverage, d->coverage);
                         }
                     } else {
                         constexpr bool final_ = true;
-                        std::vector refps = [&](){
-                            std::vector<const float *> temp;
-                            temp.reserve(temporal_width);
-                            for (const auto & frame : ref_frames) {
-                                temp.push_back(cast_fp(vsapi->getReadPtr(frame, plane)));
-                            }
-                            return temp;
-                        }();
                         if (radius == 0) {
                             constexpr bool temporal = false;
                             bm3d<temporal, chroma, final_>(
-                                dstps, stride, srcps.data(), refps.data(),
+                                dstps, stride, p.srcps.data(), p.refps.data(), p.refps.data(),
                                 width, height,
                                 sigma, block_step, bm_range,
-                                radius, ps_num, ps_range,
-                                buffer);
+                                radius, ps_num, ps_range, d->ps_gate,
+                                false, d->nlm, p.buffer, d->tile, tile_buffer, y_begin, y_end, stats,
+                                coverage, d->coverage);
                         } else {
                             constexpr bool temporal = true;
                             bm3d<temporal, chroma, final_>(
-                                dstps, stride, srcps.data(), refps.data(),
+                                dstps, stride, p.srcps.data(), p.refps.data(), p.refps.data(),
                                 width, height,
                                 sigma, block_step, bm_range,
-                                radius, ps_num, ps_range,
-                                nullptr);
+                                radius, ps_num, ps_range, d->ps_gate,
+                                false, d->nlm, nullptr, 0, nullptr, y_begin, y_end, stats,
+                                coverage, d->coverage);
                         }
                     }
+
+                    // rows no longer modified by subsequent bands are aggregated
+                    if (radius == 0) {
+                        const int num_completed_rows = (band == num_bands - 1) ?
+                            height :
+                            std::max(std::min(y_end, height - 8) - bm_range, 0);
+
+                        bm3d_aggregation<chroma>(
+                            dstps, stride, p.buffer, sigma, false,
+                            width, height, p.num_aggregated_rows, num_completed_rows);
+
+                        p.num_aggregated_rows = std::max(p.num_aggregated_rows, num_completed_rows);
+                    }
                 }
             }
+        };
+
+        run_fields(process);
+    }
+
+    if (radius != 0) {
+        d->num_searched.fetch_add(stats.num_searched, std::memory_order_relaxed);
+        d->num_skipped.fetch_add(stats.num_skipped, std::memory_order_relaxed);
+
+        VSMap * dst_prop { vsapi->getFramePropertiesRW(dst_frame) };
+
+        vsapi->mapSetInt(dst_prop, "BM3D_V_radius", radius, maReplace);
+
+        int64_t process[3] { d->process[0], d->process[1], d->process[2] };
+        vsapi->mapSetIntArray(dst_prop, "BM3D_V_process", process, 3);
+
+        if (d->opp) {
+            vsapi->mapSetInt(dst_prop, "BM3D_V_opp", 1, maReplace);
+        }
+    }
+
+    d->perf.add_frame(PerfSummary::elapsed_ns(frame_start));
+
+    return dst_frame;
+}
+
+static const VSFrame *VS_CC BM3DGetFrame(
+    int n, int activationReason, void *instanceData, void **frameData,
+    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi
+) {
+
+    auto * d = static_cast<BM3DData *>(instanceData);
+
+    TraceScope trace_scope { d->trace.get(), d->trace_instance, n, activationReason };
+
+    // frames of the batch containing frame `n`
+    const int first_frame = n - n % d->batch;
+    const int last_frame = std::min(first_frame + d->batch - 1, d->vi->numFrames - 1);
+
+    // takes a frame computed in another request, if any
+    const auto take_cached = [&](int i) -> const VSFrame * {
+        auto & cache = d->batch_cache;
+        auto it = std::find_if(cache.begin(), cache.end(), [i](const auto & item) {
+            return item.first == i;
+        });
+        if (it == cache.end()) {
+            return nullptr;
         }
+        auto frame = it->second;
+        cache.erase(it);
+        return frame;
+    };
 
-        for (const auto & frame : src_frames) {
+    if (activationReason == arInitial) {
+        if (d->batch > 1) {
+            std::lock_guard _ { d->batch_lock };
+            if (auto frame = take_cached(n)) {
+                d->perf.add_cache(bm3d_cache_batch, true);
+                return frame;
+            }
+        }
+
+        int start_frame = std::max(first_frame - d->radius, 0);
+        int end_frame = std::min(last_frame + d->radius, d->vi->numFrames - 1);
+
+        for (int i = start_frame; i <= end_frame; ++i) {
+            vsapi->requestFrameFilter(i, d->node, frameCtx);
+        }
+        if (d->ref_node != nullptr) {
+            for (int i = start_frame; i <= end_frame; ++i) {
+                vsapi->requestFrameFilter(i, d->ref_node, frameCtx);
+            }
+        }
+    } else if (activationReason == arAllFramesReady) {
+        const int radius = d->radius;
+
+        if (d->batch > 1) {
+            const auto wait_start = std::chrono::steady_clock::now();
+            std::unique_lock lock { d->batch_lock };
+            d->batch_cv.wait(lock, [&]{ return d->batch_pending.count(first_frame) == 0; });
+            trace_scope.add_wait(wait_start);
+            d->perf.add_wait(PerfSummary::elapsed_ns(wait_start));
+            if (auto frame = take_cached(n)) {
+                d->perf.add_cache(bm3d_cache_batch, true);
+                return frame;
+            }
+            d->perf.add_cache(bm3d_cache_batch, false);
+            d->batch_pending.insert(first_frame);
+        }
+
+        // input frames shared by the batch
+        const auto get_window = [&](VSNode * node) {
+            std::vector<const VSFrame *> temp;
+            temp.reserve(2 * radius + last_frame - first_frame + 1);
+            for (int i = first_frame - radius; i <= last_frame + radius; ++i) {
+                int clamped_n = std::clamp(i, 0, d->vi->numFrames - 1);
+                temp.push_back(vsapi->getFrameFilter(clamped_n, node, frameCtx));
+            }
+            return temp;
+        };
+        const std::vector src_window = get_window(d->node);
+        const std::vector ref_window = [&](){
+            if (d->ref_node) {
+                return get_window(d->ref_node);
+            }
+            return std::vector<const VSFrame *>{};
+        }();
+
+        const VSFrame * dst_frame {};
+        std::vector<std::pair<int, const VSFrame *>> batch_frames;
+        for (int i = first_frame; i <= last_frame; ++i) {
+            const int batch_index = i - first_frame;
+            const auto get_frames = [&](const std::vector<const VSFrame *> & window) {
+                if (window.empty()) {
+                    return std::vector<const VSFrame *>{};
+                }
+                return std::vector(
+                    window.begin() + batch_index,
+                    window.begin() + batch_index + 2 * radius + 1);
+            };
+
+            auto frame = BM3DProcessFrame(
+                get_frames(src_window), get_frames(ref_window),
+                batch_index, d, frameCtx, core, vsapi);
+
+            if (frame == nullptr) {
+                for (const auto & [_, batch_frame] : batch_frames) {
+                    vsapi->freeFrame(batch_frame);
+                }
+                vsapi->freeFrame(dst_frame);
+                dst_frame = nullptr;
+                batch_frames.clear();
+                break;
+            } else if (i == n) {
+                dst_frame = frame;
+            } else {
+                batch_frames.emplace_back(i, frame);
+            }
+        }
+
+        for (const auto & frame : src_window) {
             vsapi->freeFrame(frame);
         }
 
-        for (const auto & frame : ref_frames) {
+        for (const auto & frame : ref_window) {
             vsapi->freeFrame(frame);
         }
 
-        if (radius != 0) {
-            VSMap * dst_prop { vsapi->getFramePropertiesRW(dst_frame) };
+        if (d->batch > 1) {
+            std::lock_guard _ { d->batch_lock };
+
+            auto & cache = d->batch_cache;
+            for (const auto & item : batch_frames) {
+                cache.push_back(item);
+            }
+            while (static_cast<int>(cache.size()) > d->batch_cache_capacity) {
+                vsapi->freeFrame(cache.front().second);
+                cache.pop_front();
+            }
+
+            d->batch_pending.erase(first_frame);
+            d->batch_cv.notify_all();
+        }
+
+        return dst_frame;
+    }
+
+    return nullptr;
+}
+
+// Input frames of the window are copied to the shared memory of a connection
+// to the server, which holds the actual filter instance.
+static const VSFrame *VS_CC BM3DRemoteGetFrame(
+    int n, int activationReason, void *instanceData, void **frameData,
+    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi
+) {
+
+    auto * d = static_cast<BM3DData *>(instanceData);
+
+    TraceScope trace_scope { d->trace.get(), d->trace_instance, n, activationReason };
+
+    const int start_frame = std::max(n - d->radius, 0);
+    const int end_frame = std::min(n + d->radius, d->vi->numFrames - 1);
+
+    if (activationReason == arInitial) {
+        for (int i = start_frame; i <= end_frame; ++i) {
+            vsapi->requestFrameFilter(i, d->node, frameCtx);
+        }
+        if (d->ref_node != nullptr) {
+            for (int i = start_frame; i <= end_frame; ++i) {
+                vsapi->requestFrameFilter(i, d->ref_node, frameCtx);
+            }
+        }
+    } else if (activationReason == arAllFramesReady) {
+        const auto frame_start = PerfSummary::clock::now();
+
+        const auto get_window = [&](VSNode * node) {
+            std::vector<std::pair<int, const VSFrame *>> window;
+            if (node) {
+                for (int i = start_frame; i <= end_frame; ++i) {
+                    window.emplace_back(i, vsapi->getFrameFilter(i, node, frameCtx));
+                }
+            }
+            return window;
+        };
+        const auto src_window = get_window(d->node);
+        const auto ref_window = get_window(d->ref_node);
+
+        std::string error;
+        int64_t transfer_ns {};
+        auto dst_frame = d->remote->process(
+            n, src_window, ref_window, core, vsapi, error, transfer_ns);
 
-            vsapi->mapSetInt(dst_prop, "BM3D_V_radius", radius, maReplace);
+        for (const auto & window : { &src_window, &ref_window }) {
+            for (const auto & item : *window) {
+                vsapi->freeFrame(item.second);
+            }
+        }
 
-            int64_t process[3] { d->process[0], d->process[1], d->process[2] };
-            vsapi->mapSetIntArray(dst_prop, "BM3D_V_process", process, 3);
+        if (!dst_frame) {
+            vsapi->setFilterError(("BM3D: " + error).c_str(), frameCtx);
+            return nullptr;
         }
 
+        // copies to and from shared memory, and the round trip to the server
+        const auto latency_ns = PerfSummary::elapsed_ns(frame_start);
+        d->perf.add_stage(bm3d_stage_prepare, transfer_ns);
+        d->perf.add_stage(bm3d_stage_denoise, latency_ns - transfer_ns);
+        d->perf.add_frame(latency_ns);
+
         return dst_frame;
     }
 
@@ -1243,6 +2298,30 @@ static void VS_CC BM3DFree(
         vsh::vsh_aligned_free(p.second);
     }
 
+    for (auto & p : d->batch_cache) {
+        vsapi->freeFrame(p.second);
+    }
+
+    if (d->artifact_budget > 0) {
+        ArtifactStore::get().detach(d->artifact_budget, vsapi);
+    }
+
+    d->perf.report(
+        "BM3D", { "prepare", "denoise" }, { "batch", "artifact" },
+        d->perf_path, core, vsapi);
+
+    if (d->ps_gate > 0.f) {
+        auto num_skipped = d->num_skipped.load();
+        auto num_total = d->num_searched.load() + num_skipped;
+        auto message = (
+            "BM3D: predictive search skipped " + std::to_string(num_skipped) +
+            " of " + std::to_string(num_total) + " temporal block searches");
+        if (num_total > 0) {
+            message += " (" + std::to_string(100 * num_skipped / num_total) + "%)";
+        }
+        vsapi->logMessage(mtInformation, message.c_str(), core);
+    }
+
     vsapi->freeNode(d->node);
     vsapi->freeNode(d->ref_node);
 
@@ -1253,8 +2332,8 @@ static void VS_CC BM3DCreate(
     const VSMap *in, VSMap *out, void *userData,
     VSCore *core, const VSAPI *vsapi
 ) noexcept {
-    if (!cpu_supports_avx2()) {
-        vsapi->mapSetError(out, "bm3dcpu: requires AVX2-capable cpu");
+    if (!simd_supported()) {
+        vsapi->mapSetError(out, (std::string{"bm3dcpu: requires "} + simd_name + "-capable cpu").c_str());
         return;
     }
 
@@ -1309,6 +2388,12 @@ static void VS_CC BM3DCreate(
         d->sigma[i] *= (3.f / 4.f) / 255.f * 64.f * (d->ref_node == nullptr ? 2.7f : 1.0f);
     }
 
+    // `nlm` has cheaper defaults of block-matching
+    d->nlm = !!vsapi->mapGetInt(in, "nlm", 0, &error);
+    if (error) {
+        d->nlm = false;
+    }
+
     for (unsigned i = 0; i < std::size(d->block_step); ++i) {
         int block_step = vsh::int64ToIntS(
             vsapi->mapGetInt(in, "block_step", i, &error));
@@ -1327,7 +2412,7 @@ static void VS_CC BM3DCreate(
             vsapi->mapGetInt(in, "bm_range", i, &error));
 
         if (error) {
-            bm_range = (i == 0) ? 9 : d->bm_range[i - 1];
+            bm_range = (i == 0) ? (d->nlm ? 4 : 9) : d->bm_range[i - 1];
         } else if (bm_range <= 0) {
             return set_error("\"bm_range\" must be positive");
         }
@@ -1348,7 +2433,7 @@ static void VS_CC BM3DCreate(
             vsapi->mapGetInt(in, "ps_num", i, &error));
 
         if (error) {
-            ps_num = (i == 0) ? 2 : d->ps_num[i - 1];
+            ps_num = (i == 0) ? (d->nlm ? 1 : 2) : d->ps_num[i - 1];
         } else if (ps_num <= 0) {
             return set_error("\"ps_num\" must be positive");
         }
@@ -1361,7 +2446,7 @@ static void VS_CC BM3DCreate(
             vsapi->mapGetInt(in, "ps_range", i, &error));
 
         if (error) {
-            ps_range = (i == 0) ? 4 : d->ps_range[i - 1];
+            ps_range = (i == 0) ? (d->nlm ? 3 : 4) : d->ps_range[i - 1];
         } else if (ps_range <= 0) {
             return set_error("\"ps_range\" must be positive");
         }
@@ -1369,28 +2454,131 @@ static void VS_CC BM3DCreate(
         d->ps_range[i] = ps_range;
     }
 
+    d->ps_gate = static_cast<float>(vsapi->mapGetFloat(in, "ps_gate", 0, &error));
+    if (error) {
+        d->ps_gate = 0.f;
+    } else if (d->ps_gate < 0.f) {
+        return set_error("\"ps_gate\" must be non-negative");
+    }
+
+    int64_t artifact_budget = vsapi->mapGetInt(in, "artifact_budget", 0, &error);
+    if (error) {
+        artifact_budget = 0;
+    } else if (artifact_budget < 0) {
+        return set_error("\"artifact_budget\" must be non-negative");
+    }
+    d->artifact_budget = static_cast<size_t>(artifact_budget) << 20;
+
+    d->tile = vsh::int64ToIntS(vsapi->mapGetInt(in, "tile", 0, &error));
+    if (error) {
+        d->tile = 0;
+    } else if (d->tile < 0 || d->tile > 1024) {
+        return set_error("\"tile\" must be in range [0, 1024]");
+    }
+
+    d->coverage = vsh::int64ToIntS(vsapi->mapGetInt(in, "coverage", 0, &error));
+    if (error) {
+        d->coverage = 0;
+    } else if (d->coverage < 0 || d->coverage > 255) {
+        return set_error("\"coverage\" must be in range [0, 255]");
+    }
+
     bool chroma = !!vsapi->mapGetInt(in, "chroma", 0, &error);
     if (error) {
         chroma = false;
     }
-    if (chroma && !vsh::isSameVideoPresetFormat(pfYUV444PS, &d->vi->format, core, vsapi)) {
-        return set_error("clip format must be YUV444 when \"chroma\" is true");
+    bool opp = chroma && vsh::isSameVideoPresetFormat(pfRGBS, &d->vi->format, core, vsapi);
+    if (chroma && !opp && !vsh::isSameVideoPresetFormat(pfYUV444PS, &d->vi->format, core, vsapi)) {
+        return set_error("clip format must be YUV444 or RGB when \"chroma\" is true");
     }
     d->chroma = chroma;
+    d->opp = opp;
+    if (opp) {
+        // all planes are written by the inverse color transform
+        for (unsigned i = 0; i < std::size(d->process); ++i) {
+            d->process[i] = true;
+        }
+    }
 
     d->zero_init = !!vsapi->mapGetInt(in, "zero_init", 0, &error);
     if (error) {
         d->zero_init = true;
     }
 
+    // both fields of every plane must be of the same height
+    d->fields = !!vsapi->mapGetInt(in, "fields", 0, &error);
+    if (error) {
+        d->fields = false;
+    } else if (d->fields && d->vi->height % (2 << d->vi->format.subSamplingH) != 0) {
+        return set_error(
+            "clip height must be a multiple of " + std::to_string(2 << d->vi->format.subSamplingH) +
+            " when \"fields\" is true");
+    }
+
+    // output frames of V-BM3D only carry the processed plane,
+    // if it is the only one and processed independently
+    bool prune_planes = !!vsapi->mapGetInt(in, "prune_planes", 0, &error);
+    if (error) {
+        prune_planes = false;
+    }
+    d->pruned_plane = -1;
+    if (prune_planes && radius != 0 && !chroma && d->vi->format.numPlanes > 1 &&
+        d->process[0] + d->process[1] + d->process[2] == 1
+    ) {
+        d->pruned_plane = d->process[0] ? 0 : (d->process[1] ? 1 : 2);
+        vsapi->queryVideoFormat(&d->pruned_format, cfGray, stFloat, 32, 0, 0, core);
+    }
+
+    d->batch = vsh::int64ToIntS(vsapi->mapGetInt(in, "batch", 0, &error));
+    if (error) {
+        d->batch = 1;
+    } else if (d->batch <= 0) {
+        return set_error("\"batch\" must be positive");
+    }
+    if (radius == 0) {
+        // no input frames are shared by spatial BM3D
+        d->batch = 1;
+    }
+    if (d->batch > 1) {
+        VSCoreInfo ci;
+        vsapi->getCoreInfo(core, &ci);
+        d->batch_cache_capacity = (d->batch - 1) * ci.numThreads;
+    }
+
+    if (auto trace = vsapi->mapGetData(in, "trace", 0, &error); !error) {
+        std::string error_message;
+        d->trace = TraceFile::open(trace, error_message);
+        if (!d->trace) {
+            return set_error(error_message);
+        }
+
+        VSCoreInfo ci;
+        vsapi->getCoreInfo(core, &ci);
+        d->trace_instance = d->trace->add_instance(
+            TraceFilter::bm3d, d->vi->numFrames, radius, d->vi->width, d->vi->height,
+            ci.numThreads, 0);
+    }
+
+    if (auto perf = vsapi->mapGetData(in, "perf", 0, &error); !error) {
+        d->perf_path = perf;
+    }
+
     VSVideoInfo vi = *d->vi;
     
-    if (radius == 0) {
+    if (radius == 0 || opp) {
         struct VSCoreInfo ci;
         vsapi->getCoreInfo(core, &ci);
         auto num_threads = ci.numThreads;
         d->buffer.reserve(num_threads);
-    } else {
+    }
+    if (d->pruned_plane > 0) {
+        vi.width >>= d->vi->format.subSamplingW;
+        vi.height >>= d->vi->format.subSamplingH;
+    }
+    if (d->pruned_plane >= 0) {
+        vi.format = d->pruned_format;
+    }
+    if (radius != 0) {
         vi.height *= 2 * (2 * d->radius + 1);
     }
 
@@ -1401,8 +2589,25 @@ static void VS_CC BM3DCreate(
     if (d->ref_node)
         deps.push_back({d->ref_node, rpGeneral});
 
+    if (auto server = vsapi->mapGetData(in, "server", 0, &error); !error) {
+        std::string error_message;
+        d->remote = remote::Client::connect(
+            server, in, *d->vi, vi, d->ref_node != nullptr, radius, core, vsapi, error_message);
+        if (!d->remote) {
+            return set_error(error_message);
+        }
+        // artifacts are shared on the server
+        d->artifact_budget = 0;
+    }
+
+    if (d->artifact_budget > 0) {
+        ArtifactStore::get().attach(d->artifact_budget);
+    }
+
+    auto get_frame = d->remote ? BM3DRemoteGetFrame : BM3DGetFrame;
+
     vsapi->createVideoFilter(
-        out, "BM3D", &vi, BM3DGetFrame, BM3DFree,
+        out, "BM3D", &vi, get_frame, BM3DFree,
         fmParallel, deps.data(), deps.size(), d.release(), core);
 }
 
@@ -1413,13 +2618,26 @@ struct VAggregateData {
     const VSVideoInfo * src_vi;
 
     std::array<bool, 3> process; // sigma != 0
+    std::array<int, 3> clip_plane; // plane of "clip" holding each plane of "src"
 
     int radius;
 
+    std::unique_ptr<SpillStore> spill; // out-of-core storage of "clip"
+    std::atomic<bool> opp; // "BM3D_V_opp" of "clip"
+
     std::unordered_map<std::thread::id, float *> buffer;
     std::shared_mutex buffer_lock;
+
+    std::shared_ptr<TraceFile> trace; // null if disabled
+    uint32_t trace_instance;
+
+    PerfSummary perf; // reported when the filter is freed
+    std::string perf_path; // JSON output of `perf`, empty if disabled
 };
 
+// indices of caches of `VAggregateData::perf`
+enum VAggregatePerfCache { vaggregate_cache_spill };
+
 static const VSFrame *VS_CC VAggregateGetFrame(
     int n, int activationReason, void *instanceData, void **frameData,
     VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi
@@ -1427,6 +2645,8 @@ static const VSFrame *VS_CC VAggregateGetFrame(
 
     auto * d = static_cast<VAggregateData *>(instanceData);
 
+    TraceScope trace_scope { d->trace.get(), d->trace_instance, n, activationReason };
+
     if (activationReason == arInitial) {
         int start_frame = std::max(n - d->radius, 0);
         int end_frame = std::min(n + d->radius, d->src_vi->numFrames - 1);
@@ -1436,6 +2656,8 @@ static const VSFrame *VS_CC VAggregateGetFrame(
         }
         vsapi->requestFrameFilter(n, d->src_node, frameCtx);
     } else if (activationReason == arAllFramesReady) {
+        const auto frame_start = PerfSummary::clock::now();
+
         const VSFrame * src_frame = vsapi->getFrameFilter(n, d->src_node, frameCtx);
 
         std::vector<const VSFrame *> vbm3d_frames;
@@ -1445,6 +2667,22 @@ static const VSFrame *VS_CC VAggregateGetFrame(
             vbm3d_frames.emplace_back(vsapi->getFrameFilter(frame_id, d->node, frameCtx));
         }
 
+        // planes of RGB input are processed in the opponent color space
+        // and are mixed back to RGB here
+        const bool opp = [&](){
+            int error;
+            const VSMap * props = vsapi->getFramePropertiesRO(vbm3d_frames[d->radius]);
+            return !!vsapi->mapGetInt(props, "BM3D_V_opp", 0, &error) && !error;
+        }();
+        if (opp && d->src_vi->format.colorFamily != cfRGB) {
+            for (const auto & frame : vbm3d_frames) {
+                vsapi->freeFrame(frame);
+            }
+            vsapi->freeFrame(src_frame);
+            vsapi->setFilterError("VAggregate: \"src\" must be of RGB format", frameCtx);
+            return nullptr;
+        }
+
         float * buffer {};
         {
             const auto thread_id = std::this_thread::get_id();
@@ -1465,12 +2703,15 @@ static const VSFrame *VS_CC VAggregateGetFrame(
                 assert(d->process[0] || d->src_vi->format.numPlanes > 1);
 
                 const int max_width {
-                    d->process[0] ?
+                    d->process[0] || opp ?
                     vsapi->getFrameWidth(src_frame, 0) :
                     vsapi->getFrameWidth(src_frame, 1)
                 };
 
-                buffer = reinterpret_cast<float *>(std::malloc(2 * max_width * sizeof(float)));
+                // the opponent color transform requires buffers of all planes
+                buffer = reinterpret_cast<float *>(std::malloc(
+                    2 * (opp ? 3 : 1) * max_width * sizeof(float)));
+                d->perf.add_memory(2 * (opp ? 3 : 1) * max_width * sizeof(float));
 
                 std::lock_guard _ { d->buffer_lock };
                 d->buffer.emplace(thread_id, buffer);
@@ -1478,9 +2719,9 @@ static const VSFrame *VS_CC VAggregateGetFrame(
         }
 
         const VSFrame * fr[] {
-            d->process[0] ? nullptr : src_frame,
-            d->process[1] ? nullptr : src_frame,
-            d->process[2] ? nullptr : src_frame
+            d->process[0] || opp ? nullptr : src_frame,
+            d->process[1] || opp ? nullptr : src_frame,
+            d->process[2] || opp ? nullptr : src_frame
         };
         constexpr int pl[] { 0, 1, 2 };
         auto dst_frame = vsapi->newVideoFrame2(
@@ -1488,8 +2729,58 @@ static const VSFrame *VS_CC VAggregateGetFrame(
             d->src_vi->width, d->src_vi->height,
             fr, pl, src_frame, core);
 
+        if (opp) {
+            int width = vsapi->getFrameWidth(src_frame, 0);
+            int height = vsapi->getFrameHeight(src_frame, 0);
+            int stride = vsapi->getStride(src_frame, 0) / sizeof(float);
+
+            std::vector<const float *> srcps;
+            srcps.reserve(3 * (2 * d->radius + 1));
+            for (int plane = 0; plane < 3; ++plane) {
+                for (int i = 0; i < 2 * d->radius + 1; ++i) {
+                    srcps.emplace_back(reinterpret_cast<const float *>(vsapi->getReadPtr(vbm3d_frames[i], plane)));
+                }
+            }
+
+            std::array<float *, 3> dstps;
+            for (int plane = 0; plane < 3; ++plane) {
+                dstps[plane] = reinterpret_cast<float *>(vsapi->getWritePtr(dst_frame, plane));
+            }
+
+            for (int y = 0; y < height; ++y) {
+                memset(buffer, 0, 2 * 3 * width * sizeof(float));
+                for (int plane = 0; plane < 3; ++plane) {
+                    float * plane_buffer = &buffer[2 * plane * width];
+                    for (int i = 0; i < 2 * d->radius + 1; ++i) {
+                        auto agg_src = srcps[plane * (2 * d->radius + 1) + i];
+                        agg_src += (
+                            std::clamp(2 * d->radius - i, n - d->src_vi->numFrames + 1 + d->radius, n + d->radius)
+                            * 2 * height + y) * stride;
+                        for (int x = 0; x < width; ++x) {
+                            plane_buffer[x] += agg_src[x];
+                        }
+                        agg_src += height * stride;
+                        for (int x = 0; x < width; ++x) {
+                            plane_buffer[width + x] += agg_src[x];
+                        }
+                    }
+                }
+                for (int x = 0; x < width; ++x) {
+                    float opp_y = buffer[x] / buffer[width + x];
+                    float opp_u = buffer[2 * width + x] / buffer[3 * width + x];
+                    float opp_v = buffer[4 * width + x] / buffer[5 * width + x];
+                    dstps[0][x] = opp_y + opp_u + opp_v * (2.f / 3.f);
+                    dstps[1][x] = opp_y - opp_v * (4.f / 3.f);
+                    dstps[2][x] = opp_y - opp_u + opp_v * (2.f / 3.f);
+                }
+                for (auto & dstp : dstps) {
+                    dstp += stride;
+                }
+            }
+        }
+
         for (int plane = 0; plane < d->src_vi->format.numPlanes; ++plane) {
-            if (d->process[plane]) {
+            if (d->process[plane] && !opp) {
                 int plane_width = vsapi->getFrameWidth(src_frame, plane);
                 int plane_height = vsapi->getFrameHeight(src_frame, plane);
                 int plane_stride = vsapi->getStride(src_frame, plane) / sizeof(float);
@@ -1497,7 +2788,8 @@ static const VSFrame *VS_CC VAggregateGetFrame(
                 std::vector<const float *> srcps;
                 srcps.reserve(2 * d->radius + 1);
                 for (int i = 0; i < 2 * d->radius + 1; ++i) {
-                    srcps.emplace_back(reinterpret_cast<const float *>(vsapi->getReadPtr(vbm3d_frames[i], plane)));
+                    srcps.emplace_back(reinterpret_cast<const float *>(
+                        vsapi->getReadPtr(vbm3d_frames[i], d->clip_plane[plane])));
                 }
 
                 auto dstp = reinterpret_cast<float *>(vsapi->getWritePtr(dst_frame, plane));
@@ -1532,7 +2824,240 @@ static const VSFrame *VS_CC VAggregateGetFrame(
         }
         vsapi->freeFrame(src_frame);
 
+        d->perf.add_frame(PerfSummary::elapsed_ns(frame_start));
+
+        return dst_frame;
+    }
+
+    return nullptr;
+}
+
+// VAggregate on intermediate frames that are managed by `d->spill`
+// instead of the frame cache of VapourSynth
+static const VSFrame *VS_CC VAggregateSpillGetFrame(
+    int n, int activationReason, void *instanceData, void **frameData,
+    VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi
+) {
+
+    auto * d = static_cast<VAggregateData *>(instanceData);
+
+    TraceScope trace_scope { d->trace.get(), d->trace_instance, n, activationReason };
+
+    const int start_frame = std::max(n - d->radius, 0);
+    const int end_frame = std::min(n + d->radius, d->src_vi->numFrames - 1);
+
+    if (activationReason == arInitial) {
+        // intermediate frames that are stored are pinned until aggregation
+        auto stored = new std::vector<bool>(end_frame - start_frame + 1);
+        *frameData = stored;
+
+        for (int i = start_frame; i <= end_frame; ++i) {
+            (*stored)[i - start_frame] = d->spill->pin(i);
+            d->perf.add_cache(vaggregate_cache_spill, (*stored)[i - start_frame]);
+            if (!(*stored)[i - start_frame]) {
+                vsapi->requestFrameFilter(i, d->node, frameCtx);
+            }
+        }
+        vsapi->requestFrameFilter(n, d->src_node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const auto frame_start = PerfSummary::clock::now();
+
+        const std::unique_ptr<std::vector<bool>> stored {
+            static_cast<std::vector<bool> *>(*frameData) };
+        *frameData = nullptr;
+
+        const VSFrame * src_frame = vsapi->getFrameFilter(n, d->src_node, frameCtx);
+
+        // nullptr for frames that have been spilled
+        std::vector<const VSFrame *> vbm3d_frames;
+        vbm3d_frames.reserve(end_frame - start_frame + 1);
+        for (int i = start_frame; i <= end_frame; ++i) {
+            if ((*stored)[i - start_frame]) {
+                vbm3d_frames.emplace_back(d->spill->get_frame(i));
+            } else {
+                auto frame = vsapi->getFrameFilter(i, d->node, frameCtx);
+
+                // frame properties are not kept by spilling
+                int error;
+                const VSMap * props = vsapi->getFramePropertiesRO(frame);
+                bool opp = !!vsapi->mapGetInt(props, "BM3D_V_opp", 0, &error) && !error;
+                d->opp.store(opp, std::memory_order_relaxed);
+
+                vbm3d_frames.emplace_back(frame);
+            }
+        }
+
+        const bool opp = d->opp.load(std::memory_order_relaxed);
+
+        auto release = [&]() {
+            for (int i = start_frame; i <= end_frame; ++i) {
+                if ((*stored)[i - start_frame]) {
+                    vsapi->freeFrame(vbm3d_frames[i - start_frame]);
+                    d->spill->unpin(i);
+                } else {
+                    d->spill->insert(i, vbm3d_frames[i - start_frame]);
+                }
+            }
+            vsapi->freeFrame(src_frame);
+        };
+
+        if (opp && d->src_vi->format.colorFamily != cfRGB) {
+            release();
+            vsapi->setFilterError("VAggregate: \"src\" must be of RGB format", frameCtx);
+            return nullptr;
+        }
+
+        constexpr int band_height = SpillStore::band_height;
+
+        float * buffer {};
+        {
+            const auto thread_id = std::this_thread::get_id();
+            bool init = true;
+
+            d->buffer_lock.lock_shared();
+
+            try {
+                const auto & const_buffer = d->buffer;
+                buffer = const_buffer.at(thread_id);
+            } catch (const std::out_of_range &) {
+                init = false;
+            }
+
+            d->buffer_lock.unlock_shared();
+
+            if (!init) {
+                // accumulation of all planes and decoding of one band,
+                // which is sufficient for every plane
+                buffer = reinterpret_cast<float *>(std::malloc(
+                    (2 * 3 + 4) * band_height * d->src_vi->width * sizeof(float)));
+                d->perf.add_memory((2 * 3 + 4) * band_height * d->src_vi->width * sizeof(float));
+
+                std::lock_guard _ { d->buffer_lock };
+                d->buffer.emplace(thread_id, buffer);
+            }
+        }
+
+        const VSFrame * fr[] {
+            d->process[0] || opp ? nullptr : src_frame,
+            d->process[1] || opp ? nullptr : src_frame,
+            d->process[2] || opp ? nullptr : src_frame
+        };
+        constexpr int pl[] { 0, 1, 2 };
+        auto dst_frame = vsapi->newVideoFrame2(
+            &d->src_vi->format,
+            d->src_vi->width, d->src_vi->height,
+            fr, pl, src_frame, core);
+
+        // accumulates the wdst and weight rows of a band over the temporal window
+        auto accumulate = [&](int plane, int band, float * accumulation) {
+            const int width = vsapi->getFrameWidth(src_frame, plane);
+            const int height = vsapi->getFrameHeight(src_frame, plane);
+            const int rows = std::min(band_height, height - band * band_height);
+            float * decoded = &buffer[2 * 3 * band_height * d->src_vi->width];
+            auto temp = reinterpret_cast<uint8_t *>(&decoded[2 * band_height * d->src_vi->width]);
+
+            memset(accumulation, 0, 2 * rows * width * sizeof(float));
+            for (int i = 0; i < 2 * d->radius + 1; ++i) {
+                const int frame_id = std::clamp(n - d->radius + i, 0, d->src_vi->numFrames - 1);
+                const int z = std::clamp(2 * d->radius - i, n - d->src_vi->numFrames + 1 + d->radius, n + d->radius);
+
+                const float * wdstp;
+                const float * weightp;
+                int stride;
+                const int clip_plane = d->clip_plane[plane];
+                if (const auto frame = vbm3d_frames[frame_id - start_frame]; frame) {
+                    stride = vsapi->getStride(frame, clip_plane) / sizeof(float);
+                    wdstp = &reinterpret_cast<const float *>(vsapi->getReadPtr(frame, clip_plane))[
+                        (2 * z * height + band * band_height) * stride];
+                    weightp = &wdstp[height * stride];
+                } else {
+                    d->spill->read(frame_id, clip_plane, z, band, decoded, temp);
+                    stride = width;
+                    wdstp = decoded;
+                    weightp = &decoded[rows * width];
+                }
+
+                for (int y = 0; y < rows; ++y) {
+                    for (int x = 0; x < width; ++x) {
+                        accumulation[y * width + x] += wdstp[y * stride + x];
+                    }
+                    for (int x = 0; x < width; ++x) {
+                        accumulation[(rows + y) * width + x] += weightp[y * stride + x];
+                    }
+                }
+            }
+        };
+
+        if (opp) {
+            const int width = vsapi->getFrameWidth(src_frame, 0);
+            const int height = vsapi->getFrameHeight(src_frame, 0);
+            const int stride = vsapi->getStride(src_frame, 0) / sizeof(float);
+
+            std::array<float *, 3> dstps;
+            for (int plane = 0; plane < 3; ++plane) {
+                dstps[plane] = reinterpret_cast<float *>(vsapi->getWritePtr(dst_frame, plane));
+            }
+
+            for (int band = 0; band * band_height < height; ++band) {
+                const int rows = std::min(band_height, height - band * band_height);
+                for (int plane = 0; plane < 3; ++plane) {
+                    accumulate(plane, band, &buffer[2 * plane * band_height * width]);
+                }
+                const float * accumulation_y = buffer;
+                const float * accumulation_u = &buffer[2 * band_height * width];
+                const float * accumulation_v = &buffer[4 * band_height * width];
+                for (int y = 0; y < rows; ++y) {
+                    for (int x = 0; x < width; ++x) {
+                        float opp_y = accumulation_y[y * width + x] / accumulation_y[(rows + y) * width + x];
+                        float opp_u = accumulation_u[y * width + x] / accumulation_u[(rows + y) * width + x];
+                        float opp_v = accumulation_v[y * width + x] / accumulation_v[(rows + y) * width + x];
+                        dstps[0][x] = opp_y + opp_u + opp_v * (2.f / 3.f);
+                        dstps[1][x] = opp_y - opp_v * (4.f / 3.f);
+                        dstps[2][x] = opp_y - opp_u + opp_v * (2.f / 3.f);
+                    }
+                    for (auto & dstp : dstps) {
+                        dstp += stride;
+                    }
+                }
+            }
+        }
+
+        for (int plane = 0; plane < d->src_vi->format.numPlanes; ++plane) {
+            if (d->process[plane] && !opp) {
+                int plane_width = vsapi->getFrameWidth(src_frame, plane);
+                int plane_height = vsapi->getFrameHeight(src_frame, plane);
+                int plane_stride = vsapi->getStride(src_frame, plane) / sizeof(float);
+
+                auto dstp = reinterpret_cast<float *>(vsapi->getWritePtr(dst_frame, plane));
+
+                for (int band = 0; band * band_height < plane_height; ++band) {
+                    const int rows = std::min(band_height, plane_height - band * band_height);
+                    accumulate(plane, band, buffer);
+                    for (int y = 0; y < rows; ++y) {
+                        for (int x = 0; x < plane_width; ++x) {
+                            dstp[x] = buffer[y * plane_width + x] / buffer[(rows + y) * plane_width + x];
+                        }
+                        dstp += plane_stride;
+                    }
+                }
+            }
+        }
+
+        release();
+
+        d->perf.add_frame(PerfSummary::elapsed_ns(frame_start));
+
         return dst_frame;
+    } else if (activationReason == arError) {
+        if (*frameData) {
+            const std::unique_ptr<std::vector<bool>> stored {
+                static_cast<std::vector<bool> *>(*frameData) };
+            for (int i = start_frame; i <= end_frame; ++i) {
+                if ((*stored)[i - start_frame]) {
+                    d->spill->unpin(i);
+                }
+            }
+        }
     }
 
     return nullptr;
@@ -1548,6 +3073,8 @@ static void VS_CC VAggregateFree(
         std::free(ptr);
     }
 
+    d->perf.report("VAggregate", {}, { "spill" }, d->perf_path, core, vsapi);
+
     vsapi->freeNode(d->src_node);
     vsapi->freeNode(d->node);
 
@@ -1566,8 +3093,6 @@ static void VS_CC VAggregateCreate(
     d->src_node = vsapi->mapGetNode(in, "src", 0, nullptr);
     d->src_vi = vsapi->getVideoInfo(d->src_node);
 
-    d->radius = (vi->height / d->src_vi->height - 2) / 4;
-
     d->process.fill(false);
     int num_planes_args = vsapi->mapNumElements(in, "planes");
     for (int i = 0; i < num_planes_args; ++i) {
@@ -1575,17 +3100,107 @@ static void VS_CC VAggregateCreate(
         d->process[plane] = true;
     }
 
+    auto set_error = [&](const std::string & error_message) {
+        vsapi->mapSetError(out, ("VAggregate: " + error_message).c_str());
+        vsapi->freeNode(d->node);
+        vsapi->freeNode(d->src_node);
+    };
+
+    // intermediate frames of `BM3D(prune_planes=True)` only carry the processed plane
+    const bool pruned = vi->format.numPlanes < d->src_vi->format.numPlanes;
+    int clip_height = d->src_vi->height;
+    for (int plane = 0; plane < 3; ++plane) {
+        d->clip_plane[plane] = pruned ? 0 : plane;
+    }
+    if (pruned) {
+        if (num_planes_args != 1) {
+            return set_error("\"planes\" must have exactly one element for pruned \"clip\"");
+        }
+        const int plane = vsapi->mapGetInt(in, "planes", 0, nullptr);
+        if (vi->width != d->src_vi->width >> (plane ? d->src_vi->format.subSamplingW : 0)) {
+            return set_error("\"clip\" does not match plane " + std::to_string(plane) + " of \"src\"");
+        }
+        clip_height = d->src_vi->height >> (plane ? d->src_vi->format.subSamplingH : 0);
+    }
+
+    d->radius = (vi->height / clip_height - 2) / 4;
+
+    int error;
+    const char * spill = vsapi->mapGetData(in, "spill", 0, &error);
+    if (!error) {
+        int64_t spill_budget = vsapi->mapGetInt(in, "spill_budget", 0, &error);
+        if (error) {
+            spill_budget = 1024;
+        } else if (spill_budget < 0) {
+            return set_error("\"spill_budget\" must be non-negative");
+        }
+
+        int64_t spill_size = vsapi->mapGetInt(in, "spill_size", 0, &error);
+        if (error) {
+            spill_size = 16384;
+        } else if (spill_size <= 0) {
+            return set_error("\"spill_size\" must be positive");
+        }
+
+        // in planes of "clip"
+        SpillStore::Layout layout;
+        layout.num_planes = vi->format.numPlanes;
+        if (pruned) {
+            layout.width[0] = vi->width;
+            layout.height[0] = clip_height;
+            layout.process[0] = true;
+        } else {
+            for (int plane = 0; plane < layout.num_planes; ++plane) {
+                layout.width[plane] = d->src_vi->width >> (plane ? d->src_vi->format.subSamplingW : 0);
+                layout.height[plane] = d->src_vi->height >> (plane ? d->src_vi->format.subSamplingH : 0);
+                // RGB input of CBM3D requires all planes
+                layout.process[plane] = d->process[plane] || d->src_vi->format.colorFamily == cfRGB;
+            }
+        }
+        layout.temporal_width = 2 * d->radius + 1;
+
+        d->spill = std::make_unique<SpillStore>(layout, static_cast<size_t>(spill_budget) << 20, vsapi);
+        if (auto error_message = d->spill->open(spill, static_cast<size_t>(spill_size) << 20);
+            !error_message.empty()
+        ) {
+            return set_error(error_message);
+        }
+
+        // intermediate frames are stored by `d->spill`
+        vsapi->setCacheMode(d->node, cmForceDisable);
+    }
+
     VSCoreInfo core_info;
     vsapi->getCoreInfo(core, &core_info);
     d->buffer.reserve(core_info.numThreads);
 
+    if (auto trace = vsapi->mapGetData(in, "trace", 0, &error); !error) {
+        std::string error_message;
+        d->trace = TraceFile::open(trace, error_message);
+        if (!d->trace) {
+            return set_error(error_message);
+        }
+
+        d->trace_instance = d->trace->add_instance(
+            TraceFilter::vaggregate, d->src_vi->numFrames, d->radius,
+            d->src_vi->width, d->src_vi->height, core_info.numThreads, 0);
+    }
+
+    if (auto perf = vsapi->mapGetData(in, "perf", 0, &error); !error) {
+        d->perf_path = perf;
+    }
+
     VSFilterDependency deps[] = {
         {d->node, rpGeneral},
         {d->src_node, rpGeneral},
     };
 
+    // `d` is released in the same call
+    const VSVideoInfo * src_vi = d->src_vi;
+    auto get_frame = d->spill ? VAggregateSpillGetFrame : VAggregateGetFrame;
+
     vsapi->createVideoFilter(
-        out, "VAggregate", d->src_vi, VAggregateGetFrame, VAggregateFree,
+        out, "VAggregate", src_vi, get_frame, VAggregateFree,
         fmParallel, deps, 2, d.release(), core);
 }
 
@@ -1613,6 +3228,18 @@ static void VS_CC BM3Dv2Create(
     bool skip = true;
     auto src = vsapi->mapGetNode(in, "clip", 0, nullptr);
     auto src_vi = vsapi->getVideoInfo(src);
+
+    int error;
+    bool chroma = !!vsapi->mapGetInt(in, "chroma", 0, &error);
+    if (!error && chroma && src_vi->format.colorFamily == cfRGB) {
+        // RGB input is processed in the opponent color space
+        bool skip_opp = true;
+        for (int i = 0; i < 3; ++i) {
+            skip_opp &= !process[i];
+        }
+        process.fill(!skip_opp);
+    }
+
     for (int i = 0; i < src_vi->format.numPlanes; ++i) {
         skip &= !process[i];
     }
@@ -1622,7 +3249,20 @@ static void VS_CC BM3Dv2Create(
         return ;
     }
 
-    auto map = vsapi->invoke(myself, "BM3D", in);
+    // spilling is handled by VAggregate
+    constexpr const char * spill_keys[] { "spill", "spill_budget", "spill_size" };
+    auto bm3d_in = vsapi->createMap();
+    vsapi->copyMap(in, bm3d_in);
+    for (const auto & key : spill_keys) {
+        vsapi->mapDeleteKey(bm3d_in, key);
+    }
+    // intermediate frames are only read by VAggregate of this plugin
+    if (vsapi->mapNumElements(bm3d_in, "prune_planes") < 0) {
+        vsapi->mapSetInt(bm3d_in, "prune_planes", 1, maReplace);
+    }
+
+    auto map = vsapi->invoke(myself, "BM3D", bm3d_in);
+    vsapi->freeMap(bm3d_in);
     if (auto error = vsapi->mapGetError(map); error) {
         vsapi->mapSetError(out, error);
         vsapi->freeMap(map);
@@ -1630,7 +3270,6 @@ static void VS_CC BM3Dv2Create(
         return ;
     }
 
-    int error;
     int radius = vsapi->mapGetInt(in, "radius", 0, &error);
     if (error) {
         radius = 0;
@@ -1654,6 +3293,23 @@ static void VS_CC BM3Dv2Create(
         }
     }
 
+    if (auto trace = vsapi->mapGetData(in, "trace", 0, &error); !error) {
+        vsapi->mapSetData(map, "trace", trace, -1, dtUtf8, maReplace);
+    }
+
+    if (auto perf = vsapi->mapGetData(in, "perf", 0, &error); !error) {
+        vsapi->mapSetData(map, "perf", perf, -1, dtUtf8, maReplace);
+    }
+
+    if (auto spill = vsapi->mapGetData(in, "spill", 0, &error); !error) {
+        vsapi->mapSetData(map, "spill", spill, -1, dtUtf8, maReplace);
+        for (const auto & key : { "spill_budget", "spill_size" }) {
+            if (auto value = vsapi->mapGetInt(in, key, 0, &error); !error) {
+                vsapi->mapSetInt(map, key, value, maReplace);
+            }
+        }
+    }
+
     auto map2 = vsapi->invoke(myself, "VAggregate", map);
     vsapi->freeMap(map);
     if (auto error = vsapi->mapGetError(map2); error) {
@@ -1674,7 +3330,7 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
 
     vspapi->configPlugin(
         "com.wolframrhodium.bm3dcpu", "bm3dcpu",
-        "BM3D algorithm implemented in AVX and AVX2 intrinsics",
+        "BM3D algorithm implemented in SIMD (AVX2, AVX-512, NEON)",
         VS_MAKE_VERSION(1, 0), VAPOURSYNTH_API_VERSION, 0, plugin);
 
     constexpr auto bm3d_args {
@@ -1686,19 +3342,40 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
         "radius:int:opt;"
         "ps_num:int:opt;"
         "ps_range:int:opt;"
+        "ps_gate:float:opt;"
+        "coverage:int:opt;"
+        "tile:int:opt;"
+        "nlm:int:opt;"
+        "trace:data:opt;"
+        "perf:data:opt;"
+        "artifact_budget:int:opt;"
         "chroma:int:opt;"
         "zero_init:int:opt;"
+        "prune_planes:int:opt;"
+        "fields:int:opt;"
+        "batch:int:opt;"
+        "server:data:opt;"
     };
 
     vspapi->registerFunction("BM3D", bm3d_args, "clip:vnode;", BM3DCreate, nullptr, plugin);
 
+    constexpr auto spill_args {
+        "spill:data:opt;"
+        "spill_budget:int:opt;"
+        "spill_size:int:opt;"
+    };
+
     vspapi->registerFunction(
         "VAggregate",
-        "clip:vnode;"
+        ("clip:vnode;"
         "src:vnode;"
-        "planes:int[];",
+        "planes:int[];"
+        "trace:data:opt;"
+        "perf:data:opt;" + std::string{spill_args}).c_str(),
         "clip:vnode;",
         VAggregateCreate, nullptr, plugin);
 
-    vspapi->registerFunction("BM3Dv2", bm3d_args, "clip:vnode;", BM3Dv2Create, nullptr, plugin);
+    vspapi->registerFunction(
+        "BM3Dv2", (std::string{bm3d_args} + spill_args).c_str(), "clip:vnode;",
+        BM3Dv2Create, nullptr, plugin);
 }
@@ -0,0 +1,509 @@
+// Out-of-core storage of V-BM3D intermediate frames
+//
+// Intermediate frames are kept in memory up to a budget. Frames evicted from
+// memory are compressed losslessly and appended to a memory-mapped scratch file
+// that is used as a ring buffer. Frames overwritten in the scratch file are
+// dropped and have to be recomputed by the caller.
+//
+// Each (plane, slab, band of rows) is compressed independently so that it can
+// be streamed back without decompressing the whole frame.
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <VapourSynth4.h>
+
+// xor with the previous sample, byte-shuffle and run-length encoding
+//
+// The exponent and the leading mantissa bits of neighboring samples
+// are mostly identical, which results in long runs of zeros
+// in the leading byte planes after xor and byte-shuffle.
+static inline void spill_encode(
+    std::vector<uint8_t> & dst, std::vector<uint8_t> & temp,
+    const float * src, int width, int height, ptrdiff_t stride
+) noexcept {
+
+    const size_t count = static_cast<size_t>(width) * height;
+    temp.resize(4 * count);
+
+    uint32_t prev = 0;
+    size_t index = 0;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint32_t bits;
+            std::memcpy(&bits, &src[x], sizeof(float));
+            uint32_t delta = bits ^ prev;
+            prev = bits;
+            for (int i = 0; i < 4; ++i) {
+                temp[i * count + index] = static_cast<uint8_t>(delta >> (8 * (3 - i)));
+            }
+            ++index;
+        }
+        src += stride;
+    }
+
+    // control byte c < 128: c + 1 literal bytes follow
+    // control byte c >= 128: the next byte is repeated (c - 128) + 3 times
+    const size_t size = temp.size();
+    size_t i = 0;
+    while (i < size) {
+        size_t run = 1;
+        while (i + run < size && run < 130 && temp[i + run] == temp[i]) {
+            ++run;
+        }
+
+        if (run >= 3) {
+            dst.push_back(static_cast<uint8_t>(128 + (run - 3)));
+            dst.push_back(temp[i]);
+            i += run;
+        } else {
+            size_t literal = 0;
+            while (i + literal < size && literal < 128) {
+                if (i + literal + 2 < size &&
+                    temp[i + literal] == temp[i + literal + 1] &&
+                    temp[i + literal] == temp[i + literal + 2]
+                ) {
+                    break;
+                }
+                ++literal;
+            }
+            dst.push_back(static_cast<uint8_t>(literal - 1));
+            dst.insert(std::end(dst), &temp[i], &temp[i + literal]);
+            i += literal;
+        }
+    }
+}
+
+// decodes `count` samples, returns the position after the consumed input
+static inline const uint8_t * spill_decode(
+    float * dst, uint8_t * temp, const uint8_t * src, size_t count
+) noexcept {
+
+    const size_t size = 4 * count;
+    size_t i = 0;
+    while (i < size) {
+        unsigned control = *src++;
+        if (control < 128) {
+            std::memcpy(&temp[i], src, control + 1);
+            src += control + 1;
+            i += control + 1;
+        } else {
+            std::memset(&temp[i], *src++, control - 128 + 3);
+            i += control - 128 + 3;
+        }
+    }
+
+    uint32_t prev = 0;
+    for (size_t index = 0; index < count; ++index) {
+        uint32_t delta = 0;
+        for (int j = 0; j < 4; ++j) {
+            delta |= static_cast<uint32_t>(temp[j * count + index]) << (8 * (3 - j));
+        }
+        prev ^= delta;
+        std::memcpy(&dst[index], &prev, sizeof(float));
+    }
+
+    return src;
+}
+
+// file-backed shared mapping, the file is removed on close
+class ScratchFile {
+public:
+    ScratchFile() = default;
+    ScratchFile(const ScratchFile &) = delete;
+    ScratchFile & operator=(const ScratchFile &) = delete;
+
+    ~ScratchFile() {
+#ifdef _WIN32
+        if (data) {
+            UnmapViewOfFile(data);
+        }
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+#else
+        if (data) {
+            munmap(data, size);
+        }
+#endif
+    }
+
+    // returns an error message on failure
+    std::string open(const std::string & directory, size_t size) {
+        this->size = size;
+
+#ifdef _WIN32
+        std::wstring wdirectory(MultiByteToWideChar(
+            CP_UTF8, 0, directory.c_str(), -1, nullptr, 0), L'\0');
+        MultiByteToWideChar(
+            CP_UTF8, 0, directory.c_str(), -1, wdirectory.data(), static_cast<int>(wdirectory.size()));
+
+        wchar_t path[MAX_PATH];
+        if (GetTempFileNameW(wdirectory.c_str(), L"bm3d", 0, path) == 0) {
+            return "failed to create scratch file in \"" + directory + "\"";
+        }
+
+        file = CreateFileW(
+            path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            DeleteFileW(path);
+            return "failed to open scratch file in \"" + directory + "\"";
+        }
+
+        mapping = CreateFileMappingW(
+            file, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+            static_cast<DWORD>(size & 0xFFFFFFFF), nullptr);
+        if (!mapping) {
+            return "failed to allocate scratch file of " + std::to_string(size >> 20) + " MiB";
+        }
+
+        data = static_cast<uint8_t *>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+        if (!data) {
+            return "failed to map scratch file";
+        }
+#else
+        std::string path = directory + "/bm3d_spill_XXXXXX";
+        int fd = mkstemp(path.data());
+        if (fd == -1) {
+            return "failed to create scratch file in \"" + directory + "\"";
+        }
+        unlink(path.c_str());
+
+        if (ftruncate(fd, static_cast<off_t>(size)) == -1) {
+            close(fd);
+            return "failed to allocate scratch file of " + std::to_string(size >> 20) + " MiB";
+        }
+
+        void * ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED) {
+            return "failed to map scratch file";
+        }
+        data = static_cast<uint8_t *>(ptr);
+
+        // written and read back in ring order
+        madvise(data, size, MADV_SEQUENTIAL);
+#endif
+
+        return {};
+    }
+
+    // hints the OS to read the range ahead of use
+    void prefetch(size_t offset, size_t length) noexcept {
+#ifndef _WIN32
+        static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t begin = offset / page_size * page_size;
+        madvise(data + begin, offset + length - begin, MADV_WILLNEED);
+#endif
+    }
+
+    uint8_t * data {};
+    size_t size {};
+
+private:
+#ifdef _WIN32
+    HANDLE file { INVALID_HANDLE_VALUE };
+    HANDLE mapping {};
+#endif
+};
+
+class SpillStore {
+public:
+    static constexpr int band_height = 32;
+
+    struct Layout {
+        int num_planes;
+        std::array<int, 3> width;
+        std::array<int, 3> height;
+        std::array<bool, 3> process; // planes that are stored
+        int temporal_width;
+    };
+
+    SpillStore(const Layout & layout, size_t ram_budget, const VSAPI * vsapi)
+        : layout(layout), ram_budget(ram_budget), vsapi(vsapi) {
+
+        int num_segments = 0;
+        for (int plane = 0; plane < layout.num_planes; ++plane) {
+            segment_base[plane] = num_segments;
+            if (layout.process[plane]) {
+                num_segments += layout.temporal_width * num_bands(plane);
+            }
+        }
+        this->num_segments = num_segments;
+    }
+
+    ~SpillStore() {
+        for (const auto & [_, entry] : entries) {
+            vsapi->freeFrame(entry.frame);
+        }
+    }
+
+    std::string open(const std::string & directory, size_t size) {
+        return file.open(directory, size);
+    }
+
+    int num_bands(int plane) const noexcept {
+        return (layout.height[plane] + band_height - 1) / band_height;
+    }
+
+    // keeps frame `n` available until unpin(), returns false if it is not stored
+    bool pin(int n) {
+        std::lock_guard _ { lock };
+
+        auto it = entries.find(n);
+        if (it == std::end(entries)) {
+            return false;
+        }
+
+        auto & entry = it->second;
+        ++entry.pins;
+        if (!entry.frame) {
+            file.prefetch(entry.offset, entry.segments.back());
+        }
+        return true;
+    }
+
+    void unpin(int n) {
+        std::lock_guard _ { lock };
+
+        auto & entry = entries.at(n);
+        if (--entry.pins == 0 && !entry.frame && !entry.on_disk) {
+            entries.erase(n);
+        }
+    }
+
+    // returns a new reference to the stored frame, or nullptr if it has been spilled
+    const VSFrame * get_frame(int n) {
+        std::lock_guard _ { lock };
+
+        auto & entry = entries.at(n);
+        if (entry.frame) {
+            if (!entry.spilling) {
+                lru.splice(std::begin(lru), lru, entry.lru);
+            }
+            return vsapi->addFrameRef(entry.frame);
+        }
+        return nullptr;
+    }
+
+    // decodes the wdst and weight rows of a band of a spilled frame to `dst`
+    void read(int n, int plane, int z, int band, float * dst, uint8_t * temp) {
+        const uint8_t * src;
+        {
+            std::lock_guard _ { lock };
+
+            const auto & entry = entries.at(n);
+            src = &file.data[entry.offset + entry.segments[segment(plane, z, band)]];
+        }
+
+        // the data of a pinned frame is never overwritten
+        const size_t count = static_cast<size_t>(layout.width[plane]) * rows(plane, band);
+        src = spill_decode(dst, temp, src, count);
+        spill_decode(&dst[count], temp, src, count);
+    }
+
+    // takes ownership of `frame`
+    void insert(int n, const VSFrame * frame) {
+        std::vector<std::pair<int, const VSFrame *>> victims;
+        {
+            std::lock_guard _ { lock };
+
+            auto & entry = entries[n];
+            if (entry.frame || entry.on_disk) {
+                // computed concurrently
+                vsapi->freeFrame(frame);
+                return;
+            }
+
+            entry.frame = frame;
+            entry.lru = lru.insert(std::begin(lru), n);
+            ram_usage += frame_size(frame);
+
+            while (ram_usage > ram_budget && !lru.empty()) {
+                int victim = lru.back();
+                lru.pop_back();
+                auto & victim_entry = entries.at(victim);
+                victim_entry.spilling = true;
+                ram_usage -= frame_size(victim_entry.frame);
+                victims.emplace_back(victim, victim_entry.frame);
+            }
+        }
+
+        for (const auto & [victim, victim_frame] : victims) {
+            spill(victim, victim_frame);
+        }
+    }
+
+private:
+    struct Entry {
+        const VSFrame * frame {}; // in memory
+        std::list<int>::iterator lru;
+        bool spilling {};
+
+        bool on_disk {};
+        size_t offset {};
+        std::vector<size_t> segments; // offsets relative to `offset`
+
+        int pins {};
+    };
+
+    int segment(int plane, int z, int band) const noexcept {
+        return segment_base[plane] + z * num_bands(plane) + band;
+    }
+
+    int rows(int plane, int band) const noexcept {
+        return std::min(band_height, layout.height[plane] - band * band_height);
+    }
+
+    size_t frame_size(const VSFrame * frame) const noexcept {
+        size_t size = 0;
+        for (int plane = 0; plane < layout.num_planes; ++plane) {
+            size += vsapi->getStride(frame, plane) * vsapi->getFrameHeight(frame, plane);
+        }
+        return size;
+    }
+
+    void spill(int n, const VSFrame * frame) {
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> temp;
+        std::vector<size_t> segments;
+        segments.reserve(num_segments + 1);
+
+        for (int plane = 0; plane < layout.num_planes; ++plane) {
+            if (!layout.process[plane]) {
+                continue;
+            }
+
+            const int width = layout.width[plane];
+            const int height = layout.height[plane];
+            const ptrdiff_t stride = vsapi->getStride(frame, plane) / sizeof(float);
+            const auto srcp = reinterpret_cast<const float *>(vsapi->getReadPtr(frame, plane));
+
+            for (int z = 0; z < layout.temporal_width; ++z) {
+                for (int band = 0; band < num_bands(plane); ++band) {
+                    segments.push_back(data.size());
+                    const float * wdstp = &srcp[(2 * z * height + band * band_height) * stride];
+                    spill_encode(data, temp, wdstp, width, rows(plane, band), stride);
+                    spill_encode(data, temp, &wdstp[height * stride], width, rows(plane, band), stride);
+                }
+            }
+        }
+        segments.push_back(data.size());
+
+        bool keep = false;
+        {
+            std::lock_guard _ { lock };
+
+            auto & entry = entries.at(n);
+            entry.spilling = false;
+
+            size_t offset;
+            if (reserve(data.size(), offset)) {
+                std::memcpy(&file.data[offset], data.data(), data.size());
+                entry.frame = nullptr;
+                entry.on_disk = true;
+                entry.offset = offset;
+                entry.segments = std::move(segments);
+                disk_index.emplace(offset, n);
+            } else if (entry.pins > 0) {
+                // frames in use are kept in memory beyond the budget
+                entry.lru = lru.insert(std::begin(lru), n);
+                ram_usage += frame_size(frame);
+                keep = true;
+            } else {
+                entries.erase(n);
+            }
+        }
+
+        if (!keep) {
+            vsapi->freeFrame(frame);
+        }
+    }
+
+    // allocates a range of the scratch file, the lock must be held
+    bool reserve(size_t size, size_t & offset) {
+        if (size > file.size) {
+            return false;
+        }
+
+        size_t begin = (head + size > file.size) ? 0 : head;
+        size_t end = begin + size;
+
+        // spilled frames that overlap with [begin, end)
+        auto first = disk_index.lower_bound(begin);
+        if (first != std::begin(disk_index)) {
+            auto prev = std::prev(first);
+            const auto & entry = entries.at(prev->second);
+            if (prev->first + entry.segments.back() > begin) {
+                first = prev;
+            }
+        }
+        auto last = disk_index.lower_bound(end);
+
+        for (auto it = first; it != last; ++it) {
+            if (entries.at(it->second).pins > 0) {
+                return false;
+            }
+        }
+
+        for (auto it = first; it != last; ++it) {
+            auto & entry = entries.at(it->second);
+            entry.on_disk = false;
+            entry.segments.clear();
+            if (!entry.frame) {
+                entries.erase(it->second);
+            }
+        }
+        disk_index.erase(first, last);
+
+        head = end;
+        offset = begin;
+        return true;
+    }
+
+    const Layout layout;
+    const size_t ram_budget;
+    const VSAPI * const vsapi;
+
+    std::array<int, 3> segment_base {};
+    int num_segments;
+
+    ScratchFile file;
+    size_t head {};
+
+    std::unordered_map<int, Entry> entries;
+    std::list<int> lru; // in-memory frames that are not pinned by spilling, most recent first
+    std::map<size_t, int> disk_index; // offset => frame number
+    size_t ram_usage {};
+
+    std::mutex lock;
+};
@@ -22,13 +22,16 @@
 #include <atomic>
 #include <array>
 #include <cctype>
+#include <chrono>
 #include <cmath>
 #include <concepts>
 #include <cstdint>
 #include <ios>
 #include <limits>
+#include <list>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <shared_mutex>
 #include <sstream>
 #include <string>
@@ -46,6 +49,8 @@
 #include <VSHelper4.h>
 
 #include "kernel.hpp"
+#include "perf.h"
+#include "trace.h"
 
 #ifdef _MSC_VER
 #   if defined (_WINDEF_) && defined(min) && defined(max)
@@ -75,6 +80,9 @@ using namespace std::string_literals;
 
 constexpr int kFast = 4;
 
+// maximum number of kernels compiled for per-frame overrides of parameters
+constexpr int kMaxSpecializations = 16;
+
 static VSPlugin * myself = nullptr;
 
 struct ticket_semaphore {
@@ -156,18 +164,28 @@ struct CUDA_Resource {
     std::array<Resource<CUgraphExec, cuGraphExecDestroy>, 3> graphexecs;
 };
 
+// kernel compiled for per-frame overrides of "sigma" and "bm_range"
+struct Specialization {
+    int plane;
+    std::array<float, 3> sigma;
+    int bm_range;
+
+    Resource<CUmodule, cuModuleUnload> module_;
+    CUfunction function;
+};
+
 struct BM3DData {
     VSNode * node;
     VSNode * ref_node;
     const VSVideoInfo * vi;
 
-    // stored in graphexec:
-    // float sigma[3];
-    // int block_step[3];
-    // int bm_range[3];
-    // int ps_num[3];
-    // int ps_range[3];
-    // float extractor
+    // stored in graphexec, and used in compilation of specializations
+    float sigma[3];
+    int block_step[3];
+    int bm_range[3];
+    int ps_num[3];
+    int ps_range[3];
+    float extractor;
 
     int radius;
     int num_copy_engines; // fast
@@ -187,8 +205,22 @@ struct BM3DData {
     Resource<CUmodule, cuModuleUnload> modules[3];
     std::vector<CUDA_Resource> resources;
     std::mutex resources_lock;
+
+    std::list<std::shared_ptr<Specialization>> specializations; // most recently used first
+    std::mutex specializations_lock;
+    std::mutex compile_lock;
+
+    std::shared_ptr<TraceFile> trace; // null if disabled
+    uint32_t trace_instance;
+
+    PerfSummary perf; // reported when the filter is freed
+    std::string perf_path; // JSON output of `perf`, empty if disabled
 };
 
+// indices of stages and caches of `BM3DData::perf`
+enum BM3DPerfStage { bm3d_stage_upload, bm3d_stage_kernel, bm3d_stage_download };
+enum BM3DPerfCache { bm3d_cache_kernel };
+
 static std::variant<CUmodule, std::string> compile(
     int width, int height, int stride,
     float sigma, int block_step, int bm_range,
@@ -413,6 +445,73 @@ static std::variant<CUgraphExec, std::string> get_graphexec(
     return graphexec;
 }
 
+// same as the graph built by get_graphexec(), used by specializations
+static std::optional<std::string> launch(
+    CUdeviceptr d_res, CUdeviceptr d_src, float * h_res,
+    int width, int height, int stride,
+    int block_step, int radius, bool chroma,
+    bool final_, CUstream stream, CUfunction function
+) noexcept {
+
+    const auto set_error = [](const std::string & error_message) {
+        return error_message;
+    };
+
+    size_t pitch { stride * sizeof(float) };
+    int temporal_width { 2 * radius + 1 };
+    int num_planes { chroma ? 3 : 1 };
+
+    {
+        CUDA_MEMCPY2D copy_params {
+            .srcMemoryType = CU_MEMORYTYPE_HOST,
+            .srcHost = h_res,
+            .srcPitch = pitch,
+            .dstMemoryType = CU_MEMORYTYPE_DEVICE,
+            .dstDevice = d_src,
+            .dstPitch = pitch,
+            .WidthInBytes = width * sizeof(float),
+            .Height = static_cast<size_t>((final_ ? 2 : 1) * num_planes * temporal_width * height),
+        };
+
+        checkError(cuMemcpy2DAsync(&copy_params, stream));
+    }
+
+    checkError(cuMemsetD2D32Async(
+        d_res, pitch, 0, static_cast<size_t>(width),
+        static_cast<size_t>(num_planes * temporal_width * 2 * height), stream));
+
+    {
+        void * kernel_args[] {
+            &d_res, &d_src
+        };
+
+        checkError(cuLaunchKernel(
+            function,
+            static_cast<unsigned int>((width + (4 * block_step - 1)) / (4 * block_step)),
+            static_cast<unsigned int>((height + (block_step - 1)) / block_step),
+            1,
+            32, 1, 1,
+            0, stream, kernel_args, nullptr));
+    }
+
+    {
+        CUDA_MEMCPY2D copy_params {
+            .srcMemoryType = CU_MEMORYTYPE_DEVICE,
+            .srcDevice = d_res,
+            .srcPitch = pitch,
+            .dstMemoryType = CU_MEMORYTYPE_HOST,
+            .dstHost = h_res,
+            .dstPitch = pitch,
+            .WidthInBytes = width * sizeof(float),
+            .Height = static_cast<size_t>(num_planes * temporal_width * 2 * height),
+        };
+
+        checkError(cuMemcpy2DAsync(&copy_params, stream));
+    }
+
+    return {};
+}
+
 static inline void Aggregation(
     float * VS_RESTRICT dstp, int dst_stride,
     const float * VS_RESTRICT srcp, int src_stride,
@@ -433,6 +532,140 @@ static inline void Aggregation(
     }
 }
 
+// reads per-frame overrides of "sigma" and "bm_range" from frame properties
+// "_BM3D_sigma" and "_BM3D_bm_range", which follow the same rules as the arguments,
+// returns an error message on invalid values
+//
+// planes not processed by the filter are not affected
+static std::string get_overrides(
+    float sigma[3], int bm_range[3],
+    const VSMap * props, const bool process[3], bool final_,
+    const VSAPI * vsapi
+) noexcept {
+
+    int error;
+
+    int num_sigma = vsapi->mapNumElements(props, "_BM3D_sigma");
+    for (int i = 0; i < 3 && num_sigma > 0; ++i) {
+        float value = static_cast<float>(
+            vsapi->mapGetFloat(props, "_BM3D_sigma", std::min(i, num_sigma - 1), &error));
+
+        if (error) {
+            return "\"_BM3D_sigma\" must be of type float";
+        } else if (!process[i]) {
+            continue;
+        } else if (value < std::numeric_limits<float>::epsilon()) {
+            return "\"_BM3D_sigma\" must be positive on processed planes";
+        }
+
+        // assumes grayscale input, hard_thr = 2.7
+        sigma[i] = value * ((3.0f / 4.0f) / 255.0f * 64.0f * (final_ ? 1.0f : 2.7f));
+    }
+
+    int num_bm_range = vsapi->mapNumElements(props, "_BM3D_bm_range");
+    for (int i = 0; i < 3 && num_bm_range > 0; ++i) {
+        int64_t value = vsapi->mapGetInt(
+            props, "_BM3D_bm_range", std::min(i, num_bm_range - 1), &error);
+
+        if (error) {
+            return "\"_BM3D_bm_range\" must be of type int";
+        } else if (value <= 0 || value > std::numeric_limits<int>::max()) {
+            return "\"_BM3D_bm_range\" must be positive";
+        }
+
+        bm_range[i] = static_cast<int>(value);
+    }
+
+    return {};
+}
+
+// looks up or compiles the kernel of the given parameters,
+// the least recently used one is evicted when the cache is full
+//
+// the context must be current, and remain current until the kernel is released
+static std::variant<std::shared_ptr<Specialization>, std::string> get_specialization(
+    BM3DData * d, int plane, const std::array<float, 3> & sigma, int bm_range
+) noexcept {
+
+    const auto set_error = [](const std::string & error_message) {
+        return error_message;
+    };
+
+    const auto lookup = [&]() -> std::shared_ptr<Specialization> {
+        std::lock_guard _ { d->specializations_lock };
+
+        auto & cache = d->specializations;
+        for (auto it = cache.begin(); it != cache.end(); ++it) {
+            const auto & item = **it;
+            if (item.plane == plane && item.sigma == sigma && item.bm_range == bm_range) {
+                cache.splice(cache.begin(), cache, it);
+                return cache.front();
+            }
+        }
+
+        return nullptr;
+    };
+
+    if (auto specialization = lookup()) {
+        d->perf.add_cache(bm3d_cache_kernel, true);
+        return specialization;
+    }
+
+    // avoids duplicated compilation of the same kernel
+    std::lock_guard compile_guard { d->compile_lock };
+
+    if (auto specialization = lookup()) {
+        d->perf.add_cache(bm3d_cache_kernel, true);
+        return specialization;
+    }
+
+    d->perf.add_cache(bm3d_cache_kernel, false);
+
+    int width = d->vi->width;
+    int height = d->vi->height;
+    if (plane > 0) {
+        width >>= d->vi->format.subSamplingW;
+        height >>= d->vi->format.subSamplingH;
+    }
+
+    const auto result = compile(
+        width, height, d->d_pitch / static_cast<int>(sizeof(float)),
+        sigma[0], d->block_step[plane], bm_range,
+        d->radius, d->ps_num[plane], d->ps_range[plane],
+        d->chroma, sigma[1], sigma[2],
+        d->final_,
+        d->bm_error_s[plane],
+        d->transform_2d_s[plane], d->transform_1d_s[plane],
+        d->extractor,
+        d->device
+    );
+
+    if (!std::holds_alternative<CUmodule>(result)) {
+        return set_error(std::get<std::string>(result));
+    }
+
+    auto specialization = std::make_shared<Specialization>(Specialization{
+        .plane = plane,
+        .sigma = sigma,
+        .bm_range = bm_range,
+        .module_ = std::get<CUmodule>(result),
+        .function = {}
+    });
+
+    checkError(cuModuleGetFunction(&specialization->function, specialization->module_, "bm3d"));
+
+    {
+        std::lock_guard _ { d->specializations_lock };
+
+        d->specializations.push_front(specialization);
+        if (std::ssize(d->specializations) > kMaxSpecializations) {
+            d->specializations.pop_back();
+        }
+    }
+
+    return specialization;
+}
+
 static const VSFrame *VS_CC BM3DGetFrame(
     int n, int activationReason, void *instanceData, void **frameData,
     VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi
@@ -440,6 +673,8 @@ static const VSFrame *VS_CC BM3DGetFrame(
 
     auto d = static_cast<BM3DData *>(instanceData);
 
+    TraceScope trace_scope { d->trace.get(), d->trace_instance, n, activationReason };
+
     if (activationReason == arInitial) {
         int start_frame = std::max(n - d->radius, 0);
         int end_frame = std::min(n + d->radius, d->vi->numFrames - 1);
@@ -453,6 +688,8 @@ static const VSFrame *VS_CC BM3DGetFrame(
             }
         }
     } else if (activationReason == arAllFramesReady) {
+        const auto frame_start = PerfSummary::clock::now();
+
         int radius = d->radius;
         int temporal_width = 2 * radius + 1;
         bool final_ = d->final_;
@@ -487,6 +724,17 @@ static const VSFrame *VS_CC BM3DGetFrame(
 
         const VSFrame * src = srcs[radius + (final_ ? temporal_width : 0)].get();
 
+        float sigma[3] { d->sigma[0], d->sigma[1], d->sigma[2] };
+        int bm_range[3] { d->bm_range[0], d->bm_range[1], d->bm_range[2] };
+        if (auto error = get_overrides(
+                sigma, bm_range, vsapi->getFramePropertiesRO(src),
+                d->process, final_, vsapi);
+            !error.empty()
+        ) {
+            vsapi->setFilterError(("BM3D_RTC: " + error).c_str(), frameCtx);
+            return nullptr;
+        }
+
         std::unique_ptr<VSFrame, const freeFrame_t &> dst { nullptr, vsapi->freeFrame };
         if (radius) {
             dst.reset(
@@ -518,12 +766,22 @@ static const VSFrame *VS_CC BM3DGetFrame(
             );
         }
 
+        const auto wait_start = std::chrono::steady_clock::now();
         d->semaphore.acquire();
+        trace_scope.add_wait(wait_start);
+        d->perf.add_wait(PerfSummary::elapsed_ns(wait_start));
         d->resources_lock.lock();
         auto resource = std::move(d->resources.back());
         d->resources.pop_back();
         d->resources_lock.unlock();
 
+        // accumulates the time since the end of the previous stage
+        auto stage_start = PerfSummary::clock::now();
+        const auto end_stage = [&](BM3DPerfStage stage) {
+            d->perf.add_stage(stage, PerfSummary::elapsed_ns(stage_start));
+            stage_start = PerfSummary::clock::now();
+        };
+
         const auto set_error = [&](const std::string & error_message) {
             d->resources_lock.lock();
             d->resources.push_back(std::move(resource));
@@ -542,6 +800,31 @@ static const VSFrame *VS_CC BM3DGetFrame(
 
         checkError(cuCtxPushCurrent(d->context));
 
+        // kernels of overridden parameters, the default ones are launched as graphs
+        std::array<std::shared_ptr<Specialization>, 3> specializations {};
+        for (int plane = 0; plane < (d->chroma ? 1 : d->vi->format.numPlanes); ++plane) {
+            if (!d->process[plane]) {
+                continue;
+            }
+
+            std::array<float, 3> key_sigma { sigma[plane], 0.0f, 0.0f };
+            std::array<float, 3> default_sigma { d->sigma[plane], 0.0f, 0.0f };
+            if (d->chroma) {
+                key_sigma = { sigma[0], sigma[1], sigma[2] };
+                default_sigma = { d->sigma[0], d->sigma[1], d->sigma[2] };
+            }
+
+            if (key_sigma == default_sigma && bm_range[plane] == d->bm_range[plane]) {
+                continue;
+            }
+
+            auto result = get_specialization(d, plane, key_sigma, bm_range[plane]);
+            if (std::holds_alternative<std::string>(result)) {
+                return set_error(std::get<std::string>(result));
+            }
+            specializations[plane] = std::move(std::get<std::shared_ptr<Specialization>>(result));
+        }
+
         if (d->chroma) {
             int width = vsapi->getFrameWidth(src, 0);
             int height = vsapi->getFrameHeight(src, 0);
@@ -569,9 +852,23 @@ static const VSFrame *VS_CC BM3DGetFrame(
                 }
             }
 
-            checkError(cuGraphLaunch(graphexec, stream));
+            end_stage(bm3d_stage_upload);
+
+            if (specializations[0]) {
+                if (auto error = launch(
+                        resource.d_res, resource.d_src, h_res,
+                        width, height, d_stride,
+                        d->block_step[0], radius,
+                        true, final_, stream, specializations[0]->function)
+                ) {
+                    return set_error(*error);
+                }
+            } else {
+                checkError(cuGraphLaunch(graphexec, stream));
+            }
 
             checkError(cuStreamSynchronize(stream));
+            end_stage(bm3d_stage_kernel);
 
             float * h_dst = h_res;
             for (int plane = 0; plane < std::ssize(d->process); ++plane) {
@@ -598,6 +895,7 @@ static const VSFrame *VS_CC BM3DGetFrame(
 
                 h_dst += d_stride * height * 2 * temporal_width;
             }
+            end_stage(bm3d_stage_download);
         } else { // !d->chroma
             for (int plane = 0; plane < d->vi->format.numPlanes; plane++) {
                 if (!d->process[plane]) {
@@ -622,9 +920,23 @@ static const VSFrame *VS_CC BM3DGetFrame(
                     h_src += d_stride * height;
                 }
 
-                checkError(cuGraphLaunch(graphexec, stream));
+                end_stage(bm3d_stage_upload);
+
+                if (specializations[plane]) {
+                    if (auto error = launch(
+                            resource.d_res, resource.d_src, h_res,
+                            width, height, d_stride,
+                            d->block_step[plane], radius,
+                            false, final_, stream, specializations[plane]->function)
+                    ) {
+                        return set_error(*error);
+                    }
+                } else {
+                    checkError(cuGraphLaunch(graphexec, stream));
+                }
 
                 checkError(cuStreamSynchronize(stream));
+                end_stage(bm3d_stage_kernel);
 
                 float * dstp = reinterpret_cast<float *>(
                     vsapi->getWritePtr(dst.get(), plane));
@@ -641,9 +953,13 @@ static const VSFrame *VS_CC BM3DGetFrame(
                         width, height
                     );
                 }
+                end_stage(bm3d_stage_download);
             }
         }
 
+        // modules of evicted specializations are unloaded in the context
+        specializations = {};
+
         checkError(cuCtxPopCurrent(nullptr));
 
         d->resources_lock.lock();
@@ -660,6 +976,8 @@ static const VSFrame *VS_CC BM3DGetFrame(
             vsapi->mapSetIntArray(dst_prop, "BM3D_V_process", process, 3);
         }
 
+        d->perf.add_frame(PerfSummary::elapsed_ns(frame_start));
+
         return dst.release();
     }
 
@@ -672,6 +990,10 @@ static void VS_CC BM3DFree(
 
     auto d = static_cast<BM3DData *>(instanceData);
 
+    d->perf.report(
+        "BM3D_RTC", { "upload", "kernel", "download" }, { "kernel" },
+        d->perf_path, core, vsapi);
+
     vsapi->freeNode(d->node);
     vsapi->freeNode(d->ref_node);
 
@@ -909,6 +1231,13 @@ static void VS_CC BM3DCreate(
         return (temp ? std::ldexp(1.0f, temp) : 0.0f);
     }();
 
+    std::copy_n(sigma, 3, d->sigma);
+    std::copy_n(block_step, 3, d->block_step);
+    std::copy_n(bm_range, 3, d->bm_range);
+    std::copy_n(ps_num, 3, d->ps_num);
+    std::copy_n(ps_range, 3, d->ps_range);
+    d->extractor = extractor;
+
     d->semaphore.current.store(num_copy_engines - 1, std::memory_order::relaxed);
 
     // GPU related
@@ -966,6 +1295,11 @@ static void VS_CC BM3DCreate(
             checkError(cuMemAllocHost(reinterpret_cast<void **>(&h_res.data),
                 num_planes * temporal_width * 2 * max_height * d_pitch));
 
+            // device and pinned host memory
+            d->perf.add_memory(
+                ((final_ ? 2 : 1) * num_planes * temporal_width * max_height +
+                 2 * num_planes * temporal_width * 2 * max_height) * d_pitch);
+
             Resource<CUstream, cuStreamDestroy> stream {};
             checkError(cuStreamCreate(&stream.data, CU_STREAM_NON_BLOCKING));
 
@@ -1064,6 +1398,24 @@ static void VS_CC BM3DCreate(
         checkError(cuCtxPopCurrent(nullptr));
     }
 
+    if (auto trace = vsapi->mapGetData(in, "trace", 0, &error); !error) {
+        std::string error_message;
+        d->trace = TraceFile::open(trace, error_message);
+        if (!d->trace) {
+            return set_error(error_message);
+        }
+
+        VSCoreInfo core_info;
+        vsapi->getCoreInfo(core, &core_info);
+        d->trace_instance = d->trace->add_instance(
+            TraceFilter::bm3d, d->vi->numFrames, radius, width, height,
+            core_info.numThreads, num_copy_engines);
+    }
+
+    if (auto perf = vsapi->mapGetData(in, "perf", 0, &error); !error) {
+        d->perf_path = perf;
+    }
+
     VSVideoInfo vi = *d->vi;
     
     if (radius)
@@ -1093,6 +1445,12 @@ struct VAggregateData {
 
     std::unordered_map<std::thread::id, float *> buffer;
     std::shared_mutex buffer_lock;
+
+    std::shared_ptr<TraceFile> trace; // null if disabled
+    uint32_t trace_instance;
+
+    PerfSummary perf; // reported when the filter is freed
+    std::string perf_path; // JSON output of `perf`, empty if disabled
 };
 
 static const VSFrame *VS_CC VAggregateGetFrame(
@@ -1102,6 +1460,8 @@ static const VSFrame *VS_CC VAggregateGetFrame(
 
     auto * d = static_cast<VAggregateData *>(instanceData);
 
+    TraceScope trace_scope { d->trace.get(), d->trace_instance, n, activationReason };
+
     if (activationReason == arInitial) {
         int start_frame = std::max(n - d->radius, 0);
         int end_frame = std::min(n + d->radius, d->src_vi->numFrames - 1);
@@ -1111,6 +1471,8 @@ static const VSFrame *VS_CC VAggregateGetFrame(
         }
         vsapi->requestFrameFilter(n, d->src_node, frameCtx);
     } else if (activationReason == arAllFramesReady) {
+        const auto frame_start = PerfSummary::clock::now();
+
         const VSFrame * src_frame = vsapi->getFrameFilter(n, d->src_node, frameCtx);
 
         std::vector<const VSFrame *> vbm3d_frames;
@@ -1146,6 +1508,7 @@ static const VSFrame *VS_CC VAggregateGetFrame(
                 };
 
                 buffer = reinterpret_cast<float *>(std::malloc(2 * max_width * sizeof(float)));
+                d->perf.add_memory(2 * max_width * sizeof(float));
 
                 std::lock_guard _ { d->buffer_lock };
                 d->buffer.emplace(thread_id, buffer);
@@ -1207,6 +1570,8 @@ static const VSFrame *VS_CC VAggregateGetFrame(
         }
         vsapi->freeFrame(src_frame);
 
+        d->perf.add_frame(PerfSummary::elapsed_ns(frame_start));
+
         return dst_frame;
     }
 
@@ -1223,6 +1588,8 @@ static void VS_CC VAggregateFree(
         std::free(ptr);
     }
 
+    d->perf.report("VAggregate", {}, {}, d->perf_path, core, vsapi);
+
     vsapi->freeNode(d->src_node);
     vsapi->freeNode(d->node);
 
@@ -1254,6 +1621,26 @@ static void VS_CC VAggregateCreate(
     vsapi->getCoreInfo(core, &core_info);
     d->buffer.reserve(core_info.numThreads);
 
+    int error;
+    if (auto trace = vsapi->mapGetData(in, "trace", 0, &error); !error) {
+        std::string error_message;
+        d->trace = TraceFile::open(trace, error_message);
+        if (!d->trace) {
+            vsapi->mapSetError(out, ("VAggregate: " + error_message).c_str());
+            vsapi->freeNode(d->node);
+            vsapi->freeNode(d->src_node);
+            return ;
+        }
+
+        d->trace_instance = d->trace->add_instance(
+            TraceFilter::vaggregate, d->src_vi->numFrames, d->radius,
+            d->src_vi->width, d->src_vi->height, core_info.numThreads, 0);
+    }
+
+    if (auto perf = vsapi->mapGetData(in, "perf", 0, &error); !error) {
+        d->perf_path = perf;
+    }
+
     VSFilterDependency deps[] = {
         {d->node, rpGeneral},
         {d->src_node, rpGeneral},
@@ -1329,6 +1716,14 @@ static void VS_CC BM3Dv2Create(
         }
     }
 
+    if (auto trace = vsapi->mapGetData(in, "trace", 0, &error); !error) {
+        vsapi->mapSetData(map, "trace", trace, -1, dtUtf8, maReplace);
+    }
+
+    if (auto perf = vsapi->mapGetData(in, "perf", 0, &error); !error) {
+        vsapi->mapSetData(map, "perf", perf, -1, dtUtf8, maReplace);
+    }
+
     auto map2 = vsapi->invoke(myself, "VAggregate", map);
     vsapi->freeMap(map);
     if (auto error = vsapi->mapGetError(map2); error) {
@@ -1369,6 +1764,8 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
         "transform_2d_s:data[]:opt;"
         "transform_1d_s:data[]:opt;"
         "zero_init:int:opt;"
+        "trace:data:opt;"
+        "perf:data:opt;"
     };
 
     vspapi->registerFunction("BM3D", bm3d_args, "clip:vnode;", BM3DCreate, nullptr, plugin);
@@ -1377,7 +1774,9 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
         "VAggregate",
         "clip:vnode;"
         "src:vnode;"
-        "planes:int[];",
+        "planes:int[];"
+        "trace:data:opt;"
+        "perf:data:opt;",
         "clip:vnode;",
         VAggregateCreate, nullptr, plugin);
 
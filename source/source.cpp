@@ -21,6 +21,7 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
 #include <cmath>
 #include <concepts>
 #include <cstdint>
@@ -40,6 +41,9 @@
 #include <VapourSynth4.h>
 #include <VSHelper4.h>
 
+#include "perf.h"
+#include "trace.h"
+
 using namespace std::string_literals;
 
 extern cudaGraphExec_t get_graphexec(
@@ -166,8 +170,17 @@ struct BM3DData {
     ticket_semaphore semaphore;
     std::vector<CUDA_Resource> resources;
     std::mutex resources_lock;
+
+    std::shared_ptr<TraceFile> trace; // null if disabled
+    uint32_t trace_instance;
+
+    PerfSummary perf; // reported when the filter is freed
+    std::string perf_path; // JSON output of `perf`, empty if disabled
 };
 
+// indices of stages and caches of `BM3DData::perf`
+enum BM3DPerfStage { bm3d_stage_upload, bm3d_stage_kernel, bm3d_stage_download };
+
 static inline void Aggregation(
     float * VS_RESTRICT dstp, int dst_stride,
     const float * VS_RESTRICT srcp, int src_stride,
@@ -195,6 +208,8 @@ static const VSFrame *VS_CC BM3DGetFrame(
 
     auto d = static_cast<BM3DData *>(instanceData);
 
+    TraceScope trace_scope { d->trace.get(), d->trace_instance, n, activationReason };
+
     if (activationReason == arInitial) {
         int start_frame = std::max(n - d->radius, 0);
         int end_frame = std::min(n + d->radius, d->vi->numFrames - 1);
@@ -208,6 +223,8 @@ static const VSFrame *VS_CC BM3DGetFrame(
             }
         }
     } else if (activationReason == arAllFramesReady) {
+        const auto frame_start = PerfSummary::clock::now();
+
         if (auto error = cudaSetDevice(d->device_id); error != cudaSuccess) {
             vsapi->setFilterError(
                 ("BM3D: "s + cudaGetErrorString(error)).c_str(),
@@ -281,12 +298,22 @@ static const VSFrame *VS_CC BM3DGetFrame(
             );
         }
 
+        const auto wait_start = std::chrono::steady_clock::now();
         d->semaphore.acquire();
+        trace_scope.add_wait(wait_start);
+        d->perf.add_wait(PerfSummary::elapsed_ns(wait_start));
         d->resources_lock.lock();
         auto resource = std::move(d->resources.back());
         d->resources.pop_back();
         d->resources_lock.unlock();
 
+        // accumulates the time since the end of the previous stage
+        auto stage_start = PerfSummary::clock::now();
+        const auto end_stage = [&](BM3DPerfStage stage) {
+            d->perf.add_stage(stage, PerfSummary::elapsed_ns(stage_start));
+            stage_start = PerfSummary::clock::now();
+        };
+
         const auto set_error = [&](const std::string & error_message) {
             d->resources_lock.lock();
             d->resources.push_back(std::move(resource));
@@ -330,9 +357,12 @@ static const VSFrame *VS_CC BM3DGetFrame(
                 }
             }
 
+            end_stage(bm3d_stage_upload);
+
             checkError(cudaGraphLaunch(graphexec, stream));
 
             checkError(cudaStreamSynchronize(stream));
+            end_stage(bm3d_stage_kernel);
 
             float * h_dst = h_res;
             for (int plane = 0; plane < std::ssize(d->process); ++plane) {
@@ -359,6 +389,7 @@ static const VSFrame *VS_CC BM3DGetFrame(
 
                 h_dst += d_stride * height * 2 * temporal_width;
             }
+            end_stage(bm3d_stage_download);
         } else { // !d->chroma
             for (int plane = 0; plane < d->vi->format.numPlanes; plane++) {
                 if (!d->process[plane]) {
@@ -383,9 +414,12 @@ static const VSFrame *VS_CC BM3DGetFrame(
                     h_src += d_stride * height;
                 }
 
+                end_stage(bm3d_stage_upload);
+
                 checkError(cudaGraphLaunch(graphexec, stream));
 
                 checkError(cudaStreamSynchronize(stream));
+                end_stage(bm3d_stage_kernel);
 
                 float * dstp = reinterpret_cast<float *>(
                     vsapi->getWritePtr(dst.get(), plane));
@@ -402,6 +436,7 @@ static const VSFrame *VS_CC BM3DGetFrame(
                         width, height
                     );
                 }
+                end_stage(bm3d_stage_download);
             }
         }
 
@@ -419,6 +454,8 @@ static const VSFrame *VS_CC BM3DGetFrame(
             vsapi->mapSetIntArray(dst_prop, "BM3D_V_process", process, 3);
         }
 
+        d->perf.add_frame(PerfSummary::elapsed_ns(frame_start));
+
         return dst.release();
     }
 
@@ -431,6 +468,10 @@ static void VS_CC BM3DFree(
 
     auto d = static_cast<BM3DData *>(instanceData);
 
+    d->perf.report(
+        "BM3D", { "upload", "kernel", "download" }, {},
+        d->perf_path, core, vsapi);
+
     vsapi->freeNode(d->node);
     vsapi->freeNode(d->ref_node);
 
@@ -652,6 +693,11 @@ static void VS_CC BM3DCreate(
             checkError(cudaMallocHost(&h_res.data,
                 num_planes * temporal_width * 2 * max_height * d_pitch));
 
+            // device and pinned host memory
+            d->perf.add_memory(
+                ((final_ ? 2 : 1) * num_planes * temporal_width * max_height +
+                 2 * num_planes * temporal_width * 2 * max_height) * d_pitch);
+
             Resource<cudaStream_t, cudaStreamDestroy> stream {};
             checkError(cudaStreamCreateWithFlags(&stream.data,
                 cudaStreamNonBlocking));
@@ -697,6 +743,24 @@ static void VS_CC BM3DCreate(
         }
     }
 
+    if (auto trace = vsapi->mapGetData(in, "trace", 0, &error); !error) {
+        std::string error_message;
+        d->trace = TraceFile::open(trace, error_message);
+        if (!d->trace) {
+            return set_error(error_message);
+        }
+
+        VSCoreInfo core_info;
+        vsapi->getCoreInfo(core, &core_info);
+        d->trace_instance = d->trace->add_instance(
+            TraceFilter::bm3d, d->vi->numFrames, radius, width, height,
+            core_info.numThreads, num_copy_engines);
+    }
+
+    if (auto perf = vsapi->mapGetData(in, "perf", 0, &error); !error) {
+        d->perf_path = perf;
+    }
+
     VSVideoInfo vi = *d->vi;
     
     if (radius)
@@ -726,6 +790,12 @@ struct VAggregateData {
 
     std::unordered_map<std::thread::id, float *> buffer;
     std::shared_mutex buffer_lock;
+
+    std::shared_ptr<TraceFile> trace; // null if disabled
+    uint32_t trace_instance;
+
+    PerfSummary perf; // reported when the filter is freed
+    std::string perf_path; // JSON output of `perf`, empty if disabled
 };
 
 static const VSFrame *VS_CC VAggregateGetFrame(
@@ -735,6 +805,8 @@ static const VSFrame *VS_CC VAggregateGetFrame(
 
     auto * d = static_cast<VAggregateData *>(instanceData);
 
+    TraceScope trace_scope { d->trace.get(), d->trace_instance, n, activationReason };
+
     if (activationReason == arInitial) {
         int start_frame = std::max(n - d->radius, 0);
         int end_frame = std::min(n + d->radius, d->src_vi->numFrames - 1);
@@ -744,6 +816,8 @@ static const VSFrame *VS_CC VAggregateGetFrame(
         }
         vsapi->requestFrameFilter(n, d->src_node, frameCtx);
     } else if (activationReason == arAllFramesReady) {
+        const auto frame_start = PerfSummary::clock::now();
+
         const VSFrame * src_frame = vsapi->getFrameFilter(n, d->src_node, frameCtx);
 
         std::vector<const VSFrame *> vbm3d_frames;
@@ -779,6 +853,7 @@ static const VSFrame *VS_CC VAggregateGetFrame(
                 };
 
                 buffer = reinterpret_cast<float *>(std::malloc(2 * max_width * sizeof(float)));
+                d->perf.add_memory(2 * max_width * sizeof(float));
 
                 std::lock_guard _ { d->buffer_lock };
                 d->buffer.emplace(thread_id, buffer);
@@ -840,6 +915,8 @@ static const VSFrame *VS_CC VAggregateGetFrame(
         }
         vsapi->freeFrame(src_frame);
 
+        d->perf.add_frame(PerfSummary::elapsed_ns(frame_start));
+
         return dst_frame;
     }
 
@@ -856,6 +933,8 @@ static void VS_CC VAggregateFree(
         std::free(ptr);
     }
 
+    d->perf.report("VAggregate", {}, {}, d->perf_path, core, vsapi);
+
     vsapi->freeNode(d->src_node);
     vsapi->freeNode(d->node);
 
@@ -887,6 +966,26 @@ static void VS_CC VAggregateCreate(
     vsapi->getCoreInfo(core, &core_info);
     d->buffer.reserve(core_info.numThreads);
 
+    int error;
+    if (auto trace = vsapi->mapGetData(in, "trace", 0, &error); !error) {
+        std::string error_message;
+        d->trace = TraceFile::open(trace, error_message);
+        if (!d->trace) {
+            vsapi->mapSetError(out, ("VAggregate: " + error_message).c_str());
+            vsapi->freeNode(d->node);
+            vsapi->freeNode(d->src_node);
+            return ;
+        }
+
+        d->trace_instance = d->trace->add_instance(
+            TraceFilter::vaggregate, d->src_vi->numFrames, d->radius,
+            d->src_vi->width, d->src_vi->height, core_info.numThreads, 0);
+    }
+
+    if (auto perf = vsapi->mapGetData(in, "perf", 0, &error); !error) {
+        d->perf_path = perf;
+    }
+
     VSFilterDependency deps[] = {
         {d->node, rpGeneral},
         {d->src_node, rpGeneral},
@@ -962,6 +1061,14 @@ static void VS_CC BM3Dv2Create(
         }
     }
 
+    if (auto trace = vsapi->mapGetData(in, "trace", 0, &error); !error) {
+        vsapi->mapSetData(map, "trace", trace, -1, dtUtf8, maReplace);
+    }
+
+    if (auto perf = vsapi->mapGetData(in, "perf", 0, &error); !error) {
+        vsapi->mapSetData(map, "perf", perf, -1, dtUtf8, maReplace);
+    }
+
     auto map2 = vsapi->invoke(myself, "VAggregate", map);
     vsapi->freeMap(map);
     if (auto error = vsapi->mapGetError(map2); error) {
@@ -999,6 +1106,8 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
         "fast:int:opt;"
         "extractor_exp:int:opt;"
         "zero_init:int:opt;"
+        "trace:data:opt;"
+        "perf:data:opt;"
     };
 
      vspapi->registerFunction("BM3D", bm3d_args, "clip:vnode;", BM3DCreate, nullptr, plugin);
@@ -1007,7 +1116,9 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
         "VAggregate",
         "clip:vnode;"
         "src:vnode;"
-        "planes:int[];",
+        "planes:int[];"
+        "trace:data:opt;"
+        "perf:data:opt;",
         "clip:vnode;",
         VAggregateCreate, nullptr, plugin);
 
@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+"""Throughput and energy benchmark of the BM3D plugins.
+
+Each configuration (plugin, thread count and parameter set) is run in a
+separate process. Energy is read from the RAPL package and DRAM counters of
+Linux powercap (/sys/class/powercap) around the run, when available, which
+usually requires read permission of `energy_uj` (e.g. running as root).
+
+Examples:
+
+    # installed plugins
+    python3 tools/benchmark.py --engine bm3dcpu bm3dcuda --threads 4 8 \\
+        --params "sigma=3" "sigma=3,radius=2"
+
+    # SIMD backends of bm3dcpu, built with -D CPU_SIMD=...
+    python3 tools/benchmark.py --plugin avx2=build-avx2/cpu_source/libbm3dcpu.so \\
+        --plugin avx512=build-avx512/cpu_source/libbm3dcpu.so --json > results.json
+"""
+
+import argparse
+import glob
+import json
+import os
+import platform
+import re
+import socket
+import subprocess
+import sys
+import time
+
+POWERCAP = "/sys/class/powercap"
+
+
+def read_file(path):
+    try:
+        with open(path) as f:
+            return f.read().strip()
+    except OSError:
+        return None
+
+
+def rapl_domains():
+    """Returns {(package, domain name): (energy_uj path, max_energy_range_uj)}."""
+    domains = {}
+    for zone in sorted(glob.glob(os.path.join(POWERCAP, "intel-rapl:*"))):
+        name = read_file(os.path.join(zone, "name"))
+        energy = os.path.join(zone, "energy_uj")
+        max_range = read_file(os.path.join(zone, "max_energy_range_uj"))
+        if name is None or read_file(energy) is None or max_range is None:
+            continue
+        # "intel-rapl:0" is a package, "intel-rapl:0:1" is a subzone of it
+        package = os.path.basename(zone).split(":")[1]
+        domain = "package" if name.startswith("package") else name
+        domains[(package, domain)] = (energy, int(max_range))
+    return domains
+
+
+def read_energy(domains):
+    return {key: int(read_file(path)) for key, (path, _) in domains.items()}
+
+
+def energy_delta(domains, start, end):
+    """Returns joules per domain type summed over packages, handling wrap-around."""
+    joules = {}
+    for key, (_, max_range) in domains.items():
+        delta = end[key] - start[key]
+        if delta < 0:
+            delta += max_range
+        joules[key[1]] = joules.get(key[1], 0.0) + delta * 1e-6
+    return joules
+
+
+def cpu_model():
+    for line in (read_file("/proc/cpuinfo") or "").splitlines():
+        if line.startswith("model name") or line.startswith("Model"):
+            return line.split(":", 1)[1].strip()
+    return platform.processor() or platform.machine()
+
+
+def parse_params(text):
+    """Parses "sigma=3:3:0,radius=2" into keyword arguments."""
+    params = {}
+    for item in filter(None, text.split(",")):
+        key, value = item.split("=", 1)
+        values = [float(v) if "." in v else int(v) for v in value.split(":")]
+        params[key.strip()] = values if len(values) > 1 else values[0]
+    return params
+
+
+def synthetic_clip(core, format, width, height, length):
+    """Returns a deterministic textured clip, so that block-matching is not degenerate."""
+    import random
+    import vapoursynth as vs
+
+    rng = random.Random(0)
+    format = core.get_video_format(format)
+    tiles, tile_size = 16, 4
+
+    def tile():
+        color = [rng.random() - (0.5 if format.color_family == vs.YUV and plane > 0 else 0.0)
+                 for plane in range(format.num_planes)]
+        return core.std.BlankClip(format=format, width=tile_size, height=tile_size, color=color, length=1)
+
+    mosaic = core.std.StackVertical([
+        core.std.StackHorizontal([tile() for _ in range(tiles)]) for _ in range(tiles)
+    ])
+    return core.resize.Bicubic(mosaic, width, height) * length
+
+
+def run_child(config):
+    """Runs a configuration in this process and prints the result as JSON."""
+    import vapoursynth as vs
+
+    core = vs.core
+    core.num_threads = config["threads"]
+    if config.get("plugin"):
+        # the installed bm3dcpu is autoloaded by `vs.core`, so each build is
+        # loaded under its own identifier and namespace
+        core.std.LoadPlugin(
+            config["plugin"], forcens=config["engine"],
+            forceid=f"com.wolframrhodium.{config['engine']}")
+    engine = getattr(core, config["engine"])
+
+    if config.get("source"):
+        import runpy
+        runpy.run_path(config["source"], run_name="__vapoursynth__")
+        clip = vs.get_output(0)
+        clip = getattr(clip, "clip", clip)
+    else:
+        clip = synthetic_clip(
+            core, vs.PresetVideoFormat[config["format"]],
+            config["width"], config["height"], config["frames"] + config["warmup"])
+
+    params = parse_params(config["params"])
+    params.setdefault("chroma", clip.format.color_family == vs.RGB)
+    clip = engine.BM3Dv2(clip, **params)
+
+    num_frames = min(config["frames"] + config["warmup"], clip.num_frames)
+    warmup = min(config["warmup"], num_frames - 1)
+
+    # the parent measures energy between the two markers
+    for n in range(warmup):
+        clip.get_frame(n)
+    print("start", flush=True)
+    sys.stdin.readline()
+
+    start = time.perf_counter()
+    for _ in clip[warmup:num_frames].frames(prefetch=config["threads"]):
+        pass
+    seconds = time.perf_counter() - start
+
+    print("end", flush=True)
+    sys.stdin.readline()
+    print(json.dumps({"frames": num_frames - warmup, "seconds": seconds}), flush=True)
+
+
+def run(config, domains):
+    child = subprocess.Popen(
+        [sys.executable, os.path.abspath(__file__), "--child", json.dumps(config)],
+        stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True)
+
+    def expect(marker):
+        line = child.stdout.readline()
+        if line.strip() != marker:
+            child.kill()
+            raise RuntimeError(f"benchmark process failed: {line.strip() or 'no output'}")
+
+    expect("start")
+    energy_start = read_energy(domains)
+    child.stdin.write("\n")
+    child.stdin.flush()
+    expect("end")
+    energy_end = read_energy(domains)
+    child.stdin.write("\n")
+    child.stdin.flush()
+    result = json.loads(child.stdout.readline())
+    child.wait()
+
+    frames, seconds = result["frames"], result["seconds"]
+    row = {
+        "engine": config["label"],
+        "threads": config["threads"],
+        "params": config["params"],
+        "frames": frames,
+        "fps": frames / seconds,
+    }
+
+    joules = energy_delta(domains, energy_start, energy_end) if domains else {}
+    for domain in ("package", "dram"):
+        value = joules.get(domain)
+        row[f"{domain}_j_per_frame"] = value / frames if value is not None else None
+        row[f"{domain}_w"] = value / seconds if value is not None else None
+    # other domains, e.g. "core", are included in "package"
+    total = joules["package"] + joules.get("dram", 0.0) if "package" in joules else None
+    row["j_per_frame"] = total / frames if total is not None else None
+    # perf/W in (frames/s)/W, i.e. frames per joule
+    row["frames_per_j"] = frames / total if total else None
+    return row
+
+
+def print_table(rows):
+    keys = list(rows[0])
+
+    def fmt(value):
+        if value is None:
+            return "-"
+        return f"{value:.3f}" if isinstance(value, float) else str(value)
+
+    widths = [max(len(k), *(len(fmt(row[k])) for row in rows)) for k in keys]
+    print("  ".join(k.rjust(w) for k, w in zip(keys, widths)))
+    for row in rows:
+        print("  ".join(fmt(row[k]).rjust(w) for k, w in zip(keys, widths)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--engine", nargs="+", default=["bm3dcpu"],
+                        help="namespaces of installed plugins")
+    parser.add_argument("--plugin", action="append", default=[], metavar="LABEL=PATH",
+                        help="bm3dcpu build to be loaded, e.g. of another SIMD backend")
+    parser.add_argument("--threads", type=int, nargs="+", default=[os.cpu_count()])
+    parser.add_argument("--params", nargs="+", default=["sigma=3"],
+                        help="arguments of BM3Dv2(), e.g. \"sigma=3:3:0,radius=2\"")
+    parser.add_argument("--source", help="VapourSynth script whose output 0 is denoised")
+    parser.add_argument("--format", default="YUV420PS", help="format of the synthetic clip")
+    parser.add_argument("--width", type=int, default=1920)
+    parser.add_argument("--height", type=int, default=1080)
+    parser.add_argument("--frames", type=int, default=100)
+    parser.add_argument("--warmup", type=int, default=10)
+    parser.add_argument("--json", action="store_true", help="print results as JSON")
+    parser.add_argument("--child", help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.child:
+        run_child(json.loads(args.child))
+        return
+
+    engines = [(name, name, None) for name in ([] if args.plugin else args.engine)]
+    for item in args.plugin:
+        label, _, path = item.partition("=")
+        if not path:
+            label, path = os.path.splitext(os.path.basename(label))[0], label
+        namespace = "bm3dcpu_" + re.sub(r"\W", "_", label)
+        engines.append((label, namespace, path))
+
+    domains = rapl_domains()
+    if not domains:
+        print("warning: RAPL counters are not available, energy is not reported", file=sys.stderr)
+
+    rows = []
+    for label, engine, plugin in engines:
+        for threads in args.threads:
+            for params in args.params:
+                config = {
+                    "label": label, "engine": engine, "plugin": plugin,
+                    "threads": threads, "params": params, "source": args.source,
+                    "format": args.format, "width": args.width, "height": args.height,
+                    "frames": args.frames, "warmup": args.warmup,
+                }
+                print(f"running {label}, {threads} threads, {params}", file=sys.stderr)
+                rows.append(run(config, domains))
+
+    if args.json:
+        json.dump({
+            "host": socket.gethostname(),
+            "cpu": cpu_model(),
+            "rapl_domains": sorted({domain for _, domain in domains}),
+            "results": rows,
+        }, sys.stdout, indent=2)
+        print()
+    else:
+        print_table(rows)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,319 @@
+#!/usr/bin/env python3
+"""Offline analysis of request traces recorded by the `trace` parameter.
+
+    summary   per-instance statistics of a trace
+    simulate  replays a trace against a cost model under different numbers of
+              threads, scheduling policies and resource limits
+    replay    replays the requests of a trace against the actual filters of a
+              VapourSynth script under different numbers of threads
+
+The simulator assumes that instances form a linear chain in the order of
+creation, e.g. `BM3D` -> `VAggregate` as created by `BM3Dv2()`, or the
+basic/final estimation chains in the documentation, and that frame `n` of an
+instance depends on frames `n - radius` to `n + radius` of the previous one.
+"""
+
+import argparse
+import collections
+import heapq
+import json
+import struct
+import sys
+import time
+
+MAGIC = b"BM3DTRC\0"
+FILTERS = {0: "BM3D", 1: "VAggregate"}
+AR_INITIAL = 0
+
+INSTANCE = struct.Struct("<BBHIiiiiii8x")
+ACTIVATION = struct.Struct("<BbHIiIQQQ")
+
+
+class Instance:
+    def __init__(self, id, filter, num_frames, radius, width, height, num_threads, num_resources):
+        self.id = id
+        self.filter = FILTERS.get(filter, str(filter))
+        self.num_frames = num_frames
+        self.radius = radius
+        self.width = width
+        self.height = height
+        self.num_threads = num_threads
+        self.num_resources = num_resources
+        self.activations = []  # (reason, thread, n, start_ns, duration_ns, wait_ns)
+
+    def service_times(self):
+        """Returns busy time of each frame in seconds, excluding resource waits."""
+        times = collections.defaultdict(float)
+        for _, _, n, _, duration, wait in self.activations:
+            times[n] += max(duration - wait, 0) * 1e-9
+        return times
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if data[:8] != MAGIC:
+        sys.exit(f"{path}: not a trace file")
+    version, record_size = struct.unpack_from("<II", data, 8)
+    if version != 1 or record_size != ACTIVATION.size:
+        sys.exit(f"{path}: unsupported trace version {version}")
+
+    instances = {}
+    for offset in range(16, len(data) - record_size + 1, record_size):
+        if data[offset] == 0:
+            _, *fields = INSTANCE.unpack_from(data, offset)
+            filter, _, id, *rest = fields
+            instances[id] = Instance(id, filter, *rest)
+        else:
+            _, reason, thread, id, n, _, start, duration, wait = ACTIVATION.unpack_from(data, offset)
+            instances[id].activations.append((reason, thread, n, start, duration, wait))
+
+    return [instances[id] for id in sorted(instances)]
+
+
+def summary(instances):
+    results = []
+    for instance in instances:
+        times = instance.service_times()
+        activations = instance.activations
+        wait = sum(a[5] for a in activations) * 1e-9
+        busy = sum(times.values())
+        results.append({
+            "instance": instance.id,
+            "filter": instance.filter,
+            "resolution": f"{instance.width}x{instance.height}",
+            "radius": instance.radius,
+            "num_threads": instance.num_threads,
+            "num_resources": instance.num_resources,
+            "frames": len(times),
+            "activations": len(activations),
+            "threads": len({a[1] for a in activations}),
+            "busy_s": busy,
+            "wait_s": wait,
+            "mean_frame_ms": 1e3 * busy / max(len(times), 1),
+        })
+    return results
+
+
+def build_costs(instances, model, resolution):
+    """Returns a function of (instance index, frame) to the service time in seconds."""
+    costs = []
+    for instance in instances:
+        times = instance.service_times()
+        mean = sum(times.values()) / max(len(times), 1)
+        scale = 1.0
+        if resolution:
+            # cost is assumed to be proportional to the number of pixels
+            width, height = resolution
+            scale = (width * height) / (instance.width * instance.height)
+        if model == "mean":
+            costs.append(lambda n, mean=mean, scale=scale: mean * scale)
+        else:
+            costs.append(lambda n, times=times, mean=mean, scale=scale: times.get(n, mean) * scale)
+    return lambda i, n: costs[i](n)
+
+
+def simulate(instances, cost, num_frames, threads, prefetch, policy, resources):
+    """Discrete-event simulation of demand-driven frame requests on a thread pool."""
+    last = len(instances) - 1
+    state = {}  # (i, n) -> number of pending dependencies, or None once done
+    dependents = collections.defaultdict(list)
+    ready = []  # heap
+    sequence = 0
+    running = collections.Counter()  # instance -> number of running jobs
+    # maximum number of concurrent jobs of each instance, 0 if unlimited
+    limits = [
+        resources if resources is not None and inst.filter == "BM3D" else inst.num_resources
+        for inst in instances
+    ]
+
+    def make_ready(job):
+        nonlocal sequence
+        sequence += 1
+        i, n = job
+        key = {"fifo": sequence, "lifo": -sequence, "frame": (n, -i)}[policy]
+        heapq.heappush(ready, (key, sequence, job))
+
+    def request(job):
+        if job in state:
+            return
+        i, n = job
+        deps = []
+        if i > 0:
+            radius = instances[i].radius
+            frames = instances[i - 1].num_frames
+            deps = sorted({(i - 1, min(max(k, 0), frames - 1)) for k in range(n - radius, n + radius + 1)})
+        state[job] = 0
+        for dep in deps:
+            request(dep)
+            if state[dep] is not None:
+                state[job] += 1
+                dependents[dep].append(job)
+        if state[job] == 0:
+            make_ready(job)
+
+    now = 0.0
+    events = []  # (finish time, job)
+    busy = 0.0
+    latencies = []
+    requested_at = {}
+    next_output = 0
+    completed = 0
+
+    def issue():
+        nonlocal next_output
+        while next_output < num_frames and next_output - completed < prefetch:
+            requested_at[next_output] = now
+            request((last, next_output))
+            next_output += 1
+
+    issue()
+    while completed < num_frames:
+        deferred = []
+        while ready and len(events) < threads:
+            item = heapq.heappop(ready)
+            i, n = item[2]
+            if limits[i] and running[i] >= limits[i]:
+                deferred.append(item)
+                continue
+            duration = cost(i, n)
+            busy += duration
+            running[i] += 1
+            heapq.heappush(events, (now + duration, item[2]))
+        for item in deferred:
+            heapq.heappush(ready, item)
+
+        now, job = heapq.heappop(events)
+        running[job[0]] -= 1
+        state[job] = None
+        for dependent in dependents.pop(job, []):
+            state[dependent] -= 1
+            if state[dependent] == 0:
+                make_ready(dependent)
+        if job[0] == last:
+            latencies.append(now - requested_at[job[1]])
+            completed += 1
+            issue()
+
+    return {
+        "threads": threads,
+        "prefetch": prefetch,
+        "policy": policy,
+        "resources": resources,
+        "seconds": now,
+        "fps": num_frames / now if now > 0 else float("inf"),
+        "utilization": busy / (now * threads) if now > 0 else 0.0,
+        "mean_latency_ms": 1e3 * sum(latencies) / len(latencies),
+    }
+
+
+def replay(instances, script, threads_list, prefetch):
+    import runpy
+    import vapoursynth as vs
+
+    # frames of the last instance in order of request
+    order = []
+    seen = set()
+    for reason, _, n, start, _, _ in sorted(instances[-1].activations, key=lambda a: a[3]):
+        if reason == AR_INITIAL and n not in seen:
+            seen.add(n)
+            order.append(n)
+
+    runpy.run_path(script, run_name="__vapoursynth__")
+    clip = vs.get_output(0)
+    clip = getattr(clip, "clip", clip)
+
+    results = []
+    for threads in threads_list:
+        vs.core.num_threads = threads
+        window = prefetch or threads
+        pending = collections.deque()
+        start = time.perf_counter()
+        for n in order:
+            pending.append(clip.get_frame_async(n))
+            if len(pending) >= window:
+                pending.popleft().result()
+        while pending:
+            pending.popleft().result()
+        seconds = time.perf_counter() - start
+        results.append({
+            "threads": threads,
+            "prefetch": window,
+            "seconds": seconds,
+            "fps": len(order) / seconds if seconds > 0 else float("inf"),
+        })
+    return results
+
+
+def print_table(rows):
+    if not rows:
+        return
+    keys = list(rows[0])
+
+    def fmt(value):
+        return f"{value:.3f}" if isinstance(value, float) else str(value)
+
+    widths = [max(len(k), *(len(fmt(row[k])) for row in rows)) for k in keys]
+    print("  ".join(k.rjust(w) for k, w in zip(keys, widths)))
+    for row in rows:
+        print("  ".join(fmt(row[k]).rjust(w) for k, w in zip(keys, widths)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--json", action="store_true", help="print results as JSON")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    p = commands.add_parser("summary")
+    p.add_argument("trace")
+
+    p = commands.add_parser("simulate")
+    p.add_argument("trace")
+    p.add_argument("--threads", type=int, nargs="+", default=[1, 2, 4, 8, 16])
+    p.add_argument("--prefetch", type=int, help="number of output frames in flight (default: threads)")
+    p.add_argument("--policy", nargs="+", choices=["fifo", "lifo", "frame"], default=["fifo"])
+    p.add_argument("--resources", type=int, nargs="+", default=[None],
+                   help="concurrent frames per BM3D instance, e.g. 1 or 4 for `fast` of the CUDA versions "
+                        "(default: as recorded)")
+    p.add_argument("--model", choices=["trace", "mean"], default="trace",
+                   help="per-frame service times as recorded, or their mean per instance")
+    p.add_argument("--resolution", help="WxH, scales service times by the number of pixels")
+    p.add_argument("--frames", type=int, help="number of output frames (default: as recorded)")
+
+    p = commands.add_parser("replay")
+    p.add_argument("trace")
+    p.add_argument("script", help="VapourSynth script whose output 0 was traced")
+    p.add_argument("--threads", type=int, nargs="+", default=[1, 2, 4, 8, 16])
+    p.add_argument("--prefetch", type=int, help="number of output frames in flight (default: threads)")
+
+    args = parser.parse_args()
+    instances = load(args.trace)
+    if not instances:
+        sys.exit(f"{args.trace}: empty trace")
+
+    if args.command == "summary":
+        results = summary(instances)
+    elif args.command == "simulate":
+        resolution = tuple(map(int, args.resolution.split("x"))) if args.resolution else None
+        cost = build_costs(instances, args.model, resolution)
+        num_frames = args.frames or len(instances[-1].service_times())
+        num_frames = min(num_frames, instances[-1].num_frames)
+        results = [
+            simulate(instances, cost, num_frames, threads, args.prefetch or threads, policy, resources)
+            for threads in args.threads
+            for policy in args.policy
+            for resources in args.resources
+        ]
+    else:
+        results = replay(instances, args.script, args.threads, args.prefetch)
+
+    if args.json:
+        json.dump(results, sys.stdout, indent=2)
+        print()
+    else:
+        print_table(results)
+
+
+if __name__ == "__main__":
+    main()